@@ -0,0 +1,125 @@
+// BitPage.cpp - Implementation of BitPage
+
+
+#include "BitPage.h"
+
+#include <stdexcept>
+
+using namespace std;
+using namespace cv;
+
+// Set bits of one word; POPCNT where the build targets it
+static inline unsigned int popcount64( uint64_t word ) {
+#ifdef __GNUC__
+	return __builtin_popcountll( word );
+#else
+	word = word - ( ( word >> 1 ) & 0x5555555555555555ULL );
+	word = ( word & 0x3333333333333333ULL )
+		+ ( ( word >> 2 ) & 0x3333333333333333ULL );
+	word = ( word + ( word >> 4 ) ) & 0x0f0f0f0f0f0f0f0fULL;
+	return (unsigned int)( ( word * 0x0101010101010101ULL ) >> 56 );
+#endif
+}
+
+/**
+ * BitPage - Constructor, an empty page
+ */
+BitPage::BitPage()
+	: numRows( 0 ),
+	numCols( 0 ),
+	stride( 0 ) {
+}
+
+/**
+ * Pack - Packs a thresholded 8-bit image, setting the bit of every
+ *	nonzero pixel
+ */
+void BitPage::pack( const cv::Mat &binary ) {
+	CV_Assert( binary.type() == CV_8UC1 );
+	numRows = binary.rows;
+	numCols = binary.cols;
+	stride = ( numCols + 63 ) / 64;
+	// resize keeps the capacity, so a batch of scans allocates once
+	words.resize( size_t( numRows ) * stride );
+
+	for( int r = 0; r < numRows; r++ ) {
+		const uchar *pixels = binary.ptr< uchar >( r );
+		uint64_t *row = &words[ size_t( r ) * stride ];
+		for( int w = 0; w < stride; w++ ) {
+			int start = w * 64;
+			int n = min( 64, numCols - start );
+			uint64_t bits = 0;
+			for( int i = 0; i < n; i++ ) {
+				bits |= uint64_t( pixels[start + i] != 0 ) << i;
+			}
+			row[w] = bits;
+		}
+	}
+}
+
+/**
+ * Count - Number of set pixels in a region
+ */
+unsigned int BitPage::count( const cv::Rect &region ) const {
+	unsigned int samples;
+	return count( region, 1, samples );
+}
+
+/**
+ * Count - Set pixels on every step-th row and column of a region.  The
+ *	sampled columns are those of the page divisible by step, so one
+ *	mask serves every word; the sampled rows start half a step in
+ */
+unsigned int BitPage::count( const cv::Rect &region, int step,
+	unsigned int &samples ) const {
+	if( region.x < 0 || region.y < 0 || region.width < 0 || region.height < 0
+		|| region.x + region.width > numCols
+		|| region.y + region.height > numRows ) {
+		throw out_of_range( "BitPage::count: region outside the page" );
+	}
+	if( step < 1 || step > 64 || ( step & ( step - 1 ) ) != 0 ) {
+		throw invalid_argument( "BitPage::count: step must be a power of two" );
+	}
+	samples = 0;
+	if( region.width == 0 ) {
+		return 0;
+	}
+
+	uint64_t columns = ~uint64_t( 0 );
+	if( step > 1 ) {
+		columns = 0;
+		for( int i = 0; i < 64; i += step ) {
+			columns |= uint64_t( 1 ) << i;
+		}
+	}
+	int first = region.x / 64;
+	int last = ( region.x + region.width - 1 ) / 64;
+	uint64_t firstMask = ~uint64_t( 0 ) << ( region.x % 64 );
+	uint64_t lastMask = ~uint64_t( 0 ) >> ( 63 - ( region.x + region.width - 1 ) % 64 );
+	if( first == last ) {
+		firstMask &= lastMask;
+	}
+	firstMask &= columns;
+	lastMask &= columns;
+
+	// Sampled columns per sampled row
+	unsigned int rowSamples = popcount64( firstMask );
+	if( first != last ) {
+		rowSamples += ( last - first - 1 ) * popcount64( columns )
+			+ popcount64( lastMask );
+	}
+
+	unsigned int total = 0;
+	for( int r = region.y + step / 2; r < region.y + region.height; r += step ) {
+		const uint64_t *row = &words[ size_t( r ) * stride ];
+		total += popcount64( row[first] & firstMask );
+		if( first != last ) {
+			for( int w = first + 1; w < last; w++ ) {
+				total += popcount64( row[w] & columns );
+			}
+			total += popcount64( row[last] & lastMask );
+		}
+		samples += rowSamples;
+	}
+	return total;
+}
@@ -0,0 +1,65 @@
+/**
+ * BitPage - A thresholded page packed to one bit per pixel, for counting
+ *	the dark pixels of bubble cells a word at a time
+ */
+
+#ifndef BITPAGE_H_
+#define BITPAGE_H_
+
+#include <vector>
+#include <stdint.h>
+#include <opencv2/core/core.hpp>
+
+
+class BitPage {
+
+public: // Methods
+
+	/**
+	 * BitPage - Constructor, an empty page
+	 */
+	BitPage();
+
+	/**
+	 * Pack - Packs a thresholded 8-bit image, setting the bit of every
+	 *	nonzero pixel.  Rows are padded to whole 64-bit words, and the
+	 *	buffer is kept for the next page
+	 * @param	binary	CV_8UC1 image, 0 or 255 per pixel
+	 */
+	void pack( const cv::Mat &binary );
+
+	/**
+	 * Count - Number of set pixels in a region
+	 * @param	region	Must lie within the page (throws std::out_of_range)
+	 * @return	unsigned int	Set pixels
+	 */
+	unsigned int count( const cv::Rect &region ) const;
+
+	/**
+	 * Count - Set pixels on every step-th row and column of a region,
+	 *	for estimating its fill from a subsample
+	 * @param	step	A power of two up to 64; 1 counts every pixel
+	 * @param	samples	Output, pixels looked at
+	 * @return	unsigned int	Set pixels among them
+	 */
+	unsigned int count( const cv::Rect &region, int step,
+		unsigned int &samples ) const;
+
+	int rows() const { return numRows; }
+
+	int cols() const { return numCols; }
+
+private: // Members
+
+	int numRows;
+
+	int numCols;
+
+	// 64-bit words per row
+	int stride;
+
+	// Row-major; bit i of word w in a row is pixel 64 * w + i
+	std::vector< uint64_t > words;
+
+};
+#endif
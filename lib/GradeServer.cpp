@@ -0,0 +1,642 @@
+/**
+* GradeServer.cpp - Resident grading engine served over a Unix domain socket
+*/
+
+#include "GradeServer.h"
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <poll.h>
+#include <stdint.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+using namespace std;
+using namespace gsweb;
+
+typedef void* (*thread_f)(void*);
+
+namespace {
+
+    // Reads one sheet of a request on a pool worker
+    class ServerJob : public ResJob {
+
+    public:
+
+        std::string filename;
+        int index;
+        int numQuestions;
+        bool readName;
+        const ReadOptions* options;
+        SheetResult* result;
+        ResBatch* batch;
+
+        void run( ImageReader& reader, int worker )
+        {
+            reader.readSheet( filename, numQuestions, readName, *options,
+                              *result );
+            batch->done( index );
+        }
+
+    };
+
+    // Normalizes one image for display on a pool worker
+    class PrepJob : public ResJob {
+
+    public:
+
+        std::string filename;
+        std::string outname;
+        // Why the image was not normalized, REASON_NONE once it was
+        ReadReason reason;
+        ResBatch* batch;
+        const CancelToken* cancel;
+
+        void run( ImageReader& reader, int worker )
+        {
+            try {
+                reason = reader.prepShowImage( filename, outname, cancel );
+            } catch (...) {
+                reason = REASON_OPENCV_ERROR;
+            }
+            batch->done( 0 );
+        }
+
+    };
+
+    // Sequential reads from a request payload; every get fails once the
+    // payload runs out
+    class FrameReader {
+
+    public:
+
+        FrameReader( const std::string& data )
+            : data( data ),
+                pos( 0 )
+        {}
+
+        bool get( void* value, size_t n )
+        {
+            if ( data.size() - pos < n ) {
+                return false;
+            }
+            memcpy( value, data.data() + pos, n );
+            pos += n;
+            return true;
+        }
+
+        template<typename T>
+        bool get( T& value )
+        {
+            return get( &value, sizeof( value ) );
+        }
+
+        bool getString( std::string& value )
+        {
+            uint32_t n;
+            if ( !get( n ) || data.size() - pos < n ) {
+                return false;
+            }
+            value.assign( data, pos, n );
+            pos += n;
+            return true;
+        }
+
+    private:
+
+        const std::string& data;
+
+        size_t pos;
+
+    };
+
+    void put( std::string& out, const void* value, size_t n )
+    {
+        out.append( static_cast<const char*>( value ), n );
+    }
+
+    template<typename T>
+    void putValue( std::string& out, T value )
+    {
+        put( out, &value, sizeof( value ) );
+    }
+
+    template<typename T>
+    void putArray( std::string& out, const std::vector<T>& values )
+    {
+        putValue( out, uint32_t( values.size() ) );
+        if ( !values.empty() ) {
+            put( out, &values[0], values.size() * sizeof( T ) );
+        }
+    }
+
+    // Starts a reply frame; its length is filled in by sendFrame
+    void beginFrame( std::string& out, GradeServer::Reply type )
+    {
+        out.assign( sizeof( uint32_t ), '\0' );
+        putValue( out, uint8_t( type ) );
+    }
+
+    bool readAll( int fd, void* buffer, size_t n )
+    {
+        char* p = static_cast<char*>( buffer );
+        while ( n > 0 ) {
+            ssize_t got = read( fd, p, n );
+            if ( got < 0 && errno == EINTR ) {
+                continue;
+            }
+            if ( got <= 0 ) {
+                return false;
+            }
+            p += got;
+            n -= got;
+        }
+        return true;
+    }
+
+    bool sendFrame( int fd, std::string& frame )
+    {
+        uint32_t length = uint32_t( frame.size() - sizeof( uint32_t ) );
+        memcpy( &frame[0], &length, sizeof( length ) );
+        const char* p = frame.data();
+        size_t n = frame.size();
+        while ( n > 0 ) {
+            // No SIGPIPE when a client hangs up mid-reply
+            ssize_t sent = send( fd, p, n, MSG_NOSIGNAL );
+            if ( sent < 0 && errno == EINTR ) {
+                continue;
+            }
+            if ( sent <= 0 ) {
+                return false;
+            }
+            p += sent;
+            n -= sent;
+        }
+        return true;
+    }
+
+    bool sendError( int fd, const char* message )
+    {
+        std::string frame;
+        beginFrame( frame, GradeServer::REPLY_ERROR );
+        putValue( frame, uint32_t( strlen( message ) ) );
+        put( frame, message, strlen( message ) );
+        return sendFrame( fd, frame );
+    }
+
+    bool sendFailed( int fd, ReadReason reason )
+    {
+        std::string frame;
+        beginFrame( frame, GradeServer::REPLY_FAILED );
+        putValue( frame, uint8_t( reason ) );
+        return sendFrame( fd, frame );
+    }
+
+    bool sendDone( int fd, int count )
+    {
+        std::string frame;
+        beginFrame( frame, GradeServer::REPLY_DONE );
+        putValue( frame, uint32_t( count ) );
+        return sendFrame( fd, frame );
+    }
+
+    void encodeSheet( std::string& frame, int index, const SheetResult& result )
+    {
+        beginFrame( frame, GradeServer::REPLY_SHEET );
+        putValue( frame, uint32_t( index ) );
+        putValue( frame, int32_t( result.status ) );
+        putValue( frame, uint32_t( result.answers.size() ) );
+        for ( size_t q = 0; q < result.answers.size(); ++q ) {
+            putArray( frame, result.answers[q] );
+        }
+        putArray( frame, result.name );
+        putArray( frame, result.codes );
+        putArray( frame, result.confidence );
+        putArray( frame, result.ambiguousAnswers );
+        putArray( frame, result.nameCodes );
+        putArray( frame, result.nameConfidence );
+        putValue( frame, uint32_t( result.ambiguousName ) );
+        putValue( frame, uint8_t( result.reason ) );
+        putValue( frame, uint8_t( result.attempts ) );
+        putArray( frame, result.approximateAnswers );
+        putValue( frame, uint32_t( result.approximateName ) );
+    }
+
+}
+
+GradeServer::GradeServer( const std::string& socketPath, int maxQueued,
+                          int mode )
+    : socketPath( socketPath ),
+        maxQueued( maxQueued ),
+        mode( mode ),
+        listenFd( -1 ),
+        stopping( false ),
+        queued( 0 ),
+        sheetsRead( 0 ),
+        accepted( 0 )
+{
+    wakePipe[0] = wakePipe[1] = -1;
+    // Creating the shared pool here warms its workers up before the
+    // first request
+    if ( this->maxQueued < 1 ) {
+        this->maxQueued = 4 * ResPool::shared().size();
+    } else {
+        ResPool::shared();
+    }
+    pthread_mutex_init( &lock, NULL );
+    pthread_cond_init( &changed, NULL );
+}
+
+GradeServer::~GradeServer()
+{
+    if ( listenFd >= 0 ) {
+        close( listenFd );
+        unlink( socketPath.c_str() );
+    }
+    for ( int i = 0; i < 2; ++i ) {
+        if ( wakePipe[i] >= 0 ) {
+            close( wakePipe[i] );
+        }
+    }
+    pthread_cond_destroy( &changed );
+    pthread_mutex_destroy( &lock );
+}
+
+bool GradeServer::start()
+{
+    sockaddr_un addr;
+    memset( &addr, 0, sizeof( addr ) );
+    addr.sun_family = AF_UNIX;
+    if ( socketPath.size() >= sizeof( addr.sun_path ) ) {
+        errno = ENAMETOOLONG;
+        return false;
+    }
+    strcpy( addr.sun_path, socketPath.c_str() );
+
+    listenFd = socket( AF_UNIX, SOCK_STREAM, 0 );
+    if ( listenFd < 0 ) {
+        return false;
+    }
+    // A socket file nobody answers on is left over from a dead server
+    struct stat st;
+    if ( stat( socketPath.c_str(), &st ) == 0 && S_ISSOCK( st.st_mode ) ) {
+        int probe = socket( AF_UNIX, SOCK_STREAM, 0 );
+        bool live = probe >= 0
+            && connect( probe, (sockaddr*) &addr, sizeof( addr ) ) == 0;
+        if ( probe >= 0 ) {
+            close( probe );
+        }
+        if ( live ) {
+            close( listenFd );
+            listenFd = -1;
+            errno = EADDRINUSE;
+            return false;
+        }
+        unlink( socketPath.c_str() );
+    }
+    if ( bind( listenFd, (sockaddr*) &addr, sizeof( addr ) ) != 0 ) {
+        int err = errno;
+        close( listenFd );
+        listenFd = -1;
+        errno = err;
+        return false;
+    }
+    if ( chmod( socketPath.c_str(), mode ) != 0
+            || listen( listenFd, SOMAXCONN ) != 0 || pipe( wakePipe ) != 0 ) {
+        int err = errno;
+        close( listenFd );
+        listenFd = -1;
+        unlink( socketPath.c_str() );
+        errno = err;
+        return false;
+    }
+    return true;
+}
+
+void GradeServer::run()
+{
+    for ( ;; ) {
+        pollfd fds[2];
+        fds[0].fd = listenFd;
+        fds[0].events = POLLIN;
+        fds[1].fd = wakePipe[0];
+        fds[1].events = POLLIN;
+        if ( poll( fds, 2, -1 ) < 0 ) {
+            if ( errno == EINTR ) {
+                continue;
+            }
+            break;
+        }
+        if ( fds[1].revents != 0 ) {
+            break;
+        }
+        if ( ( fds[0].revents & POLLIN ) == 0 ) {
+            continue;
+        }
+        int fd = accept( listenFd, NULL, NULL );
+        if ( fd < 0 ) {
+            continue;
+        }
+        Connection* c = new Connection;
+        c->server = this;
+        c->fd = fd;
+        char tenant[32];
+        snprintf( tenant, sizeof( tenant ), "connection %u", ++accepted );
+        c->tenant = tenant;
+        pthread_mutex_lock( &lock );
+        bool accepting = !stopping;
+        if ( accepting ) {
+            connections.push_back( c );
+        }
+        pthread_mutex_unlock( &lock );
+        if ( !accepting ) {
+            close( fd );
+            delete c;
+            break;
+        }
+        if ( pthread_create( &c->thread, NULL,
+                             (thread_f) &GradeServer::implConnection, c ) ) {
+            closeConnection( c );
+        } else {
+            pthread_detach( c->thread );
+        }
+    }
+
+    close( listenFd );
+    listenFd = -1;
+    unlink( socketPath.c_str() );
+
+    stop();
+    pthread_mutex_lock( &lock );
+    while ( !connections.empty() ) {
+        pthread_cond_wait( &changed, &lock );
+    }
+    pthread_mutex_unlock( &lock );
+}
+
+void GradeServer::stop()
+{
+    pthread_mutex_lock( &lock );
+    stopping = true;
+    for ( list<Connection*>::iterator it = connections.begin();
+            it != connections.end(); ++it ) {
+        (*it)->cancelled.cancel();
+        shutdown( (*it)->fd, SHUT_RDWR );
+    }
+    pthread_cond_broadcast( &changed );
+    pthread_mutex_unlock( &lock );
+    if ( wakePipe[1] >= 0 ) {
+        char wake = 0;
+        ssize_t ignored = write( wakePipe[1], &wake, 1 );
+        (void) ignored;
+    }
+}
+
+bool GradeServer::acquireSlot( bool wait, bool interactive )
+{
+    pthread_mutex_lock( &lock );
+    while ( wait && !interactive && !stopping && queued >= maxQueued ) {
+        pthread_cond_wait( &changed, &lock );
+    }
+    bool acquired = !stopping && ( interactive || queued < maxQueued );
+    if ( acquired ) {
+        ++queued;
+    }
+    pthread_mutex_unlock( &lock );
+    return acquired;
+}
+
+void GradeServer::releaseSlot()
+{
+    pthread_mutex_lock( &lock );
+    --queued;
+    ++sheetsRead;
+    pthread_cond_broadcast( &changed );
+    pthread_mutex_unlock( &lock );
+}
+
+void GradeServer::serve( Connection* c )
+{
+    for ( ;; ) {
+        uint32_t length;
+        if ( !readAll( c->fd, &length, sizeof( length ) ) ) {
+            return;
+        }
+        if ( length == 0 || length > MAX_FRAME ) {
+            sendError( c->fd, "bad frame length" );
+            return;
+        }
+        std::string frame( length, '\0' );
+        if ( !readAll( c->fd, &frame[0], length ) ) {
+            return;
+        }
+        std::string request( frame, 1 );
+        bool ok;
+        switch ( (unsigned char) frame[0] ) {
+        case OP_READ:
+            ok = serveRead( c, request );
+            break;
+        case OP_PREP:
+            ok = servePrep( c, request );
+            break;
+        case OP_STATUS:
+            ok = serveStatus( c );
+            break;
+        default:
+            sendError( c->fd, "unknown request" );
+            ok = false;
+            break;
+        }
+        if ( !ok ) {
+            return;
+        }
+    }
+}
+
+bool GradeServer::serveRead( Connection* c, const std::string& request )
+{
+    FrameReader in( request );
+    uint8_t flags;
+    uint8_t retries;
+    uint32_t numQuestions;
+    float fillThreshold;
+    float marginThreshold;
+    float timeout;
+    uint32_t numFiles;
+    if ( !in.get( flags ) || !in.get( retries ) || !in.get( numQuestions )
+            || !in.get( fillThreshold ) || !in.get( marginThreshold )
+            || !in.get( timeout ) || !in.get( numFiles )
+            || numFiles > request.size() ) {
+        sendError( c->fd, "malformed read request" );
+        return false;
+    }
+    if ( numQuestions < 1 || numQuestions > uint32_t( MAX_QUESTIONS ) ) {
+        sendError( c->fd, "numQuestions out of range" );
+        return false;
+    }
+    int n = int( numFiles );
+    vector<ServerJob> jobs( n );
+    for ( int i = 0; i < n; ++i ) {
+        if ( !in.getString( jobs[i].filename ) ) {
+            sendError( c->fd, "malformed read request" );
+            return false;
+        }
+    }
+    uint32_t numListed;
+    if ( !in.get( numListed ) || numListed > numQuestions ) {
+        sendError( c->fd, "malformed read request" );
+        return false;
+    }
+    vector<int> questions( numListed );
+    for ( uint32_t i = 0; i < numListed; ++i ) {
+        uint32_t q;
+        if ( !in.get( q ) || q >= numQuestions ) {
+            sendError( c->fd, "malformed read request" );
+            return false;
+        }
+        questions[i] = int( q );
+    }
+
+    // Negative thresholds keep the ReadOptions defaults
+    ReadOptions options;
+    options.classify = ( flags & READ_CLASSIFY ) != 0;
+    options.warpFree = ( flags & READ_WARP_FREE ) != 0;
+    if ( flags & READ_PROFILE_FRAME ) {
+        options.frameEngine = FRAME_PROFILE;
+    }
+    options.normalized = ( flags & READ_NORMALIZED ) != 0;
+    if ( flags & READ_APPROXIMATE ) {
+        // Only classified replies say which fills are estimates
+        if ( !options.classify ) {
+            sendError( c->fd, "approximate reads must be classified" );
+            return false;
+        }
+        options.sampleStride = APPROXIMATE_STRIDE;
+    }
+    options.questions.swap( questions );
+    if ( fillThreshold >= 0 ) {
+        options.fillThreshold = fillThreshold;
+    }
+    if ( marginThreshold >= 0 ) {
+        options.marginThreshold = marginThreshold;
+    }
+    options.timeLimit = timeout;
+    options.retries = retries;
+    options.cancel = &c->cancelled;
+    bool interactive = ( flags & READ_INTERACTIVE ) != 0;
+
+    vector<SheetResult> results( n );
+    ResBatch batch( n );
+    for ( int i = 0; i < n; ++i ) {
+        jobs[i].priority = interactive ? ResJob::PRIORITY_INTERACTIVE
+            : ResJob::PRIORITY_BULK;
+        jobs[i].tenant = c->tenant;
+        jobs[i].index = i;
+        jobs[i].numQuestions = int( numQuestions );
+        jobs[i].readName = ( flags & READ_NAME ) != 0;
+        jobs[i].options = &options;
+        jobs[i].result = &results[i];
+        jobs[i].batch = &batch;
+    }
+
+    // Queue sheets while slots are free, otherwise send a finished one to
+    // free its slot.  Only wait for a slot with nothing of ours in
+    // flight, so a connection never waits on slots it holds itself.
+    ResPool& pool = ResPool::shared();
+    int submitted = 0;
+    int sent = 0;
+    bool ok = true;
+    while ( sent < submitted || ( ok && submitted < n ) ) {
+        if ( ok && submitted < n
+                && acquireSlot( sent == submitted, interactive && n == 1 ) ) {
+            pool.submit( &jobs[submitted++] );
+            continue;
+        }
+        if ( sent == submitted ) {
+            // Stopping
+            ok = false;
+            continue;
+        }
+        int i = batch.next();
+        std::string frame;
+        encodeSheet( frame, i, results[i] );
+        results[i] = SheetResult();
+        releaseSlot();
+        ++sent;
+        if ( ok && !sendFrame( c->fd, frame ) ) {
+            // Client gone: abandon the rest of its sheets
+            c->cancelled.cancel();
+            ok = false;
+        }
+    }
+    return ok && sendDone( c->fd, n );
+}
+
+bool GradeServer::servePrep( Connection* c, const std::string& request )
+{
+    FrameReader in( request );
+    PrepJob job;
+    if ( !in.getString( job.filename ) || !in.getString( job.outname ) ) {
+        sendError( c->fd, "malformed prep request" );
+        return false;
+    }
+    if ( !acquireSlot( true, true ) ) {
+        return false;
+    }
+    ResBatch batch( 1 );
+    job.priority = ResJob::PRIORITY_INTERACTIVE;
+    job.reason = REASON_NONE;
+    job.batch = &batch;
+    job.cancel = &c->cancelled;
+    ResPool::shared().submit( &job );
+    batch.join();
+    releaseSlot();
+    if ( job.reason != REASON_NONE ) {
+        return sendFailed( c->fd, job.reason );
+    }
+    return sendDone( c->fd, 1 );
+}
+
+bool GradeServer::serveStatus( Connection* c )
+{
+    std::string frame;
+    beginFrame( frame, REPLY_STATUS );
+    pthread_mutex_lock( &lock );
+    putValue( frame, uint32_t( ResPool::shared().size() ) );
+    putValue( frame, uint32_t( maxQueued ) );
+    putValue( frame, uint32_t( queued ) );
+    putValue( frame, uint32_t( connections.size() ) );
+    putValue( frame, uint32_t( sheetsRead ) );
+    pthread_mutex_unlock( &lock );
+    for ( int p = 0; p < ResJob::NUM_PRIORITIES; ++p ) {
+        QueueWaits waits = ResPool::shared().queueWaits( ResJob::Priority( p ) );
+        putValue( frame, uint32_t( waits.queued ) );
+        putValue( frame, uint32_t( waits.jobs ) );
+        putValue( frame, float( waits.jobs > 0 ? waits.totalSeconds / waits.jobs : 0 ) );
+        putValue( frame, float( waits.maxSeconds ) );
+        putValue( frame, float( waits.percentile( 0.50 ) ) );
+        putValue( frame, float( waits.percentile( 0.95 ) ) );
+        putValue( frame, float( waits.percentile( 0.99 ) ) );
+    }
+    return sendFrame( c->fd, frame );
+}
+
+void GradeServer::closeConnection( Connection* c )
+{
+    pthread_mutex_lock( &lock );
+    connections.remove( c );
+    pthread_cond_broadcast( &changed );
+    pthread_mutex_unlock( &lock );
+    close( c->fd );
+    delete c;
+}
+
+void* GradeServer::implConnection( Connection* c )
+{
+    c->server->serve( c );
+    c->server->closeConnection( c );
+    return NULL;
+}
@@ -0,0 +1,174 @@
+/**
+* GradeServer.h - Resident grading engine served over a Unix domain socket
+*
+* One server per host owns the process-wide ResPool, so every web process
+* shares one correctly sized set of warmed-up workers instead of each
+* starting its own.  Clients (see ImgprocClient.rb) send a batch of files
+* per request; sheets from all connections go onto the one pool, and at
+* most maxQueued sheets are queued or unsent at once.  A connection that
+* cannot get a slot stops being read, so a flood of requests backs up into
+* the clients' sockets instead of the server's memory.  Each connection is
+* its own tenant of the pool, so bulk sheets are taken from connections in
+* turn.  Interactive requests (OP_PREP, reads flagged READ_INTERACTIVE) go
+* ahead of queued bulk sheets; single-sheet ones may take a slot beyond
+* maxQueued, so they never wait for bulk work to drain.
+*
+* Protocol: frames of <uint32 length><uint8 type><payload>, integers and
+* floats in host byte order (the socket never leaves the host); strings
+* and arrays are a uint32 count followed by their elements.
+*
+*   OP_READ    uint8 flags (READ_NAME | READ_CLASSIFY | READ_WARP_FREE |
+*              READ_PROFILE_FRAME | READ_NORMALIZED | READ_APPROXIMATE |
+*              READ_INTERACTIVE),
+*              uint8 retries,
+*              uint32 numQuestions, float fillThreshold,
+*              float marginThreshold, float timeout (seconds, 0 = none),
+*              string[] filenames, uint32[] questions (empty for all)
+*              -> one REPLY_SHEET per file in the order they finish, then
+*                 REPLY_DONE
+*   OP_PREP    string filename, string outname -> REPLY_DONE, or
+*              REPLY_FAILED if the image could not be normalized
+*   OP_STATUS  -> REPLY_STATUS
+*
+*   REPLY_SHEET   uint32 index, int32 status, float[][] answers,
+*                 float[] name, uint8[] codes, float[] confidence,
+*                 uint32[] ambiguousAnswers, int8[] nameCodes,
+*                 float[] nameConfidence, uint32 ambiguousName,
+*                 uint8 reason (a ReadReason), uint8 attempts,
+*                 uint32[] approximateAnswers, uint32 approximateName
+*   REPLY_DONE    uint32 count
+*   REPLY_FAILED  uint8 reason (a ReadReason)
+*   REPLY_ERROR   string message; the server hangs up after a malformed
+*                 request
+*   REPLY_STATUS  uint32 workers, maxQueued, queued, connections, sheetsRead,
+*                 then for interactive and for bulk jobs: uint32 queued,
+*                 uint32 jobs, float mean, max, p50, p95, p99 (seconds
+*                 jobs waited for a pool worker)
+*/
+
+#ifndef GradeServer_H_
+#define GradeServer_H_
+
+#include <pthread.h>
+#include <string>
+#include <list>
+
+#include "ResThread.h"
+
+namespace gsweb {
+
+    class GradeServer {
+
+    public:
+
+        enum Op {
+            OP_READ = 1,
+            OP_PREP = 2,
+            OP_STATUS = 3
+        };
+
+        enum Reply {
+            REPLY_SHEET = 1,
+            REPLY_DONE = 2,
+            REPLY_ERROR = 3,
+            REPLY_STATUS = 4,
+            REPLY_FAILED = 5
+        };
+
+        enum ReadFlags {
+            READ_NAME = 1,
+            READ_CLASSIFY = 2,
+            READ_WARP_FREE = 4,
+            READ_PROFILE_FRAME = 8,
+            READ_NORMALIZED = 16,
+            // Subsample cells at APPROXIMATE_STRIDE (with READ_CLASSIFY only)
+            READ_APPROXIMATE = 32,
+            // Someone is waiting on these sheets: read them ahead of bulk
+            READ_INTERACTIVE = 64
+        };
+
+        // Largest request frame accepted; bigger ones close the connection
+        static const unsigned int MAX_FRAME = 16 << 20;
+
+        // maxQueued < 1 means four sheets per pool worker
+        GradeServer( const std::string& socketPath, int maxQueued,
+                     int mode );
+
+        virtual ~GradeServer();
+
+        // Binds and listens on the socket, replacing a stale socket file.
+        // Returns false with errno set if it cannot.
+        bool start();
+
+        // Accepts and serves connections until stop().  Returns once every
+        // connection has finished.
+        void run();
+
+        // Stops run() from any thread: cancels the sheets being read and
+        // closes every connection
+        void stop();
+
+    private:
+
+        struct Connection {
+            GradeServer* server;
+            int fd;
+            pthread_t thread;
+            // Cancel token of the sheets read for this connection, set
+            // only once the connection is ending
+            CancelToken cancelled;
+            // Pool tenant of its bulk sheets
+            std::string tenant;
+        };
+
+        std::string socketPath;
+
+        int maxQueued;
+
+        int mode;
+
+        int listenFd;
+
+        // Written by stop() to wake run()
+        int wakePipe[2];
+
+        bool stopping;
+
+        // Sheet slots in use across all connections
+        int queued;
+
+        unsigned int sheetsRead;
+
+        // Connections accepted, numbering their tenants
+        unsigned int accepted;
+
+        std::list<Connection*> connections;
+
+        pthread_mutex_t lock;
+
+        pthread_cond_t changed;
+
+        // Takes a sheet slot, waiting for one if wait is set.  An
+        // interactive sheet takes one even when all are in use.  False if
+        // none was free or the server is stopping.
+        bool acquireSlot( bool wait, bool interactive );
+
+        void releaseSlot();
+
+        void serve( Connection* c );
+
+        bool serveRead( Connection* c, const std::string& request );
+
+        bool servePrep( Connection* c, const std::string& request );
+
+        bool serveStatus( Connection* c );
+
+        void closeConnection( Connection* c );
+
+        static void* implConnection( Connection* c );
+
+    };
+
+}
+
+#endif
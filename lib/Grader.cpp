@@ -0,0 +1,172 @@
+// Grader.cpp - Implementation of Grader
+
+
+#include "Grader.h"
+
+using namespace std;
+
+
+/**
+ * ItemStats - Constructor, empty
+ */
+ItemStats::ItemStats()
+	: numSheets( 0 ),
+	sumScore( 0 ),
+	sumScoreSq( 0 ) {
+}
+
+/**
+ * Reset - Zero every sum for a test of numQuestions questions
+ */
+void ItemStats::reset( int numQuestions ) {
+	numSheets = 0;
+	sumScore = 0;
+	sumScoreSq = 0;
+	histogram.assign( numQuestions * NUM_HISTOGRAM_BINS, 0 );
+	numCorrect.assign( numQuestions, 0 );
+	sumScoreCorrect.assign( numQuestions, 0 );
+}
+
+/**
+ * Add - Accumulate another set of sums into this one
+ */
+void ItemStats::add( const ItemStats &other ) {
+	numSheets += other.numSheets;
+	sumScore += other.sumScore;
+	sumScoreSq += other.sumScoreSq;
+	for( size_t i = 0; i < histogram.size() && i < other.histogram.size(); i++ ) {
+		histogram[i] += other.histogram[i];
+	}
+	for( size_t q = 0; q < numCorrect.size() && q < other.numCorrect.size(); q++ ) {
+		numCorrect[q] += other.numCorrect[q];
+		sumScoreCorrect[q] += other.sumScoreCorrect[q];
+	}
+}
+
+/**
+ * PointBiserial - Correlation of question q with the total score:
+ *	(M1 - M) / s * sqrt( p / (1 - p) ), where M1 is the mean score of the
+ *	sheets answering correctly, M and s the mean and deviation of all
+ *	scores and p the proportion answering correctly
+ * @return	float	0 if it is undefined for this batch
+ */
+float ItemStats::pointBiserial( int q ) const {
+	if( numSheets == 0 || numCorrect[q] == 0 || numCorrect[q] == numSheets ) {
+		return 0.0f;
+	}
+	double mean = sumScore / numSheets;
+	double variance = sumScoreSq / numSheets - mean * mean;
+	if( variance <= 0 ) {
+		return 0.0f;
+	}
+	double p = double( numCorrect[q] ) / numSheets;
+	double meanCorrect = sumScoreCorrect[q] / numCorrect[q];
+	return float( ( meanCorrect - mean ) / sqrt( variance ) * sqrt( p / ( 1 - p ) ) );
+}
+
+/**
+ * Grader - Constructor
+ * @param	key	Answer key, copied
+ * @param	numQuestions	Number of questions read per sheet
+ * @param	numWorkers	Number of threads that will call grade()
+ */
+Grader::Grader( const AnswerKey &key, int numQuestions, int numWorkers )
+	: key( key ),
+	numQuestions( numQuestions ),
+	workerStats( numWorkers < 1 ? 1 : numWorkers ) {
+	for( size_t w = 0; w < workerStats.size(); w++ ) {
+		workerStats[w].resize( key.versions.size() );
+		for( size_t v = 0; v < key.versions.size(); v++ ) {
+			workerStats[w][v].reset( numQuestions );
+		}
+	}
+}
+
+/**
+ * Grade - Score one classified sheet and add it to the calling
+ *	worker's statistics.  Each worker only touches its own
+ *	accumulator, so concurrent calls need no locking
+ *
+ * @param	result	Classified sheet, score is set on it
+ * @param	version	Index of the sheet's test version
+ * @param	worker	Index of the calling worker
+ */
+void Grader::grade( SheetResult &result, int version, int worker ) {
+	if( result.status != 0 || version < 0 || version >= numVersions() ) {
+		return;
+	}
+	const vector< unsigned char > &correct = key.versions[version];
+	ItemStats &stats = workerStats[worker][version];
+	int numGraded = min( numQuestions, int( result.codes.size() ) );
+	vector< bool > isCorrect( numQuestions, false );
+	float score = 0;
+
+	for( int q = 0; q < numGraded; q++ ) {
+		unsigned char code = result.codes[q];
+		// Histogram: the single choice, blank or multiple marks
+		int bin = BIN_MULTIPLE;
+		if( code == 0 ) {
+			bin = BIN_BLANK;
+		} else if( ( code & ( code - 1 ) ) == 0 ) {
+			for( bin = 0; ( code >> bin ) != 1; bin++ );
+		}
+		stats.histogram[q * NUM_HISTOGRAM_BINS + bin]++;
+
+		if( q < int( correct.size() ) && code == correct[q] ) {
+			isCorrect[q] = true;
+			score += weight( version, q );
+		}
+	}
+	result.score = score;
+
+	// Point-biserial inputs need the finished total
+	stats.numSheets++;
+	stats.sumScore += score;
+	stats.sumScoreSq += double( score ) * score;
+	for( int q = 0; q < numGraded; q++ ) {
+		if( isCorrect[q] ) {
+			stats.numCorrect[q]++;
+			stats.sumScoreCorrect[q] += score;
+		}
+	}
+}
+
+/**
+ * MergeStats - Sum every worker's statistics, one entry per version
+ */
+void Grader::mergeStats( std::vector< ItemStats > &stats ) const {
+	stats.resize( key.versions.size() );
+	for( size_t v = 0; v < key.versions.size(); v++ ) {
+		stats[v].reset( numQuestions );
+		for( size_t w = 0; w < workerStats.size(); w++ ) {
+			stats[v].add( workerStats[w][v] );
+		}
+	}
+}
+
+/**
+ * MaxScore - Total points available on a version
+ */
+float Grader::maxScore( int version ) const {
+	float total = 0;
+	int numKeyed = min( numQuestions, int( key.versions[version].size() ) );
+	for( int q = 0; q < numKeyed; q++ ) {
+		total += weight( version, q );
+	}
+	return total;
+}
+
+int Grader::numVersions() const {
+	return int( key.versions.size() );
+}
+
+/**
+ * Weight - Points for question q of a version
+ */
+float Grader::weight( int version, int q ) const {
+	if( version < int( key.weights.size() )
+		&& q < int( key.weights[version].size() ) ) {
+		return key.weights[version][q];
+	}
+	return 1.0f;
+}
@@ -0,0 +1,126 @@
+/**
+ * Grader - Scores classified sheets against an answer key and gathers
+ *	batch item-analysis statistics
+ */
+
+#ifndef GRADER_H_
+#define GRADER_H_
+
+#include <vector>
+
+#include "ImageReader.h"
+
+// Histogram bins per question: choices A-E, then blank, then multiple marks
+static const int NUM_HISTOGRAM_BINS = 7;
+static const int BIN_BLANK = 5;
+static const int BIN_MULTIPLE = 6;
+
+
+/**
+ * AnswerKey - Correct answers (and weights) for each version of a test
+ */
+struct AnswerKey {
+
+	// Correct answer code per question, one vector per version.  Codes are
+	// the bitmasks of SheetResult::codes, so multi-answer questions work
+	std::vector< std::vector< unsigned char > > versions;
+
+	// Points per question, one vector per version.  Missing weights count 1
+	std::vector< std::vector< float > > weights;
+};
+
+/**
+ * ItemStats - Item-analysis sums for one version of a test.  Everything is
+ *	a plain count or sum so per-thread copies merge by addition
+ */
+struct ItemStats {
+
+	// Number of graded sheets
+	int numSheets;
+
+	// Sum of scores, for the mean
+	double sumScore;
+
+	// Sum of squared scores, for the standard deviation
+	double sumScoreSq;
+
+	// NUM_HISTOGRAM_BINS counts per question
+	std::vector< int > histogram;
+
+	// Sheets answering each question correctly
+	std::vector< int > numCorrect;
+
+	// Sum of the total scores of the sheets answering each question
+	//	correctly (point-biserial input)
+	std::vector< double > sumScoreCorrect;
+
+	ItemStats();
+
+	/**
+	 * Reset - Zero every sum for a test of numQuestions questions
+	 */
+	void reset( int numQuestions );
+
+	/**
+	 * Add - Accumulate another set of sums into this one
+	 */
+	void add( const ItemStats &other );
+
+	/**
+	 * PointBiserial - Correlation of question q with the total score
+	 * @return	float	0 if it is undefined for this batch
+	 */
+	float pointBiserial( int q ) const;
+};
+
+
+class Grader {
+
+public: // Methods
+
+	/**
+	 * Grader - Constructor
+	 * @param	key	Answer key, copied
+	 * @param	numQuestions	Number of questions read per sheet
+	 * @param	numWorkers	Number of threads that will call grade()
+	 */
+	Grader( const AnswerKey &key, int numQuestions, int numWorkers );
+
+	/**
+	 * Grade - Score one classified sheet and add it to the calling
+	 *	worker's statistics.  Each worker only touches its own
+	 *	accumulator, so concurrent calls need no locking
+	 *
+	 * @param	result	Classified sheet, score is set on it
+	 * @param	version	Index of the sheet's test version
+	 * @param	worker	Index of the calling worker
+	 */
+	void grade( SheetResult &result, int version, int worker );
+
+	/**
+	 * MergeStats - Sum every worker's statistics, one entry per version
+	 */
+	void mergeStats( std::vector< ItemStats > &stats ) const;
+
+	/**
+	 * MaxScore - Total points available on a version
+	 */
+	float maxScore( int version ) const;
+
+	int numVersions() const;
+
+private: // Members
+
+	AnswerKey key;
+
+	int numQuestions;
+
+	// Per worker, per version
+	std::vector< std::vector< ItemStats > > workerStats;
+
+	/**
+	 * Weight - Points for question q of a version
+	 */
+	float weight( int version, int q ) const;
+};
+#endif
@@ -4,6 +4,11 @@
  
 
 #include "ImageReader.h"
+#include "Tracer.h"
+
+#include <cstdio>
+#include <cstring>
+#include <time.h>
 
 using namespace std;
 using namespace cv;
@@ -62,6 +67,13 @@ static const float MAIN_NBOX_FIRST2MI_X_OFFSET = 80;
 static const float MAIN_NBOX_MI2LAST_X_OFFSET = 84;
 
 
+// Block size of the reading threshold
+static const int READ_THRESH_BLOCK = 51;
+// Offset of the reading threshold
+static const int READ_THRESH_OFFSET = 7;
+// Margin around a sampled region so its threshold sees a full block
+static const int SAMPLE_MARGIN = READ_THRESH_BLOCK / 2 + 1;
+
 //Macros for isRectAccurate mode
 static const int CALIB_RECT = 0;
 static const int ROTATION_BOX = 1;
@@ -78,12 +90,151 @@ static const float ROTATED_RATIO = 1;
 static const float ROTATED_RATIO_UPPER = 1.05f;
 static const float ROTATED_RATIO_LOWER = .95f;
 
+// Long side of a whole template page at 300 dpi, in pixels
+static const float TEMPLATE_LONG_SIDE = 3300.0f;
+// Pages within this fraction of the template's size are not rescaled
+//	for RUNG_TEMPLATE_SCALE
+static const float TEMPLATE_SCALE_MIN_CHANGE = 0.15f;
+
+
+// Default fill ratio for a bubble to count as marked
+static const float DEFAULT_FILL_THRESHOLD = 0.5f;
+// Default fill gap required for an unambiguous answer
+static const float DEFAULT_MARGIN_THRESHOLD = 0.15f;
+
+// Standard errors an estimated fill is allowed to be off by
+static const float APPROX_ERROR_Z = 3.0f;
+// Least variance assumed of a sampled cell, so a cell sampled all blank
+//	or all dark still gets a bound
+static const float APPROX_MIN_VARIANCE = 0.01f;
+
+
+/**
+ * ReadOptions - Defaults read raw values only
+ */
+ReadOptions::ReadOptions()
+	: classify( false ),
+	fillThreshold( DEFAULT_FILL_THRESHOLD ),
+	marginThreshold( DEFAULT_MARGIN_THRESHOLD ),
+	warpFree( false ),
+	timeLimit( 0 ),
+	frameEngine( FRAME_CONTOURS ),
+	retries( 0 ),
+	normalized( false ),
+	sampleStride( 1 ),
+	cancel( NULL ) {
+}
+
+/**
+ * PageGeometry - Empty, for the default layout
+ */
+PageGeometry::PageGeometry()
+	: width( 0 ),
+	height( 0 ),
+	widthRatio( 0 ),
+	heightRatio( 0 ),
+	layout( DEFAULT_LAYOUT ) {
+}
+
+/**
+ * SheetResult - Empty, successful result
+ */
+SheetResult::SheetResult()
+	: status( 0 ),
+	reason( REASON_NONE ),
+	attempts( 0 ),
+	ambiguousName( 0 ),
+	approximateName( 0 ),
+	score( 0 ),
+	frameEngine( FRAME_CONTOURS ) {
+	for( int i = 0; i < NUM_READ_STAGES; i++ ) {
+		stageSeconds[i] = 0;
+	}
+}
 
 /**
 	* ImageReader - Constructor
 	* @param	numQ	Number of questions on the assignment
 	*/
-ImageReader::ImageReader(){
+ImageReader::ImageReader()
+	: deadline( 0 ),
+	cancel( NULL ),
+	source( NULL ) {
+}
+
+// Median filter aperture and edge threshold block of RUNG_DESPECKLE
+static const int DESPECKLE_MEDIAN = 5;
+static const int DESPECKLE_THRESH_BLOCK = 15;
+
+// Contours examined between deadline checks
+static const int CONTOURS_PER_CHECK = 64;
+
+// Monotonic clock, in seconds
+static double monotonicSeconds() {
+	struct timespec now;
+	clock_gettime( CLOCK_MONOTONIC, &now );
+	return now.tv_sec + now.tv_nsec * 1e-9;
+}
+
+// Whether a region lies within an image of the given size
+static bool insideImage( const Rect &region, int cols, int rows ) {
+	return region.x >= 0 && region.y >= 0 && region.width >= 0
+		&& region.height >= 0 && region.x + region.width <= cols
+		&& region.y + region.height <= rows;
+}
+
+// Whether the fitted page lies within the canvas orientImage warps an exam
+//	image onto, half again its size
+static bool pageFits( const Rect &fitted, const Mat &examImage ) {
+	return insideImage( fitted, int( examImage.cols * 1.5f ),
+		int( examImage.rows * 1.5f ) );
+}
+
+// Whether a region of the upright page lies within the exam image once
+//	its corners are mapped there by transform
+static bool regionProjectsInside( const Mat &transform, const Rect &region,
+	const Mat &examImage ) {
+	std::vector< Point2f > corners( 4 );
+	corners[0] = Point2f( region.x, region.y );
+	corners[1] = Point2f( region.x + region.width, region.y );
+	corners[2] = Point2f( region.x, region.y + region.height );
+	corners[3] = Point2f( region.x + region.width, region.y + region.height );
+	std::vector< Point2f > projected;
+	perspectiveTransform( corners, projected, transform );
+	for( int i = 0; i < 4; i++ ) {
+		if( projected[i].x < 0 || projected[i].y < 0
+			|| projected[i].x > examImage.cols
+			|| projected[i].y > examImage.rows ) {
+			return false;
+		}
+	}
+	return true;
+}
+
+// Fill of a cell estimated from every step-th row and column, scaled as an
+//	exact count over boxArea would be; widens bound to its error estimate
+static float sampledFill( const BitPage &page, const Rect &cell, int step,
+	float boxArea, float &bound ) {
+	unsigned int samples;
+	unsigned int dark = page.count( cell, step, samples );
+	if( samples == 0 ) {
+		// Too small to sample: no estimate to trust
+		bound = 1.0f;
+		return 0;
+	}
+	float p = float( dark ) / samples;
+	float scale = cell.area() / boxArea;
+	float spread = APPROX_ERROR_Z
+		* sqrt( max( p * ( 1 - p ), APPROX_MIN_VARIANCE ) / samples );
+	bound = max( bound, spread * scale );
+	return p * scale;
+}
+
+// Adds the time since start to a stage of the result and restarts the clock
+static void timeStage( SheetResult &result, ReadStage stage, double &start ) {
+	double now = monotonicSeconds();
+	result.stageSeconds[stage] += float( now - start );
+	start = now;
 }
 
 /**
@@ -99,21 +250,306 @@ ImageReader::~ImageReader() {}
  * @param	filename	Name of the file to read
  * @param	numQuestions Number of questions on the test
  * @param 	readname 	Boolean to read the name or not
- * @return	vector< vector< float > >	Answer values in order, last three:
- * 
+ * @return	vector< vector< float > >	Answer values in order, last one:
+ *	Name, or the error code
  */	
 const std::vector< std::vector< float > > ImageReader::readImage( std::string &filename,
 	int numQuestions, bool readname ) {
-	// Image of the assignment
+	SheetResult result;
+	readSheet( filename, numQuestions, readname, ReadOptions(), result );
+	if( result.status != 0 ) {
+		vector< float > oops;
+		oops.push_back( float( result.status ) );
+		result.answers.push_back( oops );
+	} else {
+		result.answers.push_back( result.name );
+	}
+	return result.answers;
+}
+
+/**
+ * ReasonStatus - The SheetResult status of a failed read
+ * @param	stage	Stage the read ended in, for OpenCV errors
+ */
+static int reasonStatus( ReadReason reason, ReadStage stage ) {
+	switch( reason ) {
+	case REASON_NONE:
+		return 0;
+	case REASON_UNREADABLE_FILE:
+		return -1;
+	case REASON_NO_FRAME:
+	case REASON_NO_ORIENTATION_BOX:
+	case REASON_NO_GEOMETRY:
+		return -2;
+	case REASON_PAGE_OUT_OF_BOUNDS:
+		return -3;
+	case REASON_TIMEOUT:
+		return READ_TIMEOUT;
+	case REASON_CANCELLED:
+		return READ_CANCELLED;
+	default:
+		break;
+	}
+	if( stage == STAGE_LOAD ) {
+		return -1;
+	} else if( stage == STAGE_CALIBRATE ) {
+		return -2;
+	} else if( stage == STAGE_ORIENT ) {
+		return -3;
+	}
+	return -4;
+}
+
+// Whether another rung of the retry ladder could read a sheet that failed
+//	for this reason
+static bool retryable( ReadReason reason ) {
+	return reason != REASON_NONE && reason != REASON_UNREADABLE_FILE
+		&& reason != REASON_TIMEOUT && reason != REASON_CANCELLED
+		&& reason != REASON_NO_GEOMETRY;
+}
+
+// Scale bringing a page to the template's resolution
+static float templateScale( const Mat &examImage ) {
+	return TEMPLATE_LONG_SIDE / max( examImage.cols, examImage.rows );
+}
+
+// The rung of the retry ladder after this one that would not repeat an
+//	earlier attempt, NUM_RETRY_RUNGS if none is left
+static int nextRung( int rung, const ReadOptions &options, const Mat &loaded ) {
+	while( ++rung < NUM_RETRY_RUNGS ) {
+		// The profile engine already fell back to contours
+		if( rung == RUNG_PROFILE && options.frameEngine == FRAME_PROFILE ) {
+			continue;
+		}
+		// A page already near the template's resolution
+		if( rung == RUNG_TEMPLATE_SCALE
+			&& fabs( templateScale( loaded ) - 1 ) < TEMPLATE_SCALE_MIN_CHANGE ) {
+			continue;
+		}
+		break;
+	}
+	return rung;
+}
+
+/**
+ * ReadSheet - Reads one sheet into a SheetResult, classifying the
+ *	bubbles if the options ask for it.  A sheet that fails after loading
+ *	is read again down the retry ladder, as far as options.retries allows
+ *
+ * @param	filename	Name of the file to read
+ * @param	numQuestions Number of questions on the test
+ * @param 	readname 	Boolean to read the name or not
+ * @param	options		Per-call settings
+ * @param	result		Output, status and reason are set on failure
+ */
+void ImageReader::readSheet( std::string &filename, int numQuestions,
+	bool readname, const ReadOptions &options, SheetResult &result ) {
+	gsweb::Tracer::setSheet( filename.c_str() );
+	gsweb::TraceSpan span( "readSheet" );
+	if( options.normalized ) {
+		readNormalized( filename, numQuestions, readname, options, result );
+		return;
+	}
+	// Image of the assignment, as loaded
+	cv::Mat loaded;
+	// Fill ratios of every name letter cell
+	std::vector< std::vector< float > > letterFills( NUM_NAME_REGIONS );
+	// Stage the read is in, for errors raised by OpenCV
+	ReadStage stage = STAGE_LOAD;
+
+	result = SheetResult();
+	result.answers.resize( options.questions.empty() ? numQuestions
+		: int( options.questions.size() ) );
+	result.name.resize( NUM_NAME_REGIONS );
+	double stageStart = monotonicSeconds();
+	deadline = options.timeLimit > 0 ? stageStart + options.timeLimit : 0;
+	cancel = options.cancel;
+
+	// Failures come back as reasons; only OpenCV errors (and running out
+	//	of memory) are thrown
+	result.reason = checkDeadline();
+	if( result.reason == REASON_NONE ) {
+		try {
+			result.reason = setImage( filename, loaded );
+		} catch ( std::exception & ) {
+			result.reason = REASON_OPENCV_ERROR;
+		}
+		timeStage( result, STAGE_LOAD, stageStart );
+	}
+	// Read it, then down the ladder while another rung could help
+	if( result.reason == REASON_NONE ) {
+		int rung = RUNG_REQUESTED;
+		do {
+			result.attempts++;
+			try {
+				result.reason = readPage( loaded, RetryRung( rung ),
+					numQuestions, readname, options, result, letterFills,
+					stage, stageStart );
+			} catch ( std::exception & ) {
+				result.reason = REASON_OPENCV_ERROR;
+			}
+		} while( retryable( result.reason )
+			&& result.attempts <= options.retries
+			&& ( rung = nextRung( rung, options, loaded ) ) < NUM_RETRY_RUNGS );
+	}
+	result.status = reasonStatus( result.reason, stage );
+	if( result.status != 0 ) {
+		return;
+	}
+
+	if( !options.classify ) {
+		return;
+	}
+
+	classifySheet( options, readname, letterFills, result );
+	timeStage( result, STAGE_CLASSIFY, stageStart );
+}
+
+/**
+ * ReadSheet - Reads one sheet already in memory, as readSheet does a file
+ *
+ * @param	data	The encoded image
+ * @param	label	Names the sheet in traces
+ */
+void ImageReader::readSheet( const std::string &data, std::string &label,
+	int numQuestions, bool readname, const ReadOptions &options,
+	SheetResult &result ) {
+	source = &data;
+	readSheet( label, numQuestions, readname, options, result );
+	source = NULL;
+}
+
+/**
+ * ReadNormalized - Reads a page prepShowImage normalized, going straight
+ *	to thresholding with the geometry in its sidecar
+ *
+ * @param	filename	Normalized image; its sidecar is filename with
+ *	GEOMETRY_SUFFIX appended
+ * @param	options		As for readSheet; options.questions picks the
+ *	questions to re-read
+ */
+void ImageReader::readNormalized( std::string &filename, int numQuestions,
+	bool readname, const ReadOptions &options, SheetResult &result ) {
+	// The normalized page
 	cv::Mat examImage;
+	PageGeometry geometry;
+	// Fill ratios of every name letter cell
+	std::vector< std::vector< float > > letterFills( NUM_NAME_REGIONS );
+	// The page is already upright, so its frame starts at the origin
+	cv::Point2f UL( 0, 0 );
+	ReadStage stage = STAGE_LOAD;
+
+	result = SheetResult();
+	result.answers.resize( options.questions.empty() ? numQuestions
+		: int( options.questions.size() ) );
+	result.name.resize( NUM_NAME_REGIONS );
+	double stageStart = monotonicSeconds();
+	deadline = options.timeLimit > 0 ? stageStart + options.timeLimit : 0;
+	cancel = options.cancel;
+
+	try {
+		if( ( result.reason = checkDeadline() ) == REASON_NONE
+			&& ( result.reason = setImage( filename, examImage ) ) == REASON_NONE
+			&& !readGeometry( filename + GEOMETRY_SUFFIX, geometry ) ) {
+			result.reason = REASON_NO_GEOMETRY;
+		}
+		timeStage( result, STAGE_LOAD, stageStart );
+		if( result.reason == REASON_NONE && geometry.layout != DEFAULT_LAYOUT ) {
+			result.reason = REASON_NO_GEOMETRY;
+		}
+		if( result.reason == REASON_NONE ) {
+			result.attempts = 1;
+			// An editor may have saved the page at another size
+			float widthRatio = geometry.widthRatio * examImage.cols / geometry.width;
+			float heightRatio = geometry.heightRatio * examImage.rows / geometry.height;
+
+			stage = STAGE_THRESHOLD;
+			gsweb::TraceSpan thresholdSpan( "threshold" );
+			adaptiveThreshold( examImage, examImage, 255, 
+				ADAPTIVE_THRESH_MEAN_C, THRESH_BINARY_INV,
+				READ_THRESH_BLOCK, READ_THRESH_OFFSET );	
+			page.pack( examImage );
+			examImage.release();
+			thresholdSpan.end();
+			timeStage( result, STAGE_THRESHOLD, stageStart );
+
+			stage = STAGE_ANSWERS;
+			if( ( result.reason = checkDeadline() ) == REASON_NONE
+				&& ( result.reason = readAllAnswers( examImage, result.answers,
+					UL, widthRatio, heightRatio, numQuestions, NULL,
+					options, result.approximateAnswers ) ) == REASON_NONE ) {
+				timeStage( result, STAGE_ANSWERS, stageStart );
+				if( readname ) {
+					stage = STAGE_NAME;
+					result.reason = readName( examImage, UL, widthRatio,
+						heightRatio, result.name, letterFills, NULL, options,
+						result.approximateName );
+					timeStage( result, STAGE_NAME, stageStart );
+				}
+			}
+		}
+	} catch ( std::exception & ) {
+		result.reason = REASON_OPENCV_ERROR;
+	}
+	result.status = reasonStatus( result.reason, stage );
+	if( result.status != 0 || !options.classify ) {
+		return;
+	}
+	classifySheet( options, readname, letterFills, result );
+	timeStage( result, STAGE_CLASSIFY, stageStart );
+}
+
+/**
+ * ClassifySheet - Classifies every answer read, and the name letters if
+ *	they were read, into the result
+ */
+void ImageReader::classifySheet( const ReadOptions &options, bool readname,
+	const std::vector< std::vector< float > > &letterFills,
+	SheetResult &result ) {
+	gsweb::TraceSpan span( "classifySheet" );
+	// Classify answers and name letters
+	float confidence;
+	bool ambiguous;
+	int numAnswers = int( result.answers.size() );
+	result.codes.resize( numAnswers );
+	result.confidence.resize( numAnswers );
+	result.ambiguousAnswers.assign( ( numAnswers + 31 ) / 32, 0 );
+	for( int i = 0; i < numAnswers; i++ ) {
+		result.codes[i] = classifyAnswer( result.answers[i], options,
+			confidence, ambiguous );
+		result.confidence[i] = confidence;
+		if( ambiguous ) {
+			result.ambiguousAnswers[i / 32] |= 1u << ( i % 32 );
+		}
+	}
+	if( readname ) {
+		result.nameCodes.resize( NUM_NAME_REGIONS );
+		result.nameConfidence.resize( NUM_NAME_REGIONS );
+		for( int i = 0; i < NUM_NAME_REGIONS; i++ ) {
+			result.nameCodes[i] = classifyLetter( letterFills[i], options,
+				confidence, ambiguous );
+			result.nameConfidence[i] = confidence;
+			if( ambiguous ) {
+				result.ambiguousName |= 1u << i;
+			}
+		}
+	}
+}
+
+/**
+ * ReadPage - One attempt at a loaded sheet: finds the frame as the retry
+ *	rung says, then orients, thresholds and reads the page
+ */
+ReadReason ImageReader::readPage( const cv::Mat &loaded, RetryRung rung,
+	int numQuestions, bool readname, const ReadOptions &options,
+	SheetResult &result, std::vector< std::vector< float > > &letterFills,
+	ReadStage &stage, double &stageStart ) {
+	// Image of the assignment; orienting replaces it, not the loaded one
+	cv::Mat examImage = loaded;
 	// Ratio of exam:base image width
 	float widthRatio = 0;
 	// Ratio of exam:base image height
 	float heightRatio = 0;
-	// Array of answers
-	std::vector< std::vector< float > > answers(numQuestions);
-	// name letters
-	std::vector< float > name( 17 );
 	// Upper-left on the frame
 	cv::Point2f UL;
 	// Upper-right on the frame
@@ -122,60 +558,134 @@ const std::vector< std::vector< float > > ImageReader::readImage( std::string &f
 	cv::Point2f LL;
 	// Lower-right on the frame
 	cv::Point2f LR;
-
-	// Set the image
-	try {
-		setImage( filename, examImage );
-	} catch (...) {
-		vector< float > oops;
-		oops.push_back( -1.0f );
-		answers.push_back( oops );
-		return answers;
-	}
+	// Upright page to exam image, when reading without warping
+	cv::Mat transform;
+	cv::Mat *sampling = NULL;
+	ReadReason reason;
 
 	// Compute the calibration corner points
-	// Checks to see if image was readable or not.  If not, adds "ERR" to ans
-	// And returns
-	try {
-		findCalibCornerPoints( examImage, UL, UR, LL, LR );
-	} catch (...) {
-		vector< float > oops;
-		oops.push_back( -2.0f );
-		answers.push_back( oops );
-		return answers;
+	stage = STAGE_CALIBRATE;
+	if( ( reason = checkDeadline() ) != REASON_NONE
+		|| ( reason = findFrame( examImage, rung, options, UL, UR, LL, LR,
+			result.frameEngine ) ) != REASON_NONE ) {
+		return reason;
 	}
+	timeStage( result, STAGE_CALIBRATE, stageStart );
 
-	try {
-		// Orient the image
-		orientImage( examImage, UL, UR, LL, LR, widthRatio, heightRatio );
-	} catch (...) {
-		vector< float > oops;
-		oops.push_back( -3.0f );
-		answers.push_back( oops );
-		return answers;
+	stage = STAGE_ORIENT;
+	if( ( reason = checkDeadline() ) != REASON_NONE ) {
+		return reason;
+	}
+	if( options.warpFree ) {
+		// Only work out where the page is; regions are sampled from the
+		// exam image as they are read
+		cv::Rect fitted;
+		findOrientation( examImage, UL, UR, LL, LR, transform, fitted,
+			widthRatio, heightRatio );
+		if( !pageFits( fitted, examImage ) ) {
+			return REASON_PAGE_OUT_OF_BOUNDS;
+		}
+		transform = shiftTransform( transform, float( fitted.x ),
+			float( fitted.y ) );
+		sampling = &transform;
+		UL = Point2f( 0, 0 );
+	} else if( ( reason = orientImage( examImage, UL, UR, LL, LR,
+			widthRatio, heightRatio ) ) != REASON_NONE ) {
+		return reason;
 	}
+	timeStage( result, STAGE_ORIENT, stageStart );
 
-	try { 
-		// Threshold the image so only filled/dark spaces remain for reading
+	stage = STAGE_THRESHOLD;
+	if( ( reason = checkDeadline() ) != REASON_NONE ) {
+		return reason;
+	}
+	// Threshold the image so only filled/dark spaces remain for reading
+	if( sampling == NULL ) {
+		gsweb::TraceSpan span( "threshold" );
 		adaptiveThreshold( examImage, examImage, 255, 
-			ADAPTIVE_THRESH_MEAN_C, THRESH_BINARY_INV, 51, 7 );	
+			ADAPTIVE_THRESH_MEAN_C, THRESH_BINARY_INV,
+			READ_THRESH_BLOCK, READ_THRESH_OFFSET );	
+		// Bubbles are scored a word of pixels at a time, so the byte
+		// page is done with once packed
+		page.pack( examImage );
+		examImage.release();
+		if( ( reason = checkDeadline() ) != REASON_NONE ) {
+			return reason;
+		}
+	}
+	timeStage( result, STAGE_THRESHOLD, stageStart );
 
-		// Read answers
-		readAllAnswers( examImage, answers, 
-			UL, widthRatio, heightRatio, numQuestions );
-		// If name is to be read, read and add the name
-		// Otherwise, add a blank space (for consistency)
-		if( readname ) {
-			readName( examImage, UL, widthRatio, heightRatio, name );
+	// Read answers
+	stage = STAGE_ANSWERS;
+	if( ( reason = readAllAnswers( examImage, result.answers, 
+			UL, widthRatio, heightRatio, numQuestions, sampling,
+			options, result.approximateAnswers ) ) != REASON_NONE ) {
+		return reason;
+	}
+	timeStage( result, STAGE_ANSWERS, stageStart );
+	// If name is to be read, read and add the name
+	// Otherwise, the name stays blank (for consistency)
+	if( readname ) {
+		stage = STAGE_NAME;
+		if( ( reason = readName( examImage, UL, widthRatio, heightRatio,
+				result.name, letterFills, sampling, options,
+				result.approximateName ) ) != REASON_NONE ) {
+			return reason;
+		}
+		timeStage( result, STAGE_NAME, stageStart );
+	}
+	return REASON_NONE;
+}
+
+/**
+ * FindFrame - Finds the calibration corner points the way a rung of the
+ *	retry ladder says
+ * @param	engine	Output, the engine that found them
+ */
+ReadReason ImageReader::findFrame( cv::Mat &examImage, RetryRung rung,
+	const ReadOptions &options, cv::Point2f &UL, cv::Point2f &UR,
+	cv::Point2f &LL, cv::Point2f &LR, FrameEngine &engine ) {
+	ReadReason reason;
+	engine = FRAME_CONTOURS;
+	switch( rung ) {
+	case RUNG_REQUESTED:
+		if( options.frameEngine == FRAME_PROFILE ) {
+			reason = findFrameByProfile( examImage, UL, UR, LL, LR );
+			if( reason == REASON_NONE ) {
+				engine = FRAME_PROFILE;
+			}
+			if( reason != REASON_NO_FRAME && reason != REASON_NO_ORIENTATION_BOX ) {
+				return reason;
+			}
+		}
+		return findCalibCornerPoints( examImage, UL, UR, LL, LR, false );
+	case RUNG_PROFILE:
+		reason = findFrameByProfile( examImage, UL, UR, LL, LR );
+		if( reason == REASON_NONE ) {
+			engine = FRAME_PROFILE;
 		}
-		answers.push_back( name );
-	} catch (...) {
-        vector< float > oops;
-        oops.push_back( -4.0f );
-        answers.push_back( oops );
-        return answers;
-	}	
-	return answers;
+		return reason;
+	case RUNG_DESPECKLE:
+		return findCalibCornerPoints( examImage, UL, UR, LL, LR, true );
+	default:
+		break;
+	}
+
+	// The contour engine's size limits are in template pixels, so run it
+	//	on the page brought to the template's resolution
+	float scale = templateScale( examImage );
+	Mat rescaled;
+	resize( examImage, rescaled, Size(), scale, scale,
+		scale < 1 ? INTER_AREA : INTER_LINEAR );
+	if( ( reason = findCalibCornerPoints( rescaled, UL, UR, LL, LR, false ) )
+		!= REASON_NONE ) {
+		return reason;
+	}
+	UL *= 1 / scale;
+	UR *= 1 / scale;
+	LL *= 1 / scale;
+	LR *= 1 / scale;
+	return REASON_NONE;
 }
 
 /**
@@ -183,8 +693,13 @@ const std::vector< std::vector< float > > ImageReader::readImage( std::string &f
  * 
  * @param	filename	Name of the file to normalize
  * @param 	outname 	Name of the output file and paras
+ * @param	stop	Cancel token to give up on once set, or NULL
+ * @return	ReadReason	REASON_NONE once both files are written
  */
-const void ImageReader::prepShowImage( std::string &filename, std::string &outname ) {
+ReadReason ImageReader::prepShowImage( std::string &filename, std::string &outname,
+	const CancelToken *stop ) {
+	gsweb::Tracer::setSheet( filename.c_str() );
+	gsweb::TraceSpan span( "prepShowImage" );
 	// Image of the assignment
 	cv::Mat examImage;
 	// Ratio of exam:base image width
@@ -199,51 +714,143 @@ const void ImageReader::prepShowImage( std::string &filename, std::string &outna
 	cv::Point2f LL;
 	// Lower-right on the frame
 	cv::Point2f LR;
+	// No time limit on previews, but they can be cancelled
+	deadline = 0;
+	cancel = stop;
 
 	// Set the image
+	ReadReason reason;
 	try {
-		setImage( filename, examImage );
-		findCalibCornerPoints( examImage, UL, UR, LL, LR );
-		orientImage( examImage, UL, UR, LL, LR, widthRatio, heightRatio );
+		if( ( reason = setImage( filename, examImage ) ) != REASON_NONE
+			|| ( reason = findCalibCornerPoints( examImage, UL, UR, LL, LR,
+				false ) ) != REASON_NONE
+			|| ( reason = orientImage( examImage, UL, UR, LL, LR, widthRatio,
+				heightRatio ) ) != REASON_NONE ) {
+			return reason;
+		}
 		vector<int> compression_params;
 		compression_params.push_back( 95 );
-        imwrite(outname, examImage, compression_params);
-    } catch (...) {
-        return;
-    }
+		gsweb::TraceSpan encodeSpan( "preview encode" );
+		bool written = imwrite( outname, examImage, compression_params );
+		encodeSpan.end();
+		if( !written ) {
+			return REASON_UNWRITABLE_FILE;
+		}
+		PageGeometry geometry;
+		geometry.width = examImage.cols;
+		geometry.height = examImage.rows;
+		geometry.widthRatio = widthRatio;
+		geometry.heightRatio = heightRatio;
+		if( !writeGeometry( outname + GEOMETRY_SUFFIX, geometry ) ) {
+			return REASON_UNWRITABLE_FILE;
+		}
+	} catch ( std::exception & ) {
+		return REASON_OPENCV_ERROR;
+	}
+	return REASON_NONE;
 }
 
+// First line of a geometry sidecar, with its format version
+static const char GEOMETRY_MAGIC[] = "gsimgproc-geometry";
+static const int GEOMETRY_VERSION = 1;
+
 /**
- * SetImage - Set the image given to be the currently-used image, returns
- *	status of whether it could open it or not
+ * ReadGeometry - Loads a geometry sidecar
+ * @return	bool	False if it is missing or malformed
+ */
+bool ImageReader::readGeometry( const std::string &path, PageGeometry &geometry ) {
+	FILE *in = fopen( path.c_str(), "r" );
+	if( in == NULL ) {
+		return false;
+	}
+	char magic[32];
+	char layout[64];
+	int version = 0;
+	bool ok = fscanf( in, "%31s %d size %d %d ratios %f %f layout %63s", magic,
+		&version, &geometry.width, &geometry.height, &geometry.widthRatio,
+		&geometry.heightRatio, layout ) == 7
+		&& strcmp( magic, GEOMETRY_MAGIC ) == 0 && version == GEOMETRY_VERSION
+		&& geometry.width > 0 && geometry.height > 0
+		&& geometry.widthRatio > 0 && geometry.heightRatio > 0;
+	fclose( in );
+	if( ok ) {
+		geometry.layout = layout;
+	}
+	return ok;
+}
+
+/**
+ * WriteGeometry - Saves a geometry sidecar.  Written then renamed, so a
+ *	reader never sees half of one
+ * @return	bool	False if it could not be written
+ */
+bool ImageReader::writeGeometry( const std::string &path,
+	const PageGeometry &geometry ) {
+	std::string tmp = path + ".tmp";
+	FILE *out = fopen( tmp.c_str(), "w" );
+	if( out == NULL ) {
+		return false;
+	}
+	fprintf( out, "%s %d\nsize %d %d\nratios %.9g %.9g\nlayout %s\n",
+		GEOMETRY_MAGIC, GEOMETRY_VERSION, geometry.width, geometry.height,
+		geometry.widthRatio, geometry.heightRatio, geometry.layout.c_str() );
+	if( fclose( out ) != 0 ) {
+		remove( tmp.c_str() );
+		return false;
+	}
+	return rename( tmp.c_str(), path.c_str() ) == 0;
+}
+
+/**
+ * SetImage - Set the image given to be the currently-used image,
+ *	decoded from source instead when one is set
  *
  * @param	filename	String of the image filename
- * @return 	bool 	Whether it could be read or not
+ * @return 	ReadReason 	REASON_UNREADABLE_FILE if it could not be read
  */
-void ImageReader::setImage( std::string &filename, Mat &examImage ) {
-	examImage = imread( filename, 0 );
+ReadReason ImageReader::setImage( std::string &filename, Mat &examImage ) {
+	gsweb::TraceSpan span( "setImage" );
+	if( source != NULL ) {
+		// Wraps the bytes without copying them
+		Mat encoded( 1, int( source->size() ), CV_8UC1,
+			const_cast< char* >( source->data() ) );
+		examImage = source->empty() ? Mat() : imdecode( encoded, 0 );
+	} else {
+		examImage = imread( filename, 0 );
+	}
 	if (examImage.data == NULL) {
-		throw new Exception;
+		return REASON_UNREADABLE_FILE;
 	}
+	return REASON_NONE;
 }
 
 /**
  * FindCalibCorners - Finds and sets the calibration corner points
- * @returnsbool	True if resultant corners are readable.  False if otherwise
+ * @param	despeckle	Median filter the page and widen the edge
+ *	threshold first
+ * @return	ReadReason	REASON_NO_FRAME or REASON_NO_ORIENTATION_BOX if
+ *	the corners could not be found
  */
-void ImageReader::findCalibCornerPoints( Mat &examImage, cv::Point2f &UL, cv::Point2f &UR, 
-	cv::Point2f &LL, cv::Point2f &LR ) {
+ReadReason ImageReader::findCalibCornerPoints( Mat &examImage, cv::Point2f &UL, cv::Point2f &UR, 
+	cv::Point2f &LL, cv::Point2f &LR, bool despeckle ) {
+	gsweb::TraceSpan span( "findCalibCornerPoints" );
 	// Copy of the image, as the functions drastically modify it
 	Mat examCopy = examImage.clone();
 	// Calib box UL point
 	cv::Point boxUL;
+	ReadReason reason;
 
+	// Scanner dust and speckle break the frame's edges into pieces
+	if( despeckle ) {
+		medianBlur( examCopy, examCopy, DESPECKLE_MEDIAN );
+	}
 	// Dilates the exam image to reduce noise
 	dilate( examCopy, examCopy, Mat(), Point(-1,-1), 2 );
 	//-- 2: Smooth, also reduces noise
 	GaussianBlur( examCopy, examCopy, Size( 3, 3 ), 0, 0 );
 	// Get the image to b/w basics
-	adaptiveThreshold( examCopy, examCopy, 255, ADAPTIVE_THRESH_MEAN_C, THRESH_BINARY, 5, 10 );
+	adaptiveThreshold( examCopy, examCopy, 255, ADAPTIVE_THRESH_MEAN_C, THRESH_BINARY,
+		despeckle ? DESPECKLE_THRESH_BLOCK : 5, 10 );
 	// Dilates the exam image to reduce noise
 	erode( examCopy, examCopy, Mat(), Point(-1,-1), 1 );
 	//-- 3a: Detect edges from the (now extracted) frame by Canny method
@@ -251,6 +858,9 @@ void ImageReader::findCalibCornerPoints( Mat &examImage, cv::Point2f &UL, cv::Po
 	//-- 4: Find contours to establish the interesting marks
 	vector< vector< Point > > contours;
 	findContours( examCopy, contours, RETR_LIST, CHAIN_APPROX_SIMPLE );
+	if( ( reason = checkDeadline() ) != REASON_NONE ) {
+		return reason;
+	}
 
 	//-- 7: Finds correct contours for calib corners and sends
 	//		rectangle representation to the corner rectangle vector	
@@ -265,6 +875,11 @@ void ImageReader::findCalibCornerPoints( Mat &examImage, cv::Point2f &UL, cv::Po
 	int contoursSize = int(contours.size());
 	Point2f pts[4];
 	for ( int i = 0; i < contoursSize; i++ ) {
+		// Handwriting-heavy pages can produce enormous contour lists
+		if( i % CONTOURS_PER_CHECK == 0
+			&& ( reason = checkDeadline() ) != REASON_NONE ) {
+			return reason;
+		}
 		minArRect = minAreaRect( contours[i] );
 		area = minArRect.size.area();
 		// If high enough for large rect consideration
@@ -283,8 +898,11 @@ void ImageReader::findCalibCornerPoints( Mat &examImage, cv::Point2f &UL, cv::Po
 	}
 
 	// Readability checking
-	if( !brChosen || !crChosen ) {
-		throw new Exception;
+	if( !crChosen ) {
+		return REASON_NO_FRAME;
+	}
+	if( !brChosen ) {
+		return REASON_NO_ORIENTATION_BOX;
 	}
 	// Assign calibration points to be at the center of the image.
 	Rect box = minAreaRect( contours[boxRectIndex] ).boundingRect();
@@ -341,13 +959,373 @@ void ImageReader::findCalibCornerPoints( Mat &examImage, cv::Point2f &UL, cv::Po
 		LL = eRectPoints[2];
 		LR = eRectPoints[1];
 	}
+	return REASON_NONE;
+}
+
+// Longest side of the downsampled page the profile engine works on
+static const int PROFILE_SIZE = 800;
+// Share of the page width (height) a row (column) of ink must reach to
+//	count as part of the frame
+static const float PROFILE_EDGE_FRACTION = 0.1f;
+// Largest skew, as a slope, the profile engine searches for and accepts
+static const float PROFILE_MAX_SLOPE = 0.07f;
+// Share of each edge, from either end, left out of its line fit
+static const float PROFILE_EDGE_INSET = 0.1f;
+// Share of an edge's samples that must hit ink
+static const float PROFILE_MIN_HITS = 0.6f;
+// Samples per edge when refitting on the full-size image
+static const int PROFILE_REFINE_SAMPLES = 64;
+// Distance (downsampled pixels) beyond which a sample is refit without
+static const float PROFILE_OUTLIER = 2.0f;
+// Orientation box search region, from a frame corner along both edges,
+//	as shares of the frame's short side
+static const float PROFILE_BOX_NEAR = 0.012f;
+static const float PROFILE_BOX_FAR = 0.06f;
+// Ink share the box corner must reach, and its lead over the next corner
+static const float PROFILE_BOX_MIN_INK = 0.2f;
+static const float PROFILE_BOX_LEAD = 3.0f;
+
+/**
+ * ProfileLine - Edge line of the frame, across = a + b * along.  Horizontal
+ *	edges run along x, vertical edges along y
+ */
+struct ProfileLine {
+	float a;
+	float b;
+};
+
+// Least-squares line through the samples, then again without the ones
+//	further than PROFILE_OUTLIER from it (specks, marks touching the edge)
+static bool fitProfileLine( const vector< Point2f > &samples, ProfileLine &line ) {
+	vector< bool > used( samples.size(), true );
+	for( int pass = 0; pass < 2; pass++ ) {
+		double n = 0, sx = 0, sy = 0, sxx = 0, sxy = 0;
+		for( size_t i = 0; i < samples.size(); i++ ) {
+			if( !used[i] ) {
+				continue;
+			}
+			n++;
+			sx += samples[i].x;
+			sy += samples[i].y;
+			sxx += double( samples[i].x ) * samples[i].x;
+			sxy += double( samples[i].x ) * samples[i].y;
+		}
+		double det = n * sxx - sx * sx;
+		if( n < 2 || det == 0 ) {
+			return false;
+		}
+		line.b = float( ( n * sxy - sx * sy ) / det );
+		line.a = float( ( sy - line.b * sx ) / n );
+		for( size_t i = 0; i < samples.size(); i++ ) {
+			used[i] = fabs( line.a + line.b * samples[i].x - samples[i].y )
+				<= PROFILE_OUTLIER;
+		}
+	}
+	return true;
+}
+
+// Samples one frame edge by scanning from outside the page inwards.
+//	Each sample is (along, across): the first of two inked pixels in a row
+//	within [from, to] of the across coordinate, walking in step
+static bool fitProfileEdge( const Mat &ink, bool horizontal, int alongFrom,
+	int alongTo, int from, int to, int step, ProfileLine &line ) {
+	vector< Point2f > samples;
+	int numScanned = 0;
+	for( int along = alongFrom; along <= alongTo; along++ ) {
+		numScanned++;
+		for( int across = from; across != to; across += step ) {
+			int next = across + step;
+			bool hit = horizontal
+				? ink.at< uchar >( across, along ) && ink.at< uchar >( next, along )
+				: ink.at< uchar >( along, across ) && ink.at< uchar >( along, next );
+			if( hit ) {
+				samples.push_back( Point2f( float( along ), float( across ) ) );
+				break;
+			}
+		}
+	}
+	if( numScanned == 0 || samples.size() < PROFILE_MIN_HITS * numScanned ) {
+		return false;
+	}
+	return fitProfileLine( samples, line ) && fabs( line.b ) <= PROFILE_MAX_SLOPE;
+}
+
+// Refits an edge line on the full-size image.  The downsampled fit is only
+//	good to a downsampled pixel, so each sample rescans a few full-size
+//	pixels either side of it for the first two below the ink threshold.
+//	Keeps the downsampled line (mapped to full size) if too few samples hit
+static void refineProfileEdge( const Mat &examImage, double inkLevel,
+	float scale, bool horizontal, float alongFrom, float alongTo, int step,
+	ProfileLine &line ) {
+	int limit = horizontal ? examImage.rows : examImage.cols;
+	int window = int( 2 / scale ) + 2;
+	vector< Point2f > samples;
+	vector< float > predicted( PROFILE_REFINE_SAMPLES );
+	for( int i = 0; i < PROFILE_REFINE_SAMPLES; i++ ) {
+		float along = alongFrom + ( alongTo - alongFrom ) * i
+			/ ( PROFILE_REFINE_SAMPLES - 1 );
+		float smallAlong = ( along + 0.5f ) * scale - 0.5f;
+		float across = ( line.a + line.b * smallAlong + 0.5f ) / scale - 0.5f;
+		predicted[i] = across;
+		int from = max( 0, min( limit - 1, cvRound( across ) - step * window ) );
+		int to = max( 0, min( limit - 1, cvRound( across ) + step * window ) );
+		int x = cvRound( along );
+		for( int at = from; step > 0 ? at < to : at > to; at += step ) {
+			int next = at + step;
+			bool hit = horizontal
+				? examImage.at< uchar >( at, x ) <= inkLevel
+					&& examImage.at< uchar >( next, x ) <= inkLevel
+				: examImage.at< uchar >( x, at ) <= inkLevel
+					&& examImage.at< uchar >( x, next ) <= inkLevel;
+			if( hit ) {
+				samples.push_back( Point2f( along, float( at ) ) );
+				break;
+			}
+		}
+	}
+	ProfileLine refined;
+	if( samples.size() >= PROFILE_MIN_HITS * PROFILE_REFINE_SAMPLES
+		&& fitProfileLine( samples, refined ) ) {
+		line = refined;
+		return;
+	}
+	// Through the first and last predictions
+	line.b = ( predicted.back() - predicted.front() ) / ( alongTo - alongFrom );
+	line.a = predicted.front() - line.b * alongFrom;
+}
+
+// Where a horizontal and a vertical edge line cross
+static Point2f crossProfileLines( const ProfileLine &horizontal,
+	const ProfileLine &vertical ) {
+	// y = ha + hb x and x = va + vb y
+	float y = ( horizontal.a + horizontal.b * vertical.a )
+		/ ( 1 - horizontal.b * vertical.b );
+	return Point2f( vertical.a + vertical.b * y, y );
+}
+
+// Share of inked pixels in the square region between near and far along
+//	both edges leaving corner towards its neighbours a and b
+static float cornerInk( const Mat &ink, const Point2f &corner, const Point2f &a,
+	const Point2f &b, float shortSide ) {
+	Point2f u = a - corner;
+	Point2f v = b - corner;
+	u *= 1.0f / sqrt( u.dot( u ) );
+	v *= 1.0f / sqrt( v.dot( v ) );
+	float near = PROFILE_BOX_NEAR * shortSide;
+	float far = PROFILE_BOX_FAR * shortSide;
+	int steps = max( 4, int( far - near ) );
+	int numInked = 0;
+	int numSampled = 0;
+	for( int i = 0; i < steps; i++ ) {
+		for( int j = 0; j < steps; j++ ) {
+			Point2f p = corner + u * ( near + ( far - near ) * i / steps )
+				+ v * ( near + ( far - near ) * j / steps );
+			int x = cvRound( p.x );
+			int y = cvRound( p.y );
+			if( x < 0 || y < 0 || x >= ink.cols || y >= ink.rows ) {
+				continue;
+			}
+			numSampled++;
+			numInked += ink.at< uchar >( y, x ) != 0;
+		}
+	}
+	return numSampled == 0 ? 0 : float( numInked ) / numSampled;
+}
+
+/**
+ * FindFrameByProfile - Finds the calibration corner points from row and
+ *	column ink profiles and edge line fits on a downsampled copy, in time
+ *	linear in the image size
+ *
+ *	The profiles bound the frame: its edges are the outermost rows and
+ *	columns holding a good share of ink.  Each edge is then sampled by
+ *	scanning in from outside the page and fitted with a line, the corners
+ *	are where the lines cross, and the orientation box is the corner with
+ *	ink just inside it.  Anything unexpected (too much skew, wrong aspect
+ *	ratio, no clear box) fails validation so the contour engine can try.
+ * @return	ReadReason	REASON_NO_FRAME or REASON_NO_ORIENTATION_BOX if
+ *	the frame or box did not validate; the corner points are then unchanged
+ */
+ReadReason ImageReader::findFrameByProfile( Mat &examImage, cv::Point2f &UL,
+	cv::Point2f &UR, cv::Point2f &LL, cv::Point2f &LR ) {
+	gsweb::TraceSpan span( "findFrameByProfile" );
+	float scale = min( 1.0f,
+		float( PROFILE_SIZE ) / max( examImage.cols, examImage.rows ) );
+	Mat ink;
+	resize( examImage, ink, Size(), scale, scale, INTER_AREA );
+	double inkLevel = threshold( ink, ink, 0, 255,
+		THRESH_BINARY_INV | THRESH_OTSU );
+	ReadReason reason = checkDeadline();
+	if( reason != REASON_NONE ) {
+		return reason;
+	}
+	int width = ink.cols;
+	int height = ink.rows;
+	if( width < 16 || height < 16 ) {
+		return REASON_NO_FRAME;
+	}
+
+	// Row and column ink profiles
+	vector< int > rowInk( height, 0 );
+	vector< int > colInk( width, 0 );
+	for( int y = 0; y < height; y++ ) {
+		const uchar *row = ink.ptr< uchar >( y );
+		for( int x = 0; x < width; x++ ) {
+			if( row[x] ) {
+				rowInk[y]++;
+				colInk[x]++;
+			}
+		}
+	}
+	int top = -1, bottom = -1, left = -1, right = -1;
+	for( int y = 0; y < height; y++ ) {
+		if( rowInk[y] >= PROFILE_EDGE_FRACTION * width ) {
+			top = top < 0 ? y : top;
+			bottom = y;
+		}
+	}
+	for( int x = 0; x < width; x++ ) {
+		if( colInk[x] >= PROFILE_EDGE_FRACTION * height ) {
+			left = left < 0 ? x : left;
+			right = x;
+		}
+	}
+	if( top < 0 || left < 0 || bottom - top < height / 4
+		|| right - left < width / 4 ) {
+		return REASON_NO_FRAME;
+	}
+
+	// Fit each edge between the others, searching as far as the largest
+	//	skew could move it from where the profile put it
+	int hBand = int( PROFILE_MAX_SLOPE * ( right - left ) ) + 2;
+	int vBand = int( PROFILE_MAX_SLOPE * ( bottom - top ) ) + 2;
+	int hInset = int( PROFILE_EDGE_INSET * ( right - left ) );
+	int vInset = int( PROFILE_EDGE_INSET * ( bottom - top ) );
+	ProfileLine topLine, bottomLine, leftLine, rightLine;
+	if( !fitProfileEdge( ink, true, left + hInset, right - hInset,
+			max( 0, top - hBand ), min( height - 1, top + hBand ), 1, topLine )
+		|| !fitProfileEdge( ink, true, left + hInset, right - hInset,
+			min( height - 1, bottom + hBand ), max( 0, bottom - hBand ), -1,
+			bottomLine )
+		|| !fitProfileEdge( ink, false, top + vInset, bottom - vInset,
+			max( 0, left - vBand ), min( width - 1, left + vBand ), 1, leftLine )
+		|| !fitProfileEdge( ink, false, top + vInset, bottom - vInset,
+			min( width - 1, right + vBand ), max( 0, right - vBand ), -1,
+			rightLine ) ) {
+		return REASON_NO_FRAME;
+	}
+	// Opposite edges parallel, adjacent ones square
+	if( fabs( topLine.b - bottomLine.b ) > PROFILE_OUTLIER / ( right - left )
+			+ 0.01f
+		|| fabs( leftLine.b - rightLine.b ) > PROFILE_OUTLIER / ( bottom - top )
+			+ 0.01f
+		|| fabs( topLine.b + leftLine.b ) > 0.02f ) {
+		return REASON_NO_FRAME;
+	}
+
+	// Corners, clockwise on screen from the top left
+	Point2f corners[4];
+	corners[0] = crossProfileLines( topLine, leftLine );
+	corners[1] = crossProfileLines( topLine, rightLine );
+	corners[2] = crossProfileLines( bottomLine, rightLine );
+	corners[3] = crossProfileLines( bottomLine, leftLine );
+	float sideA = sqrt( ( corners[1] - corners[0] ).dot( corners[1] - corners[0] ) );
+	float sideB = sqrt( ( corners[3] - corners[0] ).dot( corners[3] - corners[0] ) );
+	float shortSide = min( sideA, sideB );
+	float ratio = shortSide / max( sideA, sideB );
+	if( ratio < CALIB_RATIO_LOWER || ratio > CALIB_RATIO_UPPER
+		|| sideA * sideB * ACCURACY_MODIFIER < MAIN_FRAME_MIN_THRESH * scale * scale / 4 ) {
+		return REASON_NO_FRAME;
+	}
+
+	// The orientation box marks the upper-left corner
+	float boxInk[4];
+	int boxCorner = 0;
+	for( int i = 0; i < 4; i++ ) {
+		boxInk[i] = cornerInk( ink, corners[i], corners[( i + 1 ) % 4],
+			corners[( i + 3 ) % 4], shortSide );
+		if( boxInk[i] > boxInk[boxCorner] ) {
+			boxCorner = i;
+		}
+	}
+	for( int i = 0; i < 4; i++ ) {
+		if( i != boxCorner && boxInk[i] * PROFILE_BOX_LEAD > boxInk[boxCorner] ) {
+			return REASON_NO_ORIENTATION_BOX;
+		}
+	}
+	if( boxInk[boxCorner] < PROFILE_BOX_MIN_INK ) {
+		return REASON_NO_ORIENTATION_BOX;
+	}
+
+	// Refit the edges at full size, between the same insets
+	float fLeft = ( left + hInset + 0.5f ) / scale - 0.5f;
+	float fRight = ( right - hInset + 0.5f ) / scale - 0.5f;
+	float fTop = ( top + vInset + 0.5f ) / scale - 0.5f;
+	float fBottom = ( bottom - vInset + 0.5f ) / scale - 0.5f;
+	refineProfileEdge( examImage, inkLevel, scale, true, fLeft, fRight, 1,
+		topLine );
+	refineProfileEdge( examImage, inkLevel, scale, true, fLeft, fRight, -1,
+		bottomLine );
+	refineProfileEdge( examImage, inkLevel, scale, false, fTop, fBottom, 1,
+		leftLine );
+	refineProfileEdge( examImage, inkLevel, scale, false, fTop, fBottom, -1,
+		rightLine );
+	corners[0] = crossProfileLines( topLine, leftLine );
+	corners[1] = crossProfileLines( topLine, rightLine );
+	corners[2] = crossProfileLines( bottomLine, rightLine );
+	corners[3] = crossProfileLines( bottomLine, leftLine );
+
+	// Clockwise from the box, as the contour engine orders them
+	Point2f found[4];
+	for( int i = 0; i < 4; i++ ) {
+		found[i] = corners[( boxCorner + i ) % 4];
+	}
+	UL = found[0];
+	UR = found[1];
+	LR = found[2];
+	LL = found[3];
+	return REASON_NONE;
 }
 
 /**
  * OrientImage - Readjust image orientation to be correctly upright
+ * @return	ReadReason	REASON_PAGE_OUT_OF_BOUNDS if the fitted page leaves
+ *	the warped image
  */
-void ImageReader::orientImage( cv::Mat &examImage, cv::Point2f &UL, cv::Point2f &UR, 
+ReadReason ImageReader::orientImage( cv::Mat &examImage, cv::Point2f &UL, cv::Point2f &UR, 
 	cv::Point2f &LL, cv::Point2f &LR, float &widthRatio, float &heightRatio ) {
+	gsweb::TraceSpan span( "orientImage" );
+	// Perspective transform and the page's place in the warped image
+	Mat warp_matrix;
+	Rect rect;
+	findOrientation( examImage, UL, UR, LL, LR, warp_matrix, rect,
+		widthRatio, heightRatio );
+	if( !pageFits( rect, examImage ) ) {
+		return REASON_PAGE_OUT_OF_BOUNDS;
+	}
+	Size warpedSize( examImage.cols * 1.5f, examImage.rows * 1.5f );
+	// Prepare the clone, & warp
+	warpPerspective( examImage.clone(), examImage, warp_matrix,
+	 warpedSize, WARP_INVERSE_MAP );
+	// Resize examImage to only have coordinate values
+	Mat fittedImage = examImage( rect );
+	examImage = fittedImage;
+	// Reassign points
+	UL = Point2f( 0, 0 );
+	UR = Point2f( rect.width, 0 );
+	LL = Point2f( 0, rect.height );
+	LR = Point2f( rect.width, rect.height );
+	return REASON_NONE;
+}
+
+/**
+ * FindOrientation - Computes the perspective transform from the upright
+ *	page canvas to the exam image, the fitted page within that canvas
+ *	and the page size ratios, without warping anything
+ */
+void ImageReader::findOrientation( cv::Mat &examImage, cv::Point2f &UL, cv::Point2f &UR, 
+	cv::Point2f &LL, cv::Point2f &LR, cv::Mat &transform, cv::Rect &fitted,
+	float &widthRatio, float &heightRatio ) {
 	// Set up lengths and widths
 	float vLength = sqrt( pow( abs(LL.x - UL.x), 2 ) + pow( abs(LL.y - UL.y), 2 ) );
 	float hLength = sqrt( pow( abs(UR.x - UL.x), 2 ) + pow( abs(UR.y - UL.y), 2 ) );
@@ -379,30 +1357,62 @@ void ImageReader::orientImage( cv::Mat &examImage, cv::Point2f &UL, cv::Point2f
 	dstQuad[ 1 ] = UR;
 	dstQuad[ 2 ] = LL;
 	dstQuad[ 3 ] = LR;
-	// Calc perspective transform, prepare the clone, & warp
-	Mat warp_matrix = getPerspectiveTransform( srcQuad, dstQuad );
-	warpPerspective( examImage.clone(), examImage, warp_matrix,
-	 Size(examImage.cols * 1.5f, examImage.rows * 1.5f), WARP_INVERSE_MAP );
-	// Resize examImage to only have coordinate values
-	Rect rect( srcQuad[0], srcQuad[3] );
-	Mat fittedImage = examImage( rect );
-	examImage = fittedImage;
+	// Calc perspective transform
+	transform = getPerspectiveTransform( srcQuad, dstQuad );
+	// The page's place in the upright canvas
+	fitted = Rect( srcQuad[0], srcQuad[3] );
 	// Recalculates size ratios
-	widthRatio = examImage.cols / (mainUR.x - mainUL.x);
-	heightRatio = examImage.rows / (mainLL.y - mainUL.y);
-	// Reassign points
-	UL = Point2f( 0, 0 );
-	UR = Point2f( hLength, 0 );
-	LL = Point2f( 0, vLength );
-	LR = Point2f( hLength, vLength );
+	widthRatio = fitted.width / (mainUR.x - mainUL.x);
+	heightRatio = fitted.height / (mainLL.y - mainUL.y);
+}
+
+/**
+ * ShiftTransform - Returns transform applied after moving the input by
+ *	(dx, dy), so its origin lands on that point
+ */
+cv::Mat ImageReader::shiftTransform( const cv::Mat &transform, float dx, float dy ) {
+	Mat shifted = transform.clone();
+	for( int r = 0; r < 3; r++ ) {
+		shifted.at<double>( r, 2 ) = transform.at<double>( r, 0 ) * dx
+			+ transform.at<double>( r, 1 ) * dy + transform.at<double>( r, 2 );
+	}
+	return shifted;
+}
+
+/**
+ * SampleRegion - Warps one region of the upright page, with a margin
+ *	for thresholding, straight out of the exam image and thresholds it
+ * @param	transform	Upright page to exam image transform
+ * @param	cell	Output, thresholded region
+ */
+void ImageReader::sampleRegion( cv::Mat &examImage, const cv::Mat &transform,
+	cv::Rect &region, cv::Mat &cell ) {
+	Mat regionTransform = shiftTransform( transform,
+		float( region.x - SAMPLE_MARGIN ), float( region.y - SAMPLE_MARGIN ) );
+	Mat warped;
+	warpPerspective( examImage, warped, regionTransform,
+		Size( region.width + 2 * SAMPLE_MARGIN, region.height + 2 * SAMPLE_MARGIN ),
+		INTER_LINEAR | WARP_INVERSE_MAP );
+	adaptiveThreshold( warped, warped, 255, ADAPTIVE_THRESH_MEAN_C,
+		THRESH_BINARY_INV, READ_THRESH_BLOCK, READ_THRESH_OFFSET );
+	cell = warped( Rect( SAMPLE_MARGIN, SAMPLE_MARGIN,
+		region.width, region.height ) );
 }
 
 /**
- * ReadAllAnswers - Manages finding answer regions, then reads each
+ * ReadAllAnswers - Manages finding answer regions, then reads each.  When
+ *	subsampling, a question whose estimate is too close to call is read
+ *	again in full; the rest stay estimates
+ * @return	ReadReason	REASON_REGION_OUT_OF_BOUNDS if a question box
+ *	leaves the page (the exam image, sampled through transform)
  */
-void ImageReader::readAllAnswers( cv::Mat &examImage, 
+ReadReason ImageReader::readAllAnswers( cv::Mat &examImage, 
 	std::vector< std::vector< float > > &answers, cv::Point2f &UL,
-	float &widthRatio, float &heightRatio, int &numQuestions ) {
+	float &widthRatio, float &heightRatio, int &numQuestions,
+	const cv::Mat *transform, const ReadOptions &options,
+	std::vector< unsigned int > &approximate ) {
+	gsweb::TraceSpan span( "readAllAnswers" );
+	const std::vector< int > &questions = options.questions;
 
 	// QBox regions
 	std::vector< cv::Rect > answerRegions(numQuestions);	
@@ -416,10 +1426,47 @@ void ImageReader::readAllAnswers( cv::Mat &examImage,
 	for( int a = 0; a < 6; a++ ) refCols[a] = distWidth * a;
 	float boxArea = distWidth * answerRegions[0].height;
 
-	for( int i = 0; i < numQuestions; i++ ) {
-		answers[i] =  readAnswer( examImage, answerRegions[i],
-			refCols, boxArea, qHeight );
+	ReadReason reason;
+	int numAnswers = questions.empty() ? numQuestions : int( questions.size() );
+	approximate.assign( ( numAnswers + 31 ) / 32, 0 );
+	int step = options.sampleStride;
+	float bound;
+	for( int i = 0; i < numAnswers; i++ ) {
+		if( ( reason = checkDeadline() ) != REASON_NONE ) {
+			return reason;
+		}
+		int q = questions.empty() ? i : questions[i];
+		if( q < 0 || q >= numQuestions ) {
+			return REASON_REGION_OUT_OF_BOUNDS;
+		}
+		const BitPage *source = &page;
+		Rect region = answerRegions[q];
+		if( transform != NULL ) {
+			if( !regionProjectsInside( *transform, answerRegions[q], examImage ) ) {
+				return REASON_REGION_OUT_OF_BOUNDS;
+			}
+			// Sample just this box out of the unwarped image
+			Mat cell;
+			sampleRegion( examImage, *transform, answerRegions[q], cell );
+			region = Rect( 0, 0, answerRegions[q].width, answerRegions[q].height );
+			cellPage.pack( cell );
+			source = &cellPage;
+		} else if( !insideImage( answerRegions[q], page.cols(), page.rows() ) ) {
+			return REASON_REGION_OUT_OF_BOUNDS;
+		}
+		answers[i] = readAnswer( *source, region, refCols, boxArea, qHeight,
+			step, bound );
+		if( step == 1 ) {
+			continue;
+		}
+		if( answerSettled( answers[i], bound, options ) ) {
+			approximate[i / 32] |= 1u << ( i % 32 );
+		} else {
+			answers[i] = readAnswer( *source, region, refCols, boxArea, qHeight,
+				1, bound );
+		}
 	}
+	return REASON_NONE;
 }
 
 /**
@@ -477,45 +1524,38 @@ void ImageReader::findAnswerRegions( cv::Mat &examImage,
  * @param	region	QBox
  * @return	vector<float>	The read results in the answer subregions 
  */
-std::vector< float > ImageReader::readAnswer( cv::Mat &examImage, 
-	cv::Rect &region, int refCols[6], float &boxArea, float &qHeight ) {
+std::vector< float > ImageReader::readAnswer( const BitPage &page, 
+	cv::Rect &region, int refCols[6], float &boxArea, float &qHeight,
+	int step, float &bound ) {
 	//Set up a projection for each of the five possible answer choices
 	std::vector< float > answer( 5 );
-	//Set the ROI for the image copy
-	Mat answerROI = examImage( region );
-	// Number of dark spots in an image region
-	float darkCount;
-	// Scalar value of the pixel at chosen location
-	Scalar intensity;
-	// Start column value for a subregion
-	int startCol;
-	// End column value for a subregion
-	int endCol;
+	bound = 0;
 
 	//For each subdivision
 	for( int a = 0; a < 5; a++ ) {
-		// Resets the darkCount to zero and recalculates column locations
-		darkCount = 0;
-		startCol = refCols[a];
-		endCol = refCols[a+1];
-		// Iterates through each column (by width)
-		for( int col = startCol; col < endCol; col++ ) {
-			// Iterates through each row (by height)
-			for( int row = 0; row < qHeight; row++ ) {
-				// Sets the intensity as the value of the pixel at that location
-				darkCount += Scalar(answerROI.at<uchar>(row, col)).val[0];
-			}
+		// Dark pixels in the subregion's columns, over the full height
+		Rect choice( region.x + refCols[a], region.y,
+			refCols[a+1] - refCols[a], int( qHeight ) );
+		if( step == 1 ) {
+			answer[a] = page.count( choice )/boxArea;
+		} else {
+			answer[a] = sampledFill( page, choice, step, boxArea, bound );
 		}
-		answer[a] = ( (darkCount/255)/boxArea );
 	}
 	return answer;
 }
 
 /**
  * ReadName - Read the name from the name boxes
+ * @return	ReadReason	REASON_REGION_OUT_OF_BOUNDS if a letter column
+ *	leaves the page (the exam image, sampled through transform)
  */
-void ImageReader::readName( cv::Mat &examImage, cv::Point2f &UL,
-	float &widthRatio, float &heightRatio, std::vector< float > &name ) {
+ReadReason ImageReader::readName( cv::Mat &examImage, cv::Point2f &UL,
+	float &widthRatio, float &heightRatio, std::vector< float > &name,
+	std::vector< std::vector< float > > &letterFills,
+	const cv::Mat *transform, const ReadOptions &options,
+	unsigned int &approximate ) {
+	gsweb::TraceSpan span( "readName" );
 	// Name letter regions
 	std::vector< cv::Rect > nameLetterRegions(NUM_NAME_REGIONS);	
 	findNameLetterRegions( examImage, nameLetterRegions,
@@ -527,10 +1567,44 @@ void ImageReader::readName( cv::Mat &examImage, cv::Point2f &UL,
 	float boxArea = nameLetterRegions[0].width * distHeight;
 	float qWidth = nameLetterRegions[0].width;
 
+	ReadReason reason;
+	approximate = 0;
+	int step = options.sampleStride;
+	float bound;
 	for(  int i = 0; i < NUM_NAME_REGIONS; i++ ) {
-		name[i] = readNameLetter( examImage, nameLetterRegions[i],
-			refCols, boxArea, qWidth );
+		if( ( reason = checkDeadline() ) != REASON_NONE ) {
+			return reason;
+		}
+		const BitPage *source = &page;
+		Rect region = nameLetterRegions[i];
+		if( transform != NULL ) {
+			if( !regionProjectsInside( *transform, nameLetterRegions[i],
+				examImage ) ) {
+				return REASON_REGION_OUT_OF_BOUNDS;
+			}
+			// Sample just this column out of the unwarped image
+			Mat cell;
+			sampleRegion( examImage, *transform, nameLetterRegions[i], cell );
+			region = Rect( 0, 0, nameLetterRegions[i].width,
+				nameLetterRegions[i].height );
+			cellPage.pack( cell );
+			source = &cellPage;
+		} else if( !insideImage( nameLetterRegions[i], page.cols(), page.rows() ) ) {
+			return REASON_REGION_OUT_OF_BOUNDS;
+		}
+		name[i] = readNameLetter( *source, region, refCols, boxArea, qWidth,
+			letterFills[i], step, bound );
+		if( step == 1 ) {
+			continue;
+		}
+		if( letterSettled( letterFills[i], bound, options ) ) {
+			approximate |= 1u << i;
+		} else {
+			name[i] = readNameLetter( *source, region, refCols, boxArea, qWidth,
+				letterFills[i], 1, bound );
+		}
 	}
+	return REASON_NONE;
 }
 
 /**
@@ -589,46 +1663,146 @@ void ImageReader::findNameLetterRegions( cv::Mat &examImage,
  * @return	float	The region with the highest concentration of writing.  
  * 	The location index is the integer in front of the decimal point
  */
-float ImageReader::readNameLetter( cv::Mat &examImage,
+float ImageReader::readNameLetter( const BitPage &page,
 	cv::Rect &region, int refCols[27], float &boxArea,
-	float &qWidth ) {
-	//Set up a projection for each of the five possible letter choices
-	float letter;
-	//Set the ROI for the image copy
-	Mat letterROI = examImage( region );
-	// Number of dark spots in an image region
-	float darkCount;
-	// Scalar value of the pixel at chosen location
-	Scalar intensity;
-	// Start column value for a subregion
-	int startRow;
-	// End column value for a subregion
-	int endRow;
-
-	float highestCount = 0; 
+	float &qWidth, std::vector< float > &fills, int step, float &bound ) {
+	//Set up a projection for each of the 26 possible letter choices
+	fills.resize( 26 );
+	bound = 0;
+
+	float highestFill = 0; 
 	int highestIndex = 0;
 
 	//For each subdivision
 	for( int a = 0; a < 26; a++ ) {
-		// Resets the darkCount to zero and recalculates column locations
-		darkCount = 0;
-		startRow = refCols[a];
-		endRow = refCols[a+1];
-		// Iterates through each column (by width)
-		for( int col = 0; col < qWidth; col++ ) {
-			// Iterates through each row (by height)
-			for( int row = startRow; row < endRow; row++ ) {
-				// Sets the intensity as the value of the pixel at that location
-				darkCount += Scalar(letterROI.at<uchar>(row, col)).val[0];
-			}
+		// Dark pixels in the subregion's rows, over the full width
+		Rect letter( region.x, region.y + refCols[a],
+			int( qWidth ), refCols[a+1] - refCols[a] );
+		if( step == 1 ) {
+			fills[a] = page.count( letter )/boxArea;
+		} else {
+			fills[a] = sampledFill( page, letter, step, boxArea, bound );
 		}
 		// Checks to see if it accurately corresponds with an answer region
-		if( darkCount > highestCount ) {
-			highestCount = darkCount;
+		if( fills[a] > highestFill ) {
+			highestFill = fills[a];
 			highestIndex = a;
 		}
 	}
-	return ((highestCount/255)/boxArea + highestIndex);
+	return ( highestFill + highestIndex );
+}
+
+/**
+ * ClassifyAnswer - Choose the selected choices of one question.  Every
+ *	choice at or over the fill threshold is selected; the question is
+ *	ambiguous when more than one is selected or the gap between the
+ *	weakest selected and strongest unselected fill is under the margin.
+ *	A blank question measures its gap from the fill threshold instead.
+ * @param	fills	Fill ratio of each choice
+ * @return	unsigned char	Bit a set for each selected choice a
+ */
+unsigned char ImageReader::classifyAnswer( const std::vector< float > &fills,
+	const ReadOptions &options, float &confidence, bool &ambiguous ) {
+	unsigned char code = 0;
+	int numSelected = 0;
+	float weakestSelected = 1.0f;
+	float strongestUnselected = 0.0f;
+	int numFills = int( fills.size() );
+
+	for( int a = 0; a < numFills; a++ ) {
+		if( fills[a] >= options.fillThreshold ) {
+			code |= (unsigned char)( 1 << a );
+			numSelected++;
+			weakestSelected = min( weakestSelected, fills[a] );
+		} else {
+			strongestUnselected = max( strongestUnselected, fills[a] );
+		}
+	}
+	if( numSelected == 0 ) {
+		weakestSelected = options.fillThreshold;
+	}
+	confidence = max( 0.0f, min( 1.0f, weakestSelected - strongestUnselected ) );
+	ambiguous = numSelected > 1 || confidence < options.marginThreshold;
+	return code;
+}
+
+/**
+ * ClassifyLetter - Choose the letter of one name column.  The strongest
+ *	cell is the letter if it reaches the fill threshold; the column is
+ *	ambiguous when a second cell also reaches it or the gap to the
+ *	runner-up (or to the threshold, for a blank) is under the margin.
+ * @param	fills	Fill ratio of each of the 26 letter cells
+ * @return	int	Letter index 0-25, or -1 if blank
+ */
+int ImageReader::classifyLetter( const std::vector< float > &fills,
+	const ReadOptions &options, float &confidence, bool &ambiguous ) {
+	int highestIndex = -1;
+	float highest = 0.0f;
+	float second = 0.0f;
+	int numFills = int( fills.size() );
+
+	for( int a = 0; a < numFills; a++ ) {
+		if( highestIndex < 0 || fills[a] > highest ) {
+			second = highestIndex < 0 ? 0.0f : highest;
+			highest = fills[a];
+			highestIndex = a;
+		} else if( fills[a] > second ) {
+			second = fills[a];
+		}
+	}
+	if( highestIndex < 0 || highest < options.fillThreshold ) {
+		confidence = max( 0.0f, options.fillThreshold - highest );
+		ambiguous = confidence < options.marginThreshold;
+		return -1;
+	}
+	confidence = min( 1.0f, highest - second );
+	ambiguous = second >= options.fillThreshold
+		|| confidence < options.marginThreshold;
+	return highestIndex;
+}
+
+/**
+ * AnswerSettled - Whether estimated fills, each within bound of the exact
+ *	ones, are sure to classify as the exact fills would.  No fill may be
+ *	within bound of the fill threshold, so the same choices are selected,
+ *	and the confidence, a difference of two fills, may not be within
+ *	twice the bound of the margin
+ */
+bool ImageReader::answerSettled( const std::vector< float > &fills,
+	float bound, const ReadOptions &options ) {
+	int numFills = int( fills.size() );
+	for( int a = 0; a < numFills; a++ ) {
+		if( fabs( fills[a] - options.fillThreshold ) <= bound ) {
+			return false;
+		}
+	}
+	float confidence;
+	bool ambiguous;
+	classifyAnswer( fills, options, confidence, ambiguous );
+	return fabs( confidence - options.marginThreshold ) > 2 * bound;
+}
+
+/**
+ * LetterSettled - As answerSettled, for a name column.  A marked column
+ *	also needs its top two fills more than twice the bound apart, so the
+ *	same cell comes out on top
+ */
+bool ImageReader::letterSettled( const std::vector< float > &fills,
+	float bound, const ReadOptions &options ) {
+	int numFills = int( fills.size() );
+	for( int a = 0; a < numFills; a++ ) {
+		if( fabs( fills[a] - options.fillThreshold ) <= bound ) {
+			return false;
+		}
+	}
+	float confidence;
+	bool ambiguous;
+	if( classifyLetter( fills, options, confidence, ambiguous ) < 0 ) {
+		// The gap to the threshold; one fill, so one bound
+		return fabs( confidence - options.marginThreshold ) > bound;
+	}
+	return confidence > 2 * bound
+		&& fabs( confidence - options.marginThreshold ) > 2 * bound;
 }
 
 /**
@@ -657,3 +1831,17 @@ bool ImageReader::isRectAccurate( cv::RotatedRect &rect, const int &mode ) {
  	}
  	return false;
  }
+
+/**
+ * CheckDeadline - Whether the current sheet has run out of time or its
+ *	batch was cancelled
+ */
+ReadReason ImageReader::checkDeadline() {
+	if( cancel != NULL && cancel->cancelled() ) {
+		return REASON_CANCELLED;
+	}
+	if( deadline > 0 && monotonicSeconds() > deadline ) {
+		return REASON_TIMEOUT;
+	}
+	return REASON_NONE;
+}
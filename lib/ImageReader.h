@@ -16,6 +16,245 @@
 #include <opencv2/imgproc/imgproc.hpp>
 #include <opencv2/highgui/highgui.hpp>
 
+#include "BitPage.h"
+
+
+// Status of a sheet abandoned because it ran past its time limit
+static const int READ_TIMEOUT = -5;
+// Status of a sheet abandoned because its batch was cancelled
+static const int READ_CANCELLED = -6;
+
+// Stages of readSheet, timed in SheetResult::stageSeconds
+enum ReadStage {
+	STAGE_LOAD,
+	STAGE_CALIBRATE,
+	STAGE_ORIENT,
+	STAGE_THRESHOLD,
+	STAGE_ANSWERS,
+	STAGE_NAME,
+	STAGE_CLASSIFY,
+	NUM_READ_STAGES
+};
+
+// ReadOptions::sampleStride of the approximate reading mode
+static const int APPROXIMATE_STRIDE = 4;
+
+// How readSheet finds the calibration frame
+enum FrameEngine {
+	// Canny edges and a full contour sweep
+	FRAME_CONTOURS,
+	// Ink projection profiles and edge line fits on a downsampled page,
+	//	falling back to FRAME_CONTOURS when the result does not validate
+	FRAME_PROFILE
+};
+
+// Why a sheet could not be read, in SheetResult::reason.  Each maps to one
+//	SheetResult::status, so callers that only know the status still work
+enum ReadReason {
+	REASON_NONE,
+	// Missing, or not an image (status -1)
+	REASON_UNREADABLE_FILE,
+	// No calibration frame found (-2)
+	REASON_NO_FRAME,
+	// A frame but no orientation box in it (-2)
+	REASON_NO_ORIENTATION_BOX,
+	// The fitted page does not lie within the image (-3)
+	REASON_PAGE_OUT_OF_BOUNDS,
+	// An answer or name region does not lie within the page (-4)
+	REASON_REGION_OUT_OF_BOUNDS,
+	// READ_TIMEOUT
+	REASON_TIMEOUT,
+	// READ_CANCELLED
+	REASON_CANCELLED,
+	// OpenCV raised an error or memory ran out; the status of the stage
+	//	it happened in
+	REASON_OPENCV_ERROR,
+	// prepShowImage could not write the normalized image or its sidecar
+	REASON_UNWRITABLE_FILE,
+	// A normalized image without a usable geometry sidecar (-2)
+	REASON_NO_GEOMETRY,
+	NUM_READ_REASONS
+};
+
+// Ways of finding the frame of the retry ladder, cheapest first.  A sheet
+//	whose frame, page or regions could not be found is read again on the
+//	next rung, up to ReadOptions::retries times
+enum RetryRung {
+	// ReadOptions::frameEngine, the first read
+	RUNG_REQUESTED,
+	// FRAME_PROFILE, when FRAME_CONTOURS was requested
+	RUNG_PROFILE,
+	// Contours after a median filter and a wider edge threshold, for
+	//	speckled or dusty scans
+	RUNG_DESPECKLE,
+	// Contours on the page rescaled to the template's resolution, for
+	//	scans far from 300 dpi
+	RUNG_TEMPLATE_SCALE,
+	NUM_RETRY_RUNGS
+};
+
+/**
+ * CancelToken - Cancel flag of one batch: set from any thread (cancel, an
+ *	interrupt, a stopping server) and polled by the batch's sheets
+ */
+class CancelToken {
+
+public:
+
+	CancelToken() : flag( 0 ) {}
+
+	void cancel() {
+		__sync_fetch_and_or( &flag, 1 );
+	}
+
+	bool cancelled() const {
+		return __sync_fetch_and_add( &flag, 0 ) != 0;
+	}
+
+private:
+
+	mutable volatile int flag;
+};
+
+/**
+ * ReadOptions - Per-call settings for readSheet
+ */
+struct ReadOptions {
+
+	// Choose marked bubbles and name letters natively (fills SheetResult codes)
+	bool classify;
+
+	// Minimum fill ratio for a bubble or letter cell to count as marked
+	float fillThreshold;
+
+	// Minimum gap between the weakest selected and the strongest unselected
+	// fill for a question or letter to be unambiguous
+	float marginThreshold;
+
+	// Sample each answer and letter region through the page transform
+	// instead of warping and thresholding the whole page
+	bool warpFree;
+
+	// Seconds a sheet may take before it is abandoned, 0 for no limit
+	double timeLimit;
+
+	// Frame detector to try first
+	FrameEngine frameEngine;
+
+	// Rungs of the retry ladder to try after a failed read, 0 for none.
+	//	Rungs that would repeat an earlier attempt are skipped
+	int retries;
+
+	// The files are pages prepShowImage normalized: read them with their
+	//	geometry sidecars instead of finding and warping the frame
+	bool normalized;
+
+	// Questions to read (0-based) in the order to list them, say those a
+	//	teacher edited on a normalized page; empty for every question
+	std::vector< int > questions;
+
+	// Score cells on every sampleStride-th row and column (a power of two
+	//	up to 16), rescoring exactly each question or letter whose
+	//	estimate is too close to call; 1 scores every pixel.  A stroke
+	//	between the sampled rows and columns goes unseen, so the codes
+	//	match an exact read with high probability, not always
+	int sampleStride;
+
+	// Batch cancel token: the sheet is abandoned once it is set
+	const CancelToken *cancel;
+
+	ReadOptions();
+};
+
+// Suffix of the geometry sidecar prepShowImage writes next to its image
+static const char GEOMETRY_SUFFIX[] = ".geom";
+
+// Layout id of the one answer sheet layout readSheet knows
+static const char DEFAULT_LAYOUT[] = "default";
+
+// Most questions the default layout has room for (four columns of 25)
+static const int MAX_QUESTIONS = 100;
+
+/**
+ * PageGeometry - What readNormalized needs to know about a page that
+ *	prepShowImage normalized, kept in its geometry sidecar
+ */
+struct PageGeometry {
+
+	// Size of the normalized image, in pixels
+	int width;
+	int height;
+
+	// Ratio of the normalized page to the template, as orientImage found
+	float widthRatio;
+	float heightRatio;
+
+	// Layout id of the sheet
+	std::string layout;
+
+	PageGeometry();
+};
+
+/**
+ * SheetResult - Everything read from one sheet
+ */
+struct SheetResult {
+
+	// 0 on success, otherwise the readImage error code (-1 to -4),
+	//	READ_TIMEOUT or READ_CANCELLED
+	int status;
+
+	// Why the sheet failed, REASON_NONE on success
+	ReadReason reason;
+
+	// Reads of the sheet, 1 if the first settled it and 0 if it could
+	//	not be loaded
+	int attempts;
+
+	// Raw fill ratios, five per question (per ReadOptions::questions
+	//	entry, if it lists any)
+	std::vector< std::vector< float > > answers;
+
+	// Raw name letters (letter index + fill ratio), zeros when not read
+	std::vector< float > name;
+
+	// Classified answers: bit a set if choice a is selected, 0 for blank
+	std::vector< unsigned char > codes;
+
+	// Fill gap between weakest selected and strongest unselected choice
+	std::vector< float > confidence;
+
+	// Bit (q % 32) of word (q / 32) set if question q is ambiguous
+	std::vector< unsigned int > ambiguousAnswers;
+
+	// Classified name letters: 0-25, or -1 for a blank letter
+	std::vector< signed char > nameCodes;
+
+	// Fill gap of each letter, as for confidence
+	std::vector< float > nameConfidence;
+
+	// Bit i set if name letter i is ambiguous
+	unsigned int ambiguousName;
+
+	// Bit (q % 32) of word (q / 32) set if the fills (and so the
+	//	confidence) of question q are subsample estimates, not exact
+	std::vector< unsigned int > approximateAnswers;
+
+	// Bit i set if the fills of name letter i are estimates
+	unsigned int approximateName;
+
+	// Points scored against the answer key, when graded
+	float score;
+
+	// Wall time spent in each ReadStage
+	float stageSeconds[NUM_READ_STAGES];
+
+	// Frame detector that found the frame
+	FrameEngine frameEngine;
+
+	SheetResult();
+};
+
 
 class ImageReader {
 
@@ -40,53 +279,180 @@ public: // Methods
 	 * @param	filename	Name of the file to read
 	 * @param	numQuestions Number of questions on the test
 	 * @param 	readname 	Boolean to read the name or not
-	 * @return	vector< vector< float > >	Answer values in order, last three:
-	 *	Name, ambiguousAnswers, ambiguousName (ambiguous letters from name)
+	 * @return	vector< vector< float > >	Answer values in order, last one:
+	 *	Name (letter index + ratio each), or the single error code on failure
 	 * 
 	 */
 	const std::vector< std::vector< float > > 
 		readImage( std::string &filename, int numQuestions, bool readname );
 
+	/**
+	 * ReadSheet - Reads one sheet into a SheetResult, classifying the
+	 *	bubbles if the options ask for it
+	 *
+	 * @param	filename	Name of the file to read
+	 * @param	numQuestions Number of questions on the test
+	 * @param 	readname 	Boolean to read the name or not
+	 * @param	options		Per-call settings
+	 * @param	result		Output, status and reason are set on failure
+	 */
+	void readSheet( std::string &filename, int numQuestions, bool readname,
+		const ReadOptions &options, SheetResult &result );
+
+	/**
+	 * ReadSheet - Reads one sheet already in memory, as readSheet does a
+	 *	file.  Not for options.normalized, whose geometry is in a file
+	 *
+	 * @param	data	The encoded image (PNG, JPEG, PGM, ...)
+	 * @param	label	Names the sheet in traces
+	 */
+	void readSheet( const std::string &data, std::string &label,
+		int numQuestions, bool readname, const ReadOptions &options,
+		SheetResult &result );
+
+	/**
+	 * ReadNormalized - Reads a page prepShowImage normalized (and a
+	 *	teacher may since have edited), going straight to thresholding
+	 *	with the geometry in its sidecar.  readSheet calls this for
+	 *	options.normalized
+	 *
+	 * @param	filename	Normalized image; its sidecar is filename
+	 *	with GEOMETRY_SUFFIX appended
+	 * @param	options		As for readSheet; options.questions picks the
+	 *	questions to re-read.  warpFree and retries do not apply
+	 */
+	void readNormalized( std::string &filename, int numQuestions,
+		bool readname, const ReadOptions &options, SheetResult &result );
+
+	/**
+	 * ReadGeometry - Loads a geometry sidecar
+	 * @return	bool	False if it is missing or malformed
+	 */
+	static bool readGeometry( const std::string &path, PageGeometry &geometry );
 
 	/**
-	 * prepShowImage - Save normalized image to be viewable for modification
+	 * WriteGeometry - Saves a geometry sidecar, replacing any old one whole
+	 * @return	bool	False if it could not be written
+	 */
+	static bool writeGeometry( const std::string &path,
+		const PageGeometry &geometry );
+
+
+	/**
+	 * prepShowImage - Save normalized image to be viewable for modification,
+	 *	with a geometry sidecar (outname with GEOMETRY_SUFFIX appended) so
+	 *	readNormalized can read it back without calibrating
 	 * 
 	 * @param	filename	Name of the file to normalize
 	 * @param 	outname 	Name of the output file and paras
+	 * @param	stop	Cancel token to give up on once set, or NULL
+	 * @return	ReadReason	REASON_NONE once both files are written, why
+	 *	not otherwise
 	 */
-	const void prepShowImage( std::string &filename, std::string &outname );
+	ReadReason prepShowImage( std::string &filename, std::string &outname,
+		const CancelToken *stop );
 
 private: // Methods
 
 	/**
-	 * SetImage - Set the image given to be the currently-used image, returns
-	 *	status of whether it could open it or not
+	 * ReadPage - One attempt at a loaded sheet: finds the frame as the
+	 *	retry rung says, then orients, thresholds and reads the page
+	 * @param	loaded	The sheet as loaded; left unchanged
+	 * @param	stage	Output, the stage the attempt ended in
+	 * @return	ReadReason	REASON_NONE if the sheet was read
+	 */
+	ReadReason readPage( const cv::Mat &loaded, RetryRung rung,
+		int numQuestions, bool readname, const ReadOptions &options,
+		SheetResult &result, std::vector< std::vector< float > > &letterFills,
+		ReadStage &stage, double &stageStart );
+
+	/**
+	 * FindFrame - Finds the calibration corner points the way a rung of
+	 *	the retry ladder says
+	 */
+	ReadReason findFrame( cv::Mat &examImage, RetryRung rung,
+		const ReadOptions &options, cv::Point2f &UL, cv::Point2f &UR,
+		cv::Point2f &LL, cv::Point2f &LR, FrameEngine &engine );
+
+	/**
+	 * SetImage - Set the image given to be the currently-used image,
+	 *	decoded from source instead when one is set
 	 *
 	 * @param	filename	String of the image filename
-	 * @return 	bool 	Whether it could be read or not
+	 * @return 	ReadReason 	REASON_UNREADABLE_FILE if it could not be read
 	 */
-	void setImage( std::string &filename, cv::Mat &examImage );
+	ReadReason setImage( std::string &filename, cv::Mat &examImage );
 
 	/**
 	 * FindCalibCorners - Finds and sets the calibration corner points
-	 * @returnsbool	True if resultant corners are readable.  False if otherwise
+	 * @param	despeckle	Median filter the page and widen the edge
+	 *	threshold first
+	 * @return	ReadReason	REASON_NO_FRAME or REASON_NO_ORIENTATION_BOX
+	 *	if the corners could not be found
 	 */
-	void findCalibCornerPoints( cv::Mat &examImage,
+	ReadReason findCalibCornerPoints( cv::Mat &examImage,
+	 cv::Point2f &UL, cv::Point2f &UR, cv::Point2f &LL, cv::Point2f &LR,
+	 bool despeckle );
+
+	/**
+	 * FindFrameByProfile - Finds the calibration corner points from row
+	 *	and column ink profiles and edge line fits on a downsampled copy,
+	 *	in time linear in the image size
+	 * @return	ReadReason	REASON_NO_FRAME or REASON_NO_ORIENTATION_BOX
+	 *	if the frame or box did not validate; the corner points are then
+	 *	unchanged
+	 */
+	ReadReason findFrameByProfile( cv::Mat &examImage,
 	 cv::Point2f &UL, cv::Point2f &UR, cv::Point2f &LL, cv::Point2f &LR );
 
 	/**
 	 * OrientImage - Readjust image orientation to be correctly upright
+	 * @return	ReadReason	REASON_PAGE_OUT_OF_BOUNDS if the fitted page
+	 *	leaves the warped image
 	 */
-	void orientImage( cv::Mat &examImage, cv::Point2f &UL, cv::Point2f &UR, 
+	ReadReason orientImage( cv::Mat &examImage, cv::Point2f &UL, cv::Point2f &UR, 
 		cv::Point2f &LL, cv::Point2f &LR,
 		float &widthRatio, float &heightRatio );
 
+	/**
+	 * FindOrientation - Computes the perspective transform from the upright
+	 *	page canvas to the exam image, the fitted page within that canvas
+	 *	and the page size ratios, without warping anything
+	 */
+	void findOrientation( cv::Mat &examImage, cv::Point2f &UL, cv::Point2f &UR, 
+		cv::Point2f &LL, cv::Point2f &LR, cv::Mat &transform,
+		cv::Rect &fitted, float &widthRatio, float &heightRatio );
+
+	/**
+	 * ShiftTransform - Returns transform applied after moving the input by
+	 *	(dx, dy), so its origin lands on that point
+	 */
+	cv::Mat shiftTransform( const cv::Mat &transform, float dx, float dy );
+
+	/**
+	 * SampleRegion - Warps one region of the upright page, with a margin
+	 *	for thresholding, straight out of the exam image and thresholds it
+	 * @param	transform	Upright page to exam image transform
+	 * @param	cell	Output, thresholded region
+	 */
+	void sampleRegion( cv::Mat &examImage, const cv::Mat &transform,
+		cv::Rect &region, cv::Mat &cell );
+
 	/**
 	 * ReadAllAnswers - Manages finding answer regions, then reads each
+	 * @param	transform	If given, examImage is the unwarped exam image and
+	 *	each region is sampled through the transform
+	 * @param	options	Its questions are read into answers, in order (all
+	 *	of them if empty), subsampled as its sampleStride says
+	 * @param	approximate	Output, SheetResult::approximateAnswers
+	 * @return	ReadReason	REASON_REGION_OUT_OF_BOUNDS if a question box
+	 *	(or question number) is off the page
 	 */
-	void readAllAnswers( cv::Mat &examImage, 
+	ReadReason readAllAnswers( cv::Mat &examImage, 
 		std::vector< std::vector< float > > &answers, cv::Point2f &UL,
-		float &widthRatio, float &heightRatio, int &numQuestions );
+		float &widthRatio, float &heightRatio, int &numQuestions,
+		const cv::Mat *transform, const ReadOptions &options,
+		std::vector< unsigned int > &approximate );
 
 	/**
 	 * FindAnswerRegions - Finds and stores the answer qbox regions
@@ -97,18 +463,28 @@ private: // Methods
 
 	/**
 	 * ReadAnswer - Read an answer from a region and return the results
+	 * @param	page	Thresholded page (or sampled cell), packed
 	 * @param	region	QBox
+	 * @param	step	Sample stride, 1 to count every pixel
+	 * @param	bound	Output, how far an estimated fill may be off; 0
+	 *	when exact
 	 * @return	vector<float>	The read results in the answer subregions 
 	 */
-	std::vector< float > readAnswer( cv::Mat &examImage,
+	std::vector< float > readAnswer( const BitPage &page,
 		cv::Rect &region, int refCols[6], float &boxArea,
-		float &qHeight );
+		float &qHeight, int step, float &bound );
 
 	/**
 	 * ReadName - Read the name from the name boxes
+	 * @param	transform	As for readAllAnswers
+	 * @param	approximate	Output, SheetResult::approximateName
+	 * @return	ReadReason	As for readAllAnswers
 	 */
-	void readName( cv::Mat &examImage, cv::Point2f &UL,
-		float &widthRatio, float &heightRatio, std::vector< float > &name );
+	ReadReason readName( cv::Mat &examImage, cv::Point2f &UL,
+		float &widthRatio, float &heightRatio, std::vector< float > &name,
+		std::vector< std::vector< float > > &letterFills,
+		const cv::Mat *transform, const ReadOptions &options,
+		unsigned int &approximate );
 
 	/**
 	 * FindNameLetterRegions - Find and store name letter regions
@@ -119,12 +495,53 @@ private: // Methods
 
 	/**
 	 * ReadNameLetter - Read and return one name letter
+	 * @param	page	Thresholded page (or sampled cell), packed
+	 * @param	fills	Output, fill ratio of each of the 26 letter cells
+	 * @param	step	As for readAnswer
+	 * @param	bound	As for readAnswer
 	 * @return	float	The region with the highest concentration of writing.  
 	 * 	The location index is the integer in front of the decimal point
 	 */
-	float readNameLetter( cv::Mat &examImage, 
+	float readNameLetter( const BitPage &page,
 		cv::Rect &region, int refCols[27], float &boxArea,
-		float &qWidth );
+		float &qWidth, std::vector< float > &fills, int step, float &bound );
+
+	/**
+	 * ClassifyAnswer - Choose the selected choices of one question
+	 * @param	fills	Fill ratio of each choice
+	 * @return	unsigned char	Bit a set for each selected choice a
+	 */
+	unsigned char classifyAnswer( const std::vector< float > &fills,
+		const ReadOptions &options, float &confidence, bool &ambiguous );
+
+	/**
+	 * ClassifyLetter - Choose the letter of one name column
+	 * @param	fills	Fill ratio of each of the 26 letter cells
+	 * @return	int	Letter index 0-25, or -1 if blank
+	 */
+	int classifyLetter( const std::vector< float > &fills,
+		const ReadOptions &options, float &confidence, bool &ambiguous );
+
+	/**
+	 * AnswerSettled - Whether estimated fills, each within bound of the
+	 *	exact ones, are sure to classify as the exact fills would
+	 */
+	bool answerSettled( const std::vector< float > &fills, float bound,
+		const ReadOptions &options );
+
+	/**
+	 * LetterSettled - As answerSettled, for a name column
+	 */
+	bool letterSettled( const std::vector< float > &fills, float bound,
+		const ReadOptions &options );
+
+	/**
+	 * ClassifySheet - Classifies every answer read, and the name letters
+	 *	if they were read, into the result
+	 */
+	void classifySheet( const ReadOptions &options, bool readname,
+		const std::vector< std::vector< float > > &letterFills,
+		SheetResult &result );
 
 	/**
 	 * isRectAccurate - Interpret dimensions of a given rotated rectangle
@@ -135,5 +552,29 @@ private: // Methods
 	 */
 	 bool isRectAccurate( cv::RotatedRect &rect, const int &mode );
 
+	/**
+	 * CheckDeadline - Whether the current sheet has run out of time or its
+	 *	batch was cancelled
+	 * @return	ReadReason	REASON_TIMEOUT, REASON_CANCELLED or REASON_NONE
+	 */
+	ReadReason checkDeadline();
+
+private: // Members
+
+	// Monotonic time (seconds) the current sheet must finish by, 0 if none
+	double deadline;
+
+	// Cancel token of the current sheet's batch, if any
+	const CancelToken *cancel;
+
+	// Encoded image of the sheet being read from memory, NULL for a file
+	const std::string *source;
+
+	// Thresholded page being read, packed; kept so its buffer is reused
+	BitPage page;
+
+	// Sampled region being read when reading without warping
+	BitPage cellPage;
+
 };
 #endif
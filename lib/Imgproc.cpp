@@ -2,13 +2,23 @@
 #include <cassert>
 #include "ruby.h"
 #include <vector>
+#include <algorithm>
 #include "ImageReader.h"
+#include "Grader.h"
+#include "ResThread.h"
+#include "ShardRunner.h"
+#include "GradeServer.h"
+#include "ResultStore.h"
+#include "Tracer.h"
 #include <string>
 #include "Imgproc.h"
+#ifdef HAVE_RB_THREAD_CALL_WITHOUT_GVL
+#include "ruby/thread.h"
+#endif
 
 using namespace std;
 //using namespace boost::lambda;
-//using namespace gsweb;
+using namespace gsweb;
 
 typedef VALUE (*rubyf)(...);
 
@@ -16,13 +26,148 @@ typedef VALUE (*rubyf)(...);
 // to be stored internally
 VALUE irm = Qnil;
 
+struct ImgprocState;
+
+/**
+ * BatchCancel - Cancel token of one batch, registered with its Imgproc
+ *	while the batch runs so cancel reaches it
+ */
+struct BatchCancel {
+	CancelToken token;
+	// Imgproc the batch is registered with, NULL once it has ended (or the
+	//	Imgproc was freed first)
+	ImgprocState *owner;
+
+	BatchCancel() : owner( NULL ) {}
+};
+
+/**
+ * ImgprocState - Native state of one Imgproc instance
+ */
+struct ImgprocState {
+	// Cancel tokens of the batches running on this instance
+	std::vector< BatchCancel* > batches;
+	// Summed ReadStage times of the last batch
+	double stageTotals[NUM_READ_STAGES];
+	// Sheets in stageTotals
+	int timedSheets;
+	// Sheets of the last batch whose frame the profile engine found
+	int profileFrames;
+	// Sheets of the last batch read more than once, and how many of
+	//	those the retry ladder read
+	int retriedSheets;
+	int rescuedSheets;
+};
+
+// Names of the ReadStages, as reported by stageTimings
+static const char *STAGE_NAMES[NUM_READ_STAGES] = {
+	"load", "calibrate", "orient", "threshold", "answers", "name", "classify"
+};
+
+// Names of the ReadReasons, as reported in classified results
+static const char *REASON_NAMES[NUM_READ_REASONS] = {
+	"none", "unreadableFile", "noFrame", "noOrientationBox",
+	"pageOutOfBounds", "regionOutOfBounds", "timeout", "cancelled",
+	"opencvError", "unwritableFile", "noGeometry"
+};
+
+// Clears the stage totals at the start of a batch
+static void resetStageTotals( ImgprocState *state ) {
+	for( int i = 0; i < NUM_READ_STAGES; i++ ) {
+		state->stageTotals[i] = 0;
+	}
+	state->timedSheets = 0;
+	state->profileFrames = 0;
+	state->retriedSheets = 0;
+	state->rescuedSheets = 0;
+}
+
+// Adds one sheet's stage times to the totals
+static void addStageTimes( ImgprocState *state, const SheetResult &result ) {
+	for( int i = 0; i < NUM_READ_STAGES; i++ ) {
+		state->stageTotals[i] += result.stageSeconds[i];
+	}
+	state->timedSheets++;
+	state->profileFrames += result.frameEngine == FRAME_PROFILE;
+	if( result.attempts > 1 ) {
+		state->retriedSheets++;
+		state->rescuedSheets += result.status == 0;
+	}
+}
+
+// Batches and servers that keep submitting to the shared pool.  The
+//	threading policy cannot change while any is running
+static int poolHolds = 0;
+
+// A forked child runs none of its parent's batches, and gets a pool of its
+//	own (see ResPool::shared)
+static void forgetPoolHolds() {
+	poolHolds = 0;
+}
+
+// Frees an Imgproc's native state.  A batch a dropped Enumerator left
+//	registered is freed later and must not unregister from it
+static void freeState( void *arg ) {
+	ImgprocState *state = static_cast< ImgprocState* >( arg );
+	for( size_t i = 0; i < state->batches.size(); i++ ) {
+		state->batches[i]->owner = NULL;
+	}
+	delete state;
+}
+
+// Allocates an Imgproc with its native state
+static VALUE method_alloc( VALUE klass ) {
+	ImgprocState *state = new ImgprocState;
+	resetStageTotals( state );
+	return Data_Wrap_Struct( klass, 0, freeState, state );
+}
+
+static ImgprocState *getState( VALUE self ) {
+	ImgprocState *state;
+	Data_Get_Struct( self, ImgprocState, state );
+	return state;
+}
+
+// Registers a batch's cancel token with the Imgproc it runs on
+static void registerBatch( VALUE self, BatchCancel &cancel ) {
+	ImgprocState *state = getState( self );
+	cancel.owner = state;
+	state->batches.push_back( &cancel );
+}
+
+// Unregisters a batch's cancel token, if it still is
+static void unregisterBatch( BatchCancel &cancel ) {
+	if( cancel.owner == NULL ) {
+		return;
+	}
+	std::vector< BatchCancel* > &batches = cancel.owner->batches;
+	batches.erase( std::find( batches.begin(), batches.end(), &cancel ) );
+	cancel.owner = NULL;
+}
+
 // Convenience method
 // The initialization method for this module
 extern "C" void Init_Imgproc() {
+	pthread_atfork(NULL, NULL, forgetPoolHolds);
 	irm = rb_define_class("Imgproc", rb_cObject);
+	rb_define_alloc_func(irm, method_alloc);
 	rb_define_method(irm, "initialize", (rubyf)  method_init, 0);
-	rb_define_method(irm, "readFiles", (rubyf) method_readFiles, 3);	
-	rb_define_method(irm, "prepShowImage", (rubyf) method_prepShowImage, 2);
+	rb_define_method(irm, "readFiles", (rubyf) method_readFiles, -1);
+	rb_define_method(irm, "eachResult", (rubyf) method_eachResult, -1);
+	rb_define_method(irm, "readNormalized", (rubyf) method_readNormalized, -1);
+	rb_define_method(irm, "readSheets", (rubyf) method_readSheets, -1);
+	rb_define_method(irm, "prepShowImage", (rubyf) method_prepShowImage, -1);
+	rb_define_method(irm, "cancel", (rubyf) method_cancel, 0);
+	rb_define_method(irm, "stageTimings", (rubyf) method_stageTimings, 0);
+	rb_define_method(irm, "readManifest", (rubyf) method_readManifest, 6);
+	rb_define_method(irm, "mergeShards", (rubyf) method_mergeShards, 4);
+	rb_define_singleton_method(irm, "serve", (rubyf) method_serve, -1);
+	rb_define_singleton_method(irm, "threading", (rubyf) method_threading, 0);
+	rb_define_singleton_method(irm, "threading=", (rubyf) method_setThreading, 1);
+	rb_define_singleton_method(irm, "queueWaits", (rubyf) method_queueWaits, -1);
+	rb_define_singleton_method(irm, "tracing", (rubyf) method_tracing, 0);
+	rb_define_singleton_method(irm, "tracing=", (rubyf) method_setTracing, 1);
+	rb_define_singleton_method(irm, "dumpTrace", (rubyf) method_dumpTrace, 1);
 }
 
 // Main initialization method used by ruby (".new")
@@ -30,6 +175,917 @@ extern "C" VALUE method_init(VALUE self) {
 	return self;
 }
 
+// Looks up a symbol key in a ruby options hash (nil if no hash given)
+static VALUE optionValue( VALUE opts, const char *key ) {
+	if( NIL_P( opts ) ) {
+		return Qnil;
+	}
+	return rb_hash_aref( opts, ID2SYM( rb_intern( key ) ) );
+}
+
+// Converts a question count, raising ArgumentError unless the layout
+//	has room for it
+static int parseNumQ( VALUE rubynumQ, const char *what ) {
+	int numQ = NUM2INT( rubynumQ );
+	if( numQ < 1 || numQ > MAX_QUESTIONS ) {
+		rb_raise( rb_eArgError, "%s must be between 1 and %d", what,
+			MAX_QUESTIONS );
+	}
+	return numQ;
+}
+
+// Fills the reading options from a ruby options hash
+static void parseReadOptions( VALUE opts, ReadOptions &options ) {
+	VALUE val;
+	options.classify = RTEST( optionValue( opts, "classify" ) );
+	options.warpFree = RTEST( optionValue( opts, "warpFree" ) );
+	if( !NIL_P( val = optionValue( opts, "fillThreshold" ) ) ) {
+		options.fillThreshold = float( NUM2DBL( val ) );
+	}
+	if( !NIL_P( val = optionValue( opts, "marginThreshold" ) ) ) {
+		options.marginThreshold = float( NUM2DBL( val ) );
+	}
+	if( !NIL_P( val = optionValue( opts, "timeout" ) ) ) {
+		options.timeLimit = NUM2DBL( val );
+	}
+	if( !NIL_P( val = optionValue( opts, "frame" ) ) ) {
+		ID frame = SYM2ID( rb_funcall( val, rb_intern( "to_sym" ), 0 ) );
+		if( frame == rb_intern( "profile" ) ) {
+			options.frameEngine = FRAME_PROFILE;
+		} else if( frame != rb_intern( "contours" ) ) {
+			rb_raise( rb_eArgError, ":frame must be :contours or :profile" );
+		}
+	}
+	options.normalized = RTEST( optionValue( opts, "normalized" ) );
+	if( !NIL_P( val = optionValue( opts, "questions" ) ) ) {
+		Check_Type( val, T_ARRAY );
+		long n = RARRAY_LEN( val );
+		options.questions.resize( n );
+		for( long i = 0; i < n; i++ ) {
+			options.questions[i] = NUM2INT( rb_ary_entry( val, i ) );
+		}
+	}
+	if( !NIL_P( val = optionValue( opts, "retries" ) ) ) {
+		options.retries = NUM2INT( val );
+		if( options.retries < 0 ) {
+			rb_raise( rb_eArgError, ":retries must not be negative" );
+		}
+	}
+	if( !NIL_P( val = optionValue( opts, "approximate" ) ) && val != Qfalse ) {
+		options.sampleStride = val == Qtrue ? APPROXIMATE_STRIDE : NUM2INT( val );
+		if( options.sampleStride < 1 || options.sampleStride > 16
+			|| ( options.sampleStride & ( options.sampleStride - 1 ) ) != 0 ) {
+			rb_raise( rb_eArgError, ":approximate must be true or 1, 2, 4, 8 or 16" );
+		}
+		// Raw results have nowhere to flag their estimated fills
+		if( options.sampleStride > 1 && !options.classify ) {
+			rb_raise( rb_eArgError, ":approximate needs :classify" );
+		}
+	}
+}
+
+// Converts a float vector to a ruby array of floats
+static VALUE floatsToRuby( const std::vector< float > &values ) {
+	int size = int( values.size() );
+	VALUE rbValues = rb_ary_new2( size );
+	for( int i = 0; i < size; i++ ) {
+		rb_ary_push( rbValues, DBL2NUM( values[i] ) );
+	}
+	return rbValues;
+}
+
+// Converts a bitmap of 32-bit words to a ruby Integer
+static VALUE bitmapToRuby( const std::vector< unsigned int > &words ) {
+	VALUE bits = INT2FIX( 0 );
+	for( int w = int( words.size() ) - 1; w >= 0; w-- ) {
+		bits = rb_funcall( bits, rb_intern( "<<" ), 1, INT2FIX( 32 ) );
+		bits = rb_funcall( bits, rb_intern( "|" ), 1, UINT2NUM( words[w] ) );
+	}
+	return bits;
+}
+
+/**
+ * parseAnswerKey - Reads the :key option.  Either an array of answer codes
+ *	(one version, every question worth 1) or a hash with :versions (array
+ *	of code arrays), optional :weights (one array for every version, or
+ *	one array per version) and :sheetVersions (version index per file,
+ *	default 0)
+ */
+static void parseAnswerKey( VALUE rubykey, int numFiles, AnswerKey &key,
+	std::vector< int > &sheetVersions ) {
+	VALUE rubyversions = rubykey;
+	VALUE rubyweights = Qnil;
+	VALUE rubysheetVersions = Qnil;
+	if( TYPE( rubykey ) == T_HASH ) {
+		rubyversions = optionValue( rubykey, "versions" );
+		rubyweights = optionValue( rubykey, "weights" );
+		rubysheetVersions = optionValue( rubykey, "sheetVersions" );
+	}
+	Check_Type( rubyversions, T_ARRAY );
+	if( RARRAY_LEN( rubyversions ) > 0
+		&& TYPE( rb_ary_entry( rubyversions, 0 ) ) != T_ARRAY ) {
+		rubyversions = rb_ary_new3( 1, rubyversions );
+	}
+	long numVersions = RARRAY_LEN( rubyversions );
+	if( numVersions == 0 ) {
+		rb_raise( rb_eArgError, "answer key has no versions" );
+	}
+	key.versions.resize( numVersions );
+	for( long v = 0; v < numVersions; v++ ) {
+		VALUE rubycodes = rb_ary_entry( rubyversions, v );
+		Check_Type( rubycodes, T_ARRAY );
+		for( long q = 0; q < RARRAY_LEN( rubycodes ); q++ ) {
+			key.versions[v].push_back(
+				(unsigned char) NUM2INT( rb_ary_entry( rubycodes, q ) ) );
+		}
+	}
+
+	if( !NIL_P( rubyweights ) ) {
+		Check_Type( rubyweights, T_ARRAY );
+		if( RARRAY_LEN( rubyweights ) > 0
+			&& TYPE( rb_ary_entry( rubyweights, 0 ) ) != T_ARRAY ) {
+			VALUE shared = rubyweights;
+			rubyweights = rb_ary_new();
+			for( long v = 0; v < numVersions; v++ ) {
+				rb_ary_push( rubyweights, shared );
+			}
+		}
+		key.weights.resize( RARRAY_LEN( rubyweights ) );
+		for( long v = 0; v < RARRAY_LEN( rubyweights ); v++ ) {
+			VALUE rubyw = rb_ary_entry( rubyweights, v );
+			Check_Type( rubyw, T_ARRAY );
+			for( long q = 0; q < RARRAY_LEN( rubyw ); q++ ) {
+				key.weights[v].push_back(
+					float( NUM2DBL( rb_ary_entry( rubyw, q ) ) ) );
+			}
+		}
+	}
+
+	sheetVersions.assign( numFiles, 0 );
+	if( !NIL_P( rubysheetVersions ) ) {
+		Check_Type( rubysheetVersions, T_ARRAY );
+		for( long i = 0; i < numFiles && i < RARRAY_LEN( rubysheetVersions ); i++ ) {
+			int v = NUM2INT( rb_ary_entry( rubysheetVersions, i ) );
+			if( v < 0 || v >= numVersions ) {
+				rb_raise( rb_eArgError, "sheet %ld has unknown version %d", i, v );
+			}
+			sheetVersions[i] = v;
+		}
+	}
+}
+
+// Converts the merged statistics of one version to a ruby hash
+static VALUE statsToRuby( const ItemStats &stats, float maxScore ) {
+	VALUE rbStats = rb_hash_new();
+	int numQuestions = int( stats.numCorrect.size() );
+	VALUE rbHistogram = rb_ary_new2( numQuestions );
+	VALUE rbNumCorrect = rb_ary_new2( numQuestions );
+	VALUE rbSumScoreCorrect = rb_ary_new2( numQuestions );
+	VALUE rbDifficulty = rb_ary_new2( numQuestions );
+	VALUE rbPointBiserial = rb_ary_new2( numQuestions );
+	for( int q = 0; q < numQuestions; q++ ) {
+		VALUE rbBins = rb_ary_new2( NUM_HISTOGRAM_BINS );
+		for( int b = 0; b < NUM_HISTOGRAM_BINS; b++ ) {
+			rb_ary_push( rbBins,
+				INT2NUM( stats.histogram[q * NUM_HISTOGRAM_BINS + b] ) );
+		}
+		rb_ary_push( rbHistogram, rbBins );
+		rb_ary_push( rbNumCorrect, INT2NUM( stats.numCorrect[q] ) );
+		rb_ary_push( rbSumScoreCorrect, DBL2NUM( stats.sumScoreCorrect[q] ) );
+		rb_ary_push( rbDifficulty, DBL2NUM( stats.numSheets == 0 ? 0.0
+			: double( stats.numCorrect[q] ) / stats.numSheets ) );
+		rb_ary_push( rbPointBiserial, DBL2NUM( stats.pointBiserial( q ) ) );
+	}
+	rb_hash_aset( rbStats, ID2SYM( rb_intern( "sheets" ) ),
+		INT2NUM( stats.numSheets ) );
+	rb_hash_aset( rbStats, ID2SYM( rb_intern( "maxScore" ) ),
+		DBL2NUM( maxScore ) );
+	rb_hash_aset( rbStats, ID2SYM( rb_intern( "sumScore" ) ),
+		DBL2NUM( stats.sumScore ) );
+	rb_hash_aset( rbStats, ID2SYM( rb_intern( "sumScoreSq" ) ),
+		DBL2NUM( stats.sumScoreSq ) );
+	rb_hash_aset( rbStats, ID2SYM( rb_intern( "histogram" ) ), rbHistogram );
+	rb_hash_aset( rbStats, ID2SYM( rb_intern( "numCorrect" ) ), rbNumCorrect );
+	rb_hash_aset( rbStats, ID2SYM( rb_intern( "sumScoreCorrect" ) ),
+		rbSumScoreCorrect );
+	rb_hash_aset( rbStats, ID2SYM( rb_intern( "difficulty" ) ), rbDifficulty );
+	rb_hash_aset( rbStats, ID2SYM( rb_intern( "pointBiserial" ) ),
+		rbPointBiserial );
+	return rbStats;
+}
+
+/**
+ * SheetJob - Reads (and grades) one file of a readFiles batch on a pool
+ *	worker
+ */
+class SheetJob : public ResJob {
+
+public:
+
+	std::string filename;
+	int index;
+	int slot;
+	int numQ;
+	bool readName;
+	int version;
+	const ReadOptions *options;
+	SheetResult *result;
+	Grader *grader;
+	ResBatch *batch;
+	// Encoded image to read instead of the file (then only a label), or NULL
+	const std::string *data;
+
+	void run( ImageReader &reader, int worker ) {
+		if( data != NULL ) {
+			reader.readSheet( *data, filename, numQ, readName, *options,
+				*result );
+		} else {
+			reader.readSheet( filename, numQ, readName, *options, *result );
+		}
+		if( grader != NULL ) {
+			grader->grade( *result, version, worker );
+		}
+		batch->done( slot );
+	}
+};
+
+/**
+ * PrepJob - Normalizes one image for prepShowImage on a pool worker, ahead
+ *	of any queued batch
+ */
+class PrepJob : public ResJob {
+
+public:
+
+	std::string filename;
+	std::string outname;
+	ResBatch *batch;
+	CancelToken *cancel;
+	// Why the image was not normalized, REASON_NONE once it was
+	ReadReason reason;
+
+	void run( ImageReader &reader, int worker ) {
+		reason = reader.prepShowImage( filename, outname, cancel );
+		batch->done( 0 );
+	}
+};
+
+// Waits for a batch, called without the GVL
+static void *joinBatch( void *batch ) {
+	Tracer::setSheet( NULL );
+	TraceSpan span( "batch wait" );
+	static_cast< ResBatch* >( batch )->join();
+	return NULL;
+}
+
+// Next finished slot of a streamed batch
+struct NextSlot {
+	ResBatch *batch;
+	int slot;
+};
+
+// Waits for the next finished job of a batch, called without the GVL
+static void *nextInBatch( void *arg ) {
+	NextSlot *next = static_cast< NextSlot* >( arg );
+	Tracer::setSheet( NULL );
+	TraceSpan span( "batch wait" );
+	next->slot = next->batch->next();
+	return NULL;
+}
+
+// Unblocking function: an interrupted wait (Thread#kill, Ctrl-C) cancels
+// its batch so the wait ends as soon as the running sheets give up
+static void cancelBatch( void *token ) {
+	static_cast< CancelToken* >( token )->cancel();
+}
+
+// Runs func without holding the GVL so other ruby threads keep going.
+//	If the calling thread is interrupted, the cancel token is set
+static void withoutGvl( void *(*func)( void* ), void *arg,
+	CancelToken *cancel ) {
+#ifdef HAVE_RB_THREAD_CALL_WITHOUT_GVL
+	rb_thread_call_without_gvl( func, arg, cancelBatch, (void*) cancel );
+#else
+	rb_thread_blocking_region( (rb_blocking_function_t*) func, arg,
+		cancelBatch, (void*) cancel );
+#endif
+}
+
+/**
+ * sheetToRuby - Converts one sheet's result to ruby.  Raw results keep the
+ *	original layout: one array of fill ratios per question, then the name
+ *	(or the single negative error code).  Classified results are a hash.
+ */
+static VALUE sheetToRuby( const SheetResult &result, bool classify ) {
+	if( classify ) {
+		VALUE rbSheet = rb_hash_new();
+		rb_hash_aset( rbSheet, ID2SYM( rb_intern( "status" ) ),
+			INT2NUM( result.status ) );
+		if( result.attempts > 1 ) {
+			rb_hash_aset( rbSheet, ID2SYM( rb_intern( "attempts" ) ),
+				INT2NUM( result.attempts ) );
+		}
+		if( result.status != 0 ) {
+			rb_hash_aset( rbSheet, ID2SYM( rb_intern( "reason" ) ),
+				ID2SYM( rb_intern( REASON_NAMES[result.reason] ) ) );
+			return rbSheet;
+		}
+		VALUE rbCodes = rb_ary_new2( long( result.codes.size() ) );
+		for( size_t i = 0; i < result.codes.size(); i++ ) {
+			rb_ary_push( rbCodes, INT2FIX( result.codes[i] ) );
+		}
+		VALUE rbName = rb_ary_new2( long( result.nameCodes.size() ) );
+		for( size_t i = 0; i < result.nameCodes.size(); i++ ) {
+			rb_ary_push( rbName, INT2FIX( result.nameCodes[i] ) );
+		}
+		rb_hash_aset( rbSheet, ID2SYM( rb_intern( "answers" ) ), rbCodes );
+		rb_hash_aset( rbSheet, ID2SYM( rb_intern( "confidence" ) ),
+			floatsToRuby( result.confidence ) );
+		rb_hash_aset( rbSheet, ID2SYM( rb_intern( "ambiguousAnswers" ) ),
+			bitmapToRuby( result.ambiguousAnswers ) );
+		rb_hash_aset( rbSheet, ID2SYM( rb_intern( "name" ) ), rbName );
+		rb_hash_aset( rbSheet, ID2SYM( rb_intern( "nameConfidence" ) ),
+			floatsToRuby( result.nameConfidence ) );
+		rb_hash_aset( rbSheet, ID2SYM( rb_intern( "ambiguousName" ) ),
+			UINT2NUM( result.ambiguousName ) );
+		bool approximate = result.approximateName != 0;
+		for( size_t w = 0; w < result.approximateAnswers.size(); w++ ) {
+			approximate = approximate || result.approximateAnswers[w] != 0;
+		}
+		if( approximate ) {
+			rb_hash_aset( rbSheet, ID2SYM( rb_intern( "approximateAnswers" ) ),
+				bitmapToRuby( result.approximateAnswers ) );
+			rb_hash_aset( rbSheet, ID2SYM( rb_intern( "approximateName" ) ),
+				UINT2NUM( result.approximateName ) );
+		}
+		return rbSheet;
+	}
+
+	// Go through each for each student's answers
+	VALUE rbStudentAnswers = rb_ary_new();
+	int sz = int( result.answers.size() );
+	for( int k = 0; k < sz; k++ ) {
+		rb_ary_push( rbStudentAnswers, floatsToRuby( result.answers[k] ) );
+	}
+	if( result.status != 0 ) {
+		std::vector< float > oops( 1, float( result.status ) );
+		rb_ary_push( rbStudentAnswers, floatsToRuby( oops ) );
+	} else {
+		rb_ary_push( rbStudentAnswers, floatsToRuby( result.name ) );
+	}
+	return rbStudentAnswers;
+}
+
+/**
+ * SheetSpec - One sheet of a batch: what to read and which form it is
+ */
+struct SheetSpec {
+	// The file, or a label for a sheet in memory
+	std::string path;
+	// Encoded image of a sheet in memory (readSheets :data)
+	std::string data;
+	bool inMemory;
+	int numQ;
+	bool readName;
+	std::string layout;
+};
+
+// Orders sheets by layout, then question count and name flag
+struct SpecOrder {
+	const std::vector< SheetSpec > *specs;
+
+	bool operator()( int a, int b ) const {
+		const SheetSpec &x = ( *specs )[a];
+		const SheetSpec &y = ( *specs )[b];
+		if( x.layout != y.layout ) {
+			return x.layout < y.layout;
+		}
+		if( x.numQ != y.numQ ) {
+			return x.numQ < y.numQ;
+		}
+		return x.readName < y.readName;
+	}
+};
+
+/**
+ * BatchArgs - Parsed arguments shared by readFiles, eachResult and
+ *	readSheets
+ */
+struct BatchArgs {
+	// The filenames, or readSheets' sheets
+	VALUE rubyfilenames;
+	VALUE rubyopts;
+	VALUE rubykey;
+	// Questions and name flag of a single-form batch, for its grader and
+	//	store (readSheets has neither)
+	int numQ;
+	int numFiles;
+	bool readName;
+	// What each sheet is and how to read it
+	std::vector< SheetSpec > sheets;
+	// Order to queue the sheets in, empty for the order given
+	std::vector< int > order;
+	// Output classified hashes (options.classify is also forced on to grade)
+	bool classify;
+	ReadOptions options;
+	AnswerKey key;
+	std::vector< int > sheetVersions;
+	// Native state of the calling Imgproc
+	ImgprocState *state;
+	// Cancel token of the batch
+	BatchCancel cancel;
+	// Result store to append the sheets to, empty for none
+	std::string storePath;
+	// Pool priority class and tenant of the batch's sheets
+	ResJob::Priority priority;
+	std::string tenant;
+};
+
+// Parses :priority, by default interactive for a single sheet (someone is
+//	waiting on it) and bulk otherwise
+static ResJob::Priority parsePriority( VALUE rubyopts, int numFiles ) {
+	VALUE val = optionValue( rubyopts, "priority" );
+	if( NIL_P( val ) ) {
+		return numFiles == 1 ? ResJob::PRIORITY_INTERACTIVE
+			: ResJob::PRIORITY_BULK;
+	}
+	ID priority = SYM2ID( rb_funcall( val, rb_intern( "to_sym" ), 0 ) );
+	if( priority == rb_intern( "interactive" ) ) {
+		return ResJob::PRIORITY_INTERACTIVE;
+	}
+	if( priority != rb_intern( "bulk" ) ) {
+		rb_raise( rb_eArgError, ":priority must be :interactive or :bulk" );
+	}
+	return ResJob::PRIORITY_BULK;
+}
+
+// Raises unless every :questions entry is a question of a numQ sheet
+static void checkQuestions( const ReadOptions &options, int numQ ) {
+	for( size_t q = 0; q < options.questions.size(); q++ ) {
+		if( options.questions[q] < 0 || options.questions[q] >= numQ ) {
+			rb_raise( rb_eArgError, ":questions must be between 0 and %d",
+				numQ - 1 );
+		}
+	}
+}
+
+// Parses the options hash of a batch of args.numFiles sheets into args
+static void parseBatchOptions( BatchArgs &args ) {
+	parseReadOptions( args.rubyopts, args.options );
+
+	// Grading needs the classified codes whatever the output format
+	args.classify = args.options.classify;
+	args.rubykey = optionValue( args.rubyopts, "key" );
+	args.sheetVersions.assign( args.numFiles, 0 );
+	if( !NIL_P( args.rubykey ) ) {
+		if( !args.options.questions.empty() ) {
+			rb_raise( rb_eArgError, "grade (:key) whole sheets, not :questions" );
+		}
+		parseAnswerKey( args.rubykey, args.numFiles, args.key,
+			args.sheetVersions );
+		args.options.classify = true;
+	}
+
+	VALUE rubystore = optionValue( args.rubyopts, "store" );
+	if( !NIL_P( rubystore ) ) {
+		args.storePath = StringValueCStr( rubystore );
+	}
+
+	args.priority = parsePriority( args.rubyopts, args.numFiles );
+	VALUE rubytenant = optionValue( args.rubyopts, "tenant" );
+	if( !NIL_P( rubytenant ) ) {
+		VALUE tenant = rb_obj_as_string( rubytenant );
+		args.tenant = StringValueCStr( tenant );
+	}
+}
+
+// Parses (filenames, numQ, readName, opts = {}) into args
+static void parseBatchArgs( int argc, VALUE *argv, BatchArgs &args ) {
+	VALUE rubynumQ, rubyReadname;
+	rb_scan_args( argc, argv, "31", &args.rubyfilenames, &rubynumQ,
+		&rubyReadname, &args.rubyopts );
+	Check_Type( args.rubyfilenames, T_ARRAY );
+	args.numQ = parseNumQ( rubynumQ, "numQ" );
+	args.numFiles = int( RARRAY_LEN( args.rubyfilenames ) );
+	args.readName = RTEST( rubyReadname );
+	parseBatchOptions( args );
+	checkQuestions( args.options, args.numQ );
+
+	args.sheets.resize( args.numFiles );
+	for( int i = 0; i < args.numFiles; i++ ) {
+		SheetSpec &sheet = args.sheets[i];
+		VALUE rubyfn = rb_ary_entry( args.rubyfilenames, i );
+		sheet.path = StringValueCStr( rubyfn );
+		sheet.inMemory = false;
+		sheet.numQ = args.numQ;
+		sheet.readName = args.readName;
+		sheet.layout = DEFAULT_LAYOUT;
+	}
+}
+
+// Parses sheet i of readSheets, a path or a hash, into spec
+static void parseSheetSpec( VALUE rubysheet, int i, VALUE rubyopts,
+	const ReadOptions &options, SheetSpec &spec ) {
+	VALUE val;
+	VALUE rubynumQ = optionValue( rubyopts, "numQ" );
+	spec.readName = RTEST( optionValue( rubyopts, "readName" ) );
+	spec.layout = DEFAULT_LAYOUT;
+	spec.inMemory = false;
+	if( RB_TYPE_P( rubysheet, T_HASH ) ) {
+		if( !NIL_P( val = optionValue( rubysheet, "numQ" ) ) ) {
+			rubynumQ = val;
+		}
+		if( rb_funcall( rubysheet, rb_intern( "key?" ), 1,
+			ID2SYM( rb_intern( "readName" ) ) ) == Qtrue ) {
+			spec.readName = RTEST( optionValue( rubysheet, "readName" ) );
+		}
+		if( !NIL_P( val = optionValue( rubysheet, "layout" ) ) ) {
+			VALUE layout = rb_obj_as_string( val );
+			spec.layout = StringValueCStr( layout );
+		}
+		VALUE rubydata = optionValue( rubysheet, "data" );
+		VALUE rubypath = optionValue( rubysheet, "path" );
+		if( NIL_P( rubydata ) == NIL_P( rubypath ) ) {
+			rb_raise( rb_eArgError, "sheet %d needs one of :path and :data", i );
+		}
+		if( !NIL_P( rubydata ) ) {
+			// Copied, as the GVL is released while it is read
+			StringValue( rubydata );
+			spec.data.assign( RSTRING_PTR( rubydata ), RSTRING_LEN( rubydata ) );
+			spec.inMemory = true;
+			char label[32];
+			snprintf( label, sizeof( label ), "<sheet %d>", i );
+			spec.path = label;
+		} else {
+			spec.path = StringValueCStr( rubypath );
+		}
+	} else {
+		spec.path = StringValueCStr( rubysheet );
+	}
+
+	if( NIL_P( rubynumQ ) ) {
+		rb_raise( rb_eArgError, "sheet %d has no :numQ", i );
+	}
+	char what[32];
+	snprintf( what, sizeof( what ), "sheet %d :numQ", i );
+	spec.numQ = parseNumQ( rubynumQ, what );
+	if( spec.layout != DEFAULT_LAYOUT ) {
+		rb_raise( rb_eArgError, "sheet %d: unknown layout %s", i,
+			spec.layout.c_str() );
+	}
+	if( spec.inMemory && options.normalized ) {
+		rb_raise( rb_eArgError,
+			"sheet %d: :normalized pages are read from files, with their geometry", i );
+	}
+	checkQuestions( options, spec.numQ );
+}
+
+
+// Sets up the job for file i of a batch
+static void prepareJob( BatchArgs &args, int i, int slot, SheetResult *result,
+	Grader *grader, ResBatch *batch, SheetJob &job ) {
+	const SheetSpec &sheet = args.sheets[i];
+	job.filename = sheet.path;
+	job.index = i;
+	job.slot = slot;
+	job.numQ = sheet.numQ;
+	job.readName = sheet.readName;
+	job.version = args.sheetVersions[i];
+	job.options = &args.options;
+	job.result = result;
+	job.grader = NIL_P( args.rubykey ) ? NULL : grader;
+	job.batch = batch;
+	job.data = sheet.inMemory ? &sheet.data : NULL;
+	job.priority = args.priority;
+	job.tenant = args.tenant;
+}
+
+// Questions per sheet in the result store of a batch
+static int storeAnswers( const BatchArgs &args ) {
+	return args.options.questions.empty() ? args.numQ
+		: int( args.options.questions.size() );
+}
+
+// Columns the result store of a batch holds beyond the raw fills
+static int storeFlags( const BatchArgs &args ) {
+	return ( args.classify ? ResultStore::STORE_CLASSIFIED : 0 )
+		| ( NIL_P( args.rubykey ) ? 0 : ResultStore::STORE_GRADED );
+}
+
+// Merged statistics of every version as a ruby array
+static VALUE gradedStatsToRuby( const Grader &grader ) {
+	std::vector< ItemStats > stats;
+	grader.mergeStats( stats );
+	VALUE rbStats = rb_ary_new2( long( stats.size() ) );
+	for( int v = 0; v < int( stats.size() ); v++ ) {
+		rb_ary_push( rbStats, statsToRuby( stats[v], grader.maxScore( v ) ) );
+	}
+	return rbStats;
+}
+
+/**
+ * BatchState - A readFiles batch, whole or streamed.  A streamed batch
+ *	only queues or holds inFlight sheets at once, in reusable slots.  It
+ *	lives on the heap, owned by a ruby object, so raising out of the batch
+ *	leaks nothing and an external Enumerator (next) may stop resuming a
+ *	streamed batch halfway: the object's free function then abandons the
+ *	sheets still queued, and the last of them to finish frees the batch
+ */
+struct BatchState {
+	BatchArgs args;
+	ResPool *pool;
+	Grader *grader;
+	ResBatch *batch;
+	std::vector< SheetJob > jobs;
+	std::vector< SheetResult > results;
+	std::vector< int > freeSlots;
+	int submitted;
+	// Sheets yielded, or all of them once a whole batch is joined
+	int yielded;
+	// Result store the sheets are appended to, NULL for none (or once an
+	//	append failed)
+	ResultStore *store;
+	// An append to the store failed; raised once the batch has ended
+	bool storeFailed;
+	// Holds the pool (poolHolds) with sheets that may still be queued
+	bool running;
+
+	BatchState() : pool( NULL ), grader( NULL ), batch( NULL ),
+		submitted( 0 ), yielded( 0 ), store( NULL ), storeFailed( false ),
+		running( false ) {
+		args.rubyfilenames = Qnil;
+		args.rubyopts = Qnil;
+		args.rubykey = Qnil;
+	}
+
+	~BatchState() {
+		delete store;
+		delete batch;
+		delete grader;
+	}
+};
+
+// Opens the :store of a batch for appending, if it names one
+static void openStore( BatchState *state ) {
+	BatchArgs &args = state->args;
+	if( args.storePath.empty() ) {
+		return;
+	}
+	state->store = new ResultStore( args.storePath, storeAnswers( args ),
+		args.readName, storeFlags( args ) );
+	if( !state->store->open() ) {
+		rb_raise( rb_eIOError, "cannot append to result store %s",
+			args.storePath.c_str() );
+	}
+}
+
+// Drops the store of a batch whose append failed, keeping the sheets
+//	coming; the error is raised once the batch has ended
+static void storeFailed( BatchState *state ) {
+	delete state->store;
+	state->store = NULL;
+	state->storeFailed = true;
+}
+
+// Appends the sheet in a slot to the store of its batch, if any
+static void storeSheet( BatchState *state, int slot ) {
+	if( state->store != NULL && !state->store->add( state->jobs[slot].index,
+		state->jobs[slot].filename, state->results[slot] ) ) {
+		storeFailed( state );
+	}
+}
+
+// Appends the sheets the store of a batch still holds
+static void flushStore( BatchState *state ) {
+	if( state->store != NULL && !state->store->flush() ) {
+		storeFailed( state );
+	}
+}
+
+// Keeps the pool fed and yields each sheet as it finishes
+static VALUE streamBatch( VALUE arg ) {
+	BatchState *state = reinterpret_cast< BatchState* >( arg );
+	BatchArgs &args = state->args;
+	while( state->yielded < args.numFiles ) {
+		while( state->submitted < args.numFiles && !state->freeSlots.empty() ) {
+			int slot = state->freeSlots.back();
+			state->freeSlots.pop_back();
+			prepareJob( args, state->submitted, slot, &state->results[slot],
+				state->grader, state->batch, state->jobs[slot] );
+			state->pool->submit( &state->jobs[slot] );
+			state->submitted++;
+		}
+
+		NextSlot next;
+		next.batch = state->batch;
+		withoutGvl( nextInBatch, &next, &args.cancel.token );
+		int slot = next.slot;
+		SheetResult &result = state->results[slot];
+		VALUE rbIndex = INT2NUM( state->jobs[slot].index );
+		VALUE rbResult = sheetToRuby( result, args.classify );
+		VALUE rbScore = ( NIL_P( args.rubykey ) || result.status != 0 ) ? Qnil
+			: DBL2NUM( result.score );
+		addStageTimes( args.state, result );
+		storeSheet( state, slot );
+		// Release the slot before yielding so memory stays bounded
+		result = SheetResult();
+		state->freeSlots.push_back( slot );
+		state->yielded++;
+		rb_yield_values( 3, rbIndex, rbResult, rbScore );
+	}
+	flushStore( state );
+	if( NIL_P( args.rubykey ) ) {
+		return INT2NUM( state->yielded );
+	}
+	return gradedStatsToRuby( *state->grader );
+}
+
+// Reads a whole batch into the readFiles result array (or hash)
+static VALUE readBatch( VALUE arg ) {
+	BatchState *state = reinterpret_cast< BatchState* >( arg );
+	BatchArgs &args = state->args;
+	std::vector< SheetResult > &results = state->results;
+	int numFiles = args.numFiles;
+	for( int i = 0; i < numFiles; i++ ) {
+		prepareJob( args, i, i, &results[i], state->grader, state->batch,
+			state->jobs[i] );
+	}
+	for( int i = 0; i < numFiles; i++ ) {
+		int job = args.order.empty() ? i : args.order[i];
+		state->pool->submit( &state->jobs[job] );
+		state->submitted++;
+	}
+	withoutGvl( joinBatch, state->batch, &args.cancel.token );
+	state->yielded = numFiles;
+
+    assert( numFiles == int(results.size()) );
+
+	VALUE rbStudents = rb_ary_new();
+	bool returnSheets = ( NIL_P( args.rubykey ) && args.storePath.empty() )
+		|| optionValue( args.rubyopts, "sheets" ) != Qfalse;
+	for( int i = 0; i < numFiles; i++ ) {
+		addStageTimes( args.state, results[i] );
+	}
+	for( int i = 0; i < numFiles; i++ ) {
+		storeSheet( state, i );
+	}
+	flushStore( state );
+	// Go through each for each student
+	for( int i = 0; i < numFiles && returnSheets; i++ ) {
+		rb_ary_push( rbStudents, sheetToRuby( results[i], args.classify ) );
+	}
+	if( NIL_P( args.rubykey ) ) {
+		return returnSheets ? rbStudents : INT2NUM( numFiles );
+	}
+
+	VALUE rbScores = rb_ary_new2( numFiles );
+	for( int i = 0; i < numFiles; i++ ) {
+		rb_ary_push( rbScores, results[i].status != 0 ? Qnil
+			: DBL2NUM( results[i].score ) );
+	}
+	VALUE rbGraded = rb_hash_new();
+	rb_hash_aset( rbGraded, ID2SYM( rb_intern( "scores" ) ), rbScores );
+	rb_hash_aset( rbGraded, ID2SYM( rb_intern( "stats" ) ),
+		gradedStatsToRuby( *state->grader ) );
+	if( returnSheets ) {
+		rb_hash_aset( rbGraded, ID2SYM( rb_intern( "sheets" ) ), rbStudents );
+	}
+	return rbGraded;
+}
+
+// Waits out the jobs still queued when the block breaks or raises
+static void *drainBatch( void *arg ) {
+	BatchState *state = static_cast< BatchState* >( arg );
+	state->batch->waitFinished( state->submitted );
+	return NULL;
+}
+
+// Ends a batch once: abandons the sheets not yet yielded, waits out those
+//	still queued, flushes the store, releases the pool and unregisters the
+//	batch's cancel token
+static VALUE finishBatchEnsure( VALUE arg ) {
+	BatchState *state = reinterpret_cast< BatchState* >( arg );
+	if( state->running ) {
+		state->running = false;
+		CancelToken *cancel = &state->args.cancel.token;
+		if( state->yielded < state->args.numFiles ) {
+			cancel->cancel();
+		}
+		withoutGvl( drainBatch, state, cancel );
+		poolHolds--;
+		// Keep what was yielded before the block broke out
+		flushStore( state );
+	}
+	unregisterBatch( state->args.cancel );
+	return Qnil;
+}
+
+// Deletes an abandoned batch, on the worker that finished its last sheet
+static void releaseBatch( void *arg ) {
+	delete static_cast< BatchState* >( arg );
+}
+
+static void markBatch( void *arg ) {
+	BatchState *state = static_cast< BatchState* >( arg );
+	rb_gc_mark( state->args.rubyfilenames );
+	rb_gc_mark( state->args.rubyopts );
+	rb_gc_mark( state->args.rubykey );
+}
+
+// Frees a batch the ensure path never finished (a dropped Enumerator's).
+//	The GC holds the GVL here, so the sheets still queued are cancelled,
+//	not waited for: the last of them to finish deletes the batch
+static void freeBatch( void *arg ) {
+	BatchState *state = static_cast< BatchState* >( arg );
+	unregisterBatch( state->args.cancel );
+	if( state->running ) {
+		state->running = false;
+		state->args.cancel.token.cancel();
+		poolHolds--;
+		flushStore( state );
+		if( state->batch->releaseWhenFinished( state->submitted, releaseBatch,
+			state ) ) {
+			return;
+		}
+	}
+	delete state;
+}
+
+// Allocates a batch, owned by the ruby object returned
+static VALUE newBatch( BatchState *&state ) {
+	state = new BatchState;
+	return Data_Wrap_Struct( 0, markBatch, freeBatch, state );
+}
+
+// Opens the store of a parsed batch of self and builds its grader,
+//	ResBatch and slots
+static void startBatch( VALUE self, BatchState *state, int slots ) {
+	BatchArgs &args = state->args;
+	args.state = getState( self );
+	args.options.cancel = &args.cancel.token;
+	resetStageTotals( args.state );
+	openStore( state );
+	state->pool = &ResPool::shared();
+	state->grader = new Grader( args.key, args.numQ, state->pool->size() );
+	state->batch = new ResBatch( args.numFiles );
+	state->jobs.resize( slots );
+	state->results.resize( slots );
+}
+
+/**
+ * runReadBatch - Runs body on a started batch of self, registered so
+ *	cancel reaches it, and frees the batch however body ends
+ * @return	What body returned.  Raises IOError, once the batch is freed,
+ *	if appending to its store failed
+ */
+static VALUE runReadBatch( VALUE self, VALUE rbState, BatchState *state,
+	VALUE (*body)( VALUE ) ) {
+	registerBatch( self, state->args.cancel );
+	state->running = true;
+	poolHolds++;
+	VALUE rbRead = rb_ensure( (rubyf) body, reinterpret_cast< VALUE >( state ),
+		(rubyf) finishBatchEnsure, reinterpret_cast< VALUE >( state ) );
+	VALUE rbError = Qnil;
+	if( state->storeFailed ) {
+		rbError = rb_exc_new3( rb_eIOError,
+			rb_sprintf( "cannot append to result store %s",
+				state->args.storePath.c_str() ) );
+	}
+	DATA_PTR( rbState ) = NULL;
+	delete state;
+	if( !NIL_P( rbError ) ) {
+		rb_exc_raise( rbError );
+	}
+	return rbRead;
+}
+
+/**
+ * readStreaming - Reads a batch, yielding (index, result, score) for each
+ *	sheet as soon as it is read.  At most :inFlight sheets (default twice
+ *	the pool size) are queued or waiting to be yielded at any time
+ * @return	Number of sheets read, or the :stats array when grading
+ */
+static VALUE readStreaming( VALUE self, int argc, VALUE *argv ) {
+	BatchState *state;
+	VALUE rbState = newBatch( state );
+	BatchArgs &args = state->args;
+	parseBatchArgs( argc, argv, args );
+	int inFlight = 2 * ResPool::shared().size();
+	VALUE rubyinFlight = optionValue( args.rubyopts, "inFlight" );
+	if( !NIL_P( rubyinFlight ) ) {
+		inFlight = NUM2INT( rubyinFlight );
+	}
+	if( inFlight < 1 ) {
+		rb_raise( rb_eArgError, ":inFlight must be positive" );
+	}
+
+	startBatch( self, state, inFlight );
+	for( int slot = inFlight - 1; slot >= 0; slot-- ) {
+		state->freeSlots.push_back( slot );
+	}
+	return runReadBatch( self, rbState, state, streamBatch );
+}
+
 /**
  * method_readFiles - main in method for Imgproc.  Reads and returns results
  *
@@ -38,68 +1094,609 @@ extern "C" VALUE method_init(VALUE self) {
  *	(including extension and path!!!)
  * @param	rubynumQ	ruby-formatted number of questions on test
  * @param	rubyReadname	ruby bool value to determine if name to be read
+ * @param	rubyopts	Optional hash:
+ *	:classify	true to return a hash per sheet with :status, :answers
+ *		(bitmask of selected choices, 1 = A ... 16 = E, 0 = blank),
+ *		:confidence, :ambiguousAnswers (bit q set if question q is
+ *		ambiguous), :name (letter 0-25, -1 blank), :nameConfidence and
+ *		:ambiguousName
+ *	:fillThreshold	fill ratio for a bubble to count as marked
+ *	:marginThreshold	fill gap below which an answer is ambiguous
+ *	:warpFree	true to sample each region through the page transform
+ *		instead of warping and thresholding the whole page
+ *	:key	answer key (see parseAnswerKey).  Sheets are graded while
+ *		they are read and the result becomes a hash with :scores (nil
+ *		for unreadable sheets), :stats (item statistics per version)
+ *		and :sheets (the per-sheet results, omitted if :sheets is false)
+ *	:inFlight	with a block, the most sheets queued or unyielded at once
+ *	:timeout	seconds a sheet may take; slower sheets are abandoned
+ *		with status -5 (READ_TIMEOUT).  Sheets of a cancelled batch
+ *		(see cancel) get -6 (READ_CANCELLED)
+ *	:frame	:profile to find the frame from ink projection profiles
+ *		first, falling back to the default :contours engine on sheets
+ *		it cannot validate
+ *	:normalized	true if the files were written by prepShowImage; see
+ *		readNormalized
+ *	:questions	question numbers (0-based) to read, in the order the
+ *		results list them; all of them if not given
+ *	:retries	rungs of the retry ladder (see RetryRung) to try on a
+ *		sheet whose frame, page or regions could not be found, cheapest
+ *		first; 0 (the default) reads each sheet once.  Classified
+ *		results of failed sheets carry a :reason (:noFrame, ...) and
+ *		retried sheets an :attempts count
+ *	:approximate	true (or a stride of 2 to 16) to score cells from
+ *		every fourth (every stride-th) row and column, for a quick first
+ *		pass; needs :classify.  Questions and letters whose estimate is
+ *		too close to call are scored exactly, so the classified answers
+ *		match an exact read with high probability, not always: a stroke
+ *		thinner than the stride can fall between the sampled rows and
+ *		columns.  The rest keep estimated fills and confidences, flagged
+ *		in :approximateAnswers (bit q set) and :approximateName when any
+ *		are
+ *	:priority	:interactive to read the sheets ahead of queued bulk
+ *		batches, on any worker including those Imgproc.threading
+ *		reserves, or :bulk; by default a single file is interactive
+ *		and more are bulk
+ *	:tenant	whose batch this is (a school, an account; any string).
+ *		The pool takes queued bulk sheets from each tenant in turn, so
+ *		a large batch does not hold up a small one queued after it
+ *	:store	path of a result store (see ResultStore.h) to append the
+ *		batch's sheets to as they are read, creating it if need be.
+ *		Raises IOError if it cannot be opened, or once the batch ends
+ *		(every sheet yielded, given a block) if an append failed.
+ *		With :sheets => false the sheets are only stored and readFiles
+ *		returns their number (the :scores and :stats hash, when
+ *		grading).  Read a store back with ResultStore (ResultStore.rb)
  *
+ * Given a block, yields |index, result, score| per sheet in the order they
+ *	finish instead of building the whole array (see readStreaming)
 */
-extern "C" VALUE method_readFiles(VALUE self, VALUE rubyfilenames,
- VALUE rubynumQ, VALUE rubyReadname) {
-	int numQ = NUM2INT( rubynumQ );
-	int numFiles = int( RARRAY_LEN( rubyfilenames ) );
-	bool readName = RTEST( rubyReadname );
-
-	// c-style array of filenames
-	std::vector<std::string> filenames;
-	for( long i = 0; i < numFiles; i++ ) {
-		VALUE rubyfn = rb_ary_entry(rubyfilenames,i);
-		std::string strfname( StringValueCStr( rubyfn ) );
-		filenames.push_back( strfname );
-	}
-
-	ImageReader imr;
-	std::vector< std::vector< std::vector< float > > > results( numFiles );
-    // asynchronize image reads
-    //ResGroup group;
-	//vector<const ResThread::ResultValue*> results;
-	vector< vector< float > > res;
-	for(  int i = 0; i < numFiles; i++ ) {
-        //group.addThread( filenames[i], numQ, readName );
-		res =  imr.readImage( filenames[i], numQ, readName );
-		results[i] = res;
-	}
-    //group.join();
-    //group.getResults( results );
+extern "C" VALUE method_readFiles(int argc, VALUE *argv, VALUE self) {
+	if( rb_block_given_p() ) {
+		return readStreaming( self, argc, argv );
+	}
+	BatchState *state;
+	VALUE rbState = newBatch( state );
+	parseBatchArgs( argc, argv, state->args );
+	startBatch( self, state, state->args.numFiles );
+	return runReadBatch( self, rbState, state, readBatch );
+}
 
-    assert( numFiles == int(results.size()) );
+/**
+ * method_readNormalized - readFiles for pages prepShowImage normalized
+ *	(and a teacher may have edited since).  Each page is read with the
+ *	geometry sidecar prepShowImage wrote next to it, skipping frame
+ *	detection and orientation; a page without one fails with :reason
+ *	:noGeometry.  Pass :questions to re-read just the edited questions.
+ *	Takes the arguments, options and block of readFiles
+ */
+extern "C" VALUE method_readNormalized(int argc, VALUE *argv, VALUE self) {
+	if( argc < 3 || argc > 4 ) {
+		rb_raise( rb_eArgError, "wrong number of arguments (%d for 3..4)", argc );
+	}
+	VALUE args[4] = { argv[0], argv[1], argv[2], rb_hash_new() };
+	if( argc == 4 && !NIL_P( argv[3] ) ) {
+		Check_Type( argv[3], T_HASH );
+		args[3] = rb_funcall( argv[3], rb_intern( "dup" ), 0 );
+	}
+	rb_hash_aset( args[3], ID2SYM( rb_intern( "normalized" ) ), Qtrue );
+	return method_readFiles( 4, args, self );
+}
 
-	VALUE rbStudents = rb_ary_new();
-	// Go through each for each student
-	for( int i = 0; i < numFiles; i++ ) {
-		// Go through each for each student's answers
-		VALUE rbStudentAnswers = rb_ary_new();
-		int sz = int( results[i].size() );
-		for( int k = 0; k < sz; k++ ) {
-			int wsize = int( (results[i])[k].size() );
-			VALUE rbStudentAnswerComponents = rb_ary_new();
-			for( int w = 0; w < wsize; w++ ) {
-				VALUE ansDouble = DBL2NUM( 
-                    (results[i])[k][w] );
-				rb_ary_push( rbStudentAnswerComponents, ansDouble );
-			}
-			rb_ary_push( rbStudentAnswers, rbStudentAnswerComponents );
-		}
-		rb_ary_push( rbStudents, rbStudentAnswers );
+/**
+ * method_readSheets - readFiles for a batch mixing forms: each sheet says
+ *	what it is.  The sheets go to the pool grouped by layout, question
+ *	count and name flag, so the sheets a worker reads in a row share their
+ *	regions, and come back in the order given
+ *
+ * @param	rubysheets	Array of paths, or of hashes with:
+ *	:path	file to read, or
+ *	:data	the encoded image itself (a String of PNG, JPEG, ... bytes)
+ *	:numQ	questions on the sheet
+ *	:readName	true to read the name
+ *	:layout	layout id of the form (only "default" is known)
+ * @param	rubyopts	readFiles options, applied to every sheet, plus
+ *	:numQ and :readName for sheets that do not give their own.  Grade
+ *	(:key) and store (:store) one form at a time with readFiles
+ * @return	Array of one result per sheet, as readFiles returns them
+ */
+extern "C" VALUE method_readSheets(int argc, VALUE *argv, VALUE self) {
+	BatchState *state;
+	VALUE rbState = newBatch( state );
+	BatchArgs &args = state->args;
+	rb_scan_args( argc, argv, "11", &args.rubyfilenames, &args.rubyopts );
+	Check_Type( args.rubyfilenames, T_ARRAY );
+	if( !NIL_P( optionValue( args.rubyopts, "key" ) )
+		|| !NIL_P( optionValue( args.rubyopts, "store" ) ) ) {
+		rb_raise( rb_eArgError,
+			"grade (:key) and store (:store) one form at a time with readFiles" );
+	}
+	args.numQ = 0;
+	args.readName = false;
+	args.numFiles = int( RARRAY_LEN( args.rubyfilenames ) );
+	parseBatchOptions( args );
+	args.sheets.resize( args.numFiles );
+	args.order.resize( args.numFiles );
+	for( int i = 0; i < args.numFiles; i++ ) {
+		parseSheetSpec( rb_ary_entry( args.rubyfilenames, i ), i,
+			args.rubyopts, args.options, args.sheets[i] );
+		args.order[i] = i;
+	}
+	SpecOrder byForm;
+	byForm.specs = &args.sheets;
+	std::stable_sort( args.order.begin(), args.order.end(), byForm );
+
+	startBatch( self, state, args.numFiles );
+	return runReadBatch( self, rbState, state, readBatch );
+}
+
+/**
+ * method_eachResult - Streaming form of readFiles.  Takes the same
+ *	arguments and yields |index, result, score| for each sheet as it
+ *	finishes; without a block, returns an Enumerator over those
+ */
+extern "C" VALUE method_eachResult(int argc, VALUE *argv, VALUE self) {
+	RETURN_ENUMERATOR( self, argc, argv );
+	return readStreaming( self, argc, argv );
+}
+
+/**
+ * method_cancel - Cancels the batches running on this Imgproc.  Sheets not
+ *	yet finished are abandoned with status -6 and the batch returns early;
+ *	batches started afterwards are not affected
+ */
+extern "C" VALUE method_cancel(VALUE self) {
+	ImgprocState *state = getState( self );
+	for( size_t i = 0; i < state->batches.size(); i++ ) {
+		state->batches[i]->token.cancel();
+	}
+	return self;
+}
+
+/**
+ * method_stageTimings - Seconds spent in each reading stage, summed over
+ *	the sheets of the last batch on this Imgproc (:sheets is their count,
+ *	:profileFrames how many of them the :profile frame engine read,
+ *	:retried how many went down the retry ladder and :rescued how many
+ *	of those it read)
+ */
+extern "C" VALUE method_stageTimings(VALUE self) {
+	ImgprocState *state = getState( self );
+	VALUE rbTimings = rb_hash_new();
+	rb_hash_aset( rbTimings, ID2SYM( rb_intern( "sheets" ) ),
+		INT2NUM( state->timedSheets ) );
+	rb_hash_aset( rbTimings, ID2SYM( rb_intern( "profileFrames" ) ),
+		INT2NUM( state->profileFrames ) );
+	rb_hash_aset( rbTimings, ID2SYM( rb_intern( "retried" ) ),
+		INT2NUM( state->retriedSheets ) );
+	rb_hash_aset( rbTimings, ID2SYM( rb_intern( "rescued" ) ),
+		INT2NUM( state->rescuedSheets ) );
+	for( int i = 0; i < NUM_READ_STAGES; i++ ) {
+		rb_hash_aset( rbTimings, ID2SYM( rb_intern( STAGE_NAMES[i] ) ),
+			DBL2NUM( state->stageTotals[i] ) );
+	}
+	return rbTimings;
+}
+
+/**
+ * PrepState - A prepShowImage call.  Like a BatchState it lives on the
+ *	heap, owned by a ruby object, so raising while its arguments are parsed
+ *	or while it is waited on leaks nothing.  Its job has always finished
+ *	by then: the wait sees it through, cancelled or not
+ */
+struct PrepState {
+	PrepJob job;
+	ResBatch batch;
+	BatchCancel cancel;
+
+	PrepState() : batch( 1 ) {
+		job.batch = &batch;
+		job.cancel = &cancel.token;
+		job.reason = REASON_NONE;
 	}
-	return rbStudents;
+};
+
+static void freePrep( void *arg ) {
+	delete static_cast< PrepState* >( arg );
+}
+
+// Queues the job of a prepShowImage call and waits for it on the shared
+//	pool, whose workers keep it off the GVL
+static VALUE runPrep( VALUE arg ) {
+	PrepState *state = reinterpret_cast< PrepState* >( arg );
+	ResPool::shared().submit( &state->job );
+	withoutGvl( joinBatch, &state->batch, &state->cancel.token );
+	return Qnil;
+}
+
+// Releases the pool and unregisters the cancel token of a finished
+//	prepShowImage call
+static VALUE finishPrep( VALUE arg ) {
+	PrepState *state = reinterpret_cast< PrepState* >( arg );
+	poolHolds--;
+	unregisterBatch( state->cancel );
+	return Qnil;
 }
 
 /**
- * prepShowImage - Save normalized image to be viewable for modification
+ * prepShowImage - Save normalized image to be viewable for modification,
+ *	with the geometry sidecar readNormalized reads it back by.  Runs on
+ *	the shared pool, by default as an interactive job: a teacher is
+ *	waiting on it
  * 
  * @param	filename	Name of the file to normalize
+ * @param	outname	Name of the normalized image to write
+ * @param	rubyopts	Optional hash with :priority and :tenant, as for
+ *	readFiles (:priority => :bulk queues it behind batches like any
+ *	bulk sheet)
+ * Raises IOError, naming the reason (:noFrame, :unwritableFile, ...), if
+ *	the image could not be normalized and written.  cancel, or an
+ *	interrupt of the wait, stops it at its next stage (:cancelled)
  */
-extern "C" VALUE method_prepShowImage(VALUE self, VALUE rubyfilename, VALUE rubyoutname) {
-	std::string strfname( StringValueCStr( rubyfilename ) );
-	std::string stroutname( StringValueCStr( rubyoutname) );
-	ImageReader imr;
-	imr.prepShowImage(strfname, stroutname);
+extern "C" VALUE method_prepShowImage(int argc, VALUE *argv, VALUE self) {
+	VALUE rubyfilename, rubyoutname, rubyopts;
+	rb_scan_args( argc, argv, "21", &rubyfilename, &rubyoutname, &rubyopts );
+	PrepState *state = new PrepState;
+	VALUE rbState = Data_Wrap_Struct( 0, 0, freePrep, state );
+	PrepJob &job = state->job;
+	job.filename = StringValueCStr( rubyfilename );
+	job.outname = StringValueCStr( rubyoutname );
+	job.priority = parsePriority( rubyopts, 1 );
+	VALUE rubytenant = optionValue( rubyopts, "tenant" );
+	if( !NIL_P( rubytenant ) ) {
+		VALUE tenant = rb_obj_as_string( rubytenant );
+		job.tenant = StringValueCStr( tenant );
+	}
+
+	// Held while the job may be queued, so threading= cannot change the pool
+	registerBatch( self, state->cancel );
+	poolHolds++;
+	rb_ensure( (rubyf) runPrep, reinterpret_cast< VALUE >( state ),
+		(rubyf) finishPrep, reinterpret_cast< VALUE >( state ) );
+	ReadReason reason = job.reason;
+	DATA_PTR( rbState ) = NULL;
+	delete state;
+	if( reason != REASON_NONE ) {
+		rb_raise( rb_eIOError, "cannot normalize %s: %s",
+			StringValueCStr( rubyfilename ), REASON_NAMES[reason] );
+	}
 	return self;
 }
+
+/**
+ * ManifestRun - A readManifest call.  Like a BatchState it lives on the
+ *	heap, owned by a ruby object, so raising while it is parsed or waited
+ *	on leaks nothing; the shard has always stopped by then
+ */
+struct ManifestRun {
+	ShardRunner runner;
+	BatchCancel cancel;
+	int numQ;
+	bool readName;
+	// What runner.run() returned
+	int numRead;
+
+	ManifestRun( const std::string &manifest, int shard, int numShards,
+		const std::string &outdir )
+		: runner( manifest, shard, numShards, outdir ), numQ( 0 ),
+		readName( false ), numRead( 0 ) {}
+};
+
+static void freeManifest( void *arg ) {
+	delete static_cast< ManifestRun* >( arg );
+}
+
+// Reads the shard of a readManifest call, called without the GVL
+static void *runManifest( void *arg ) {
+	ManifestRun *run = static_cast< ManifestRun* >( arg );
+	run->numRead = run->runner.run( run->numQ, run->readName,
+		&run->cancel.token );
+	return NULL;
+}
+
+static VALUE waitManifest( VALUE arg ) {
+	ManifestRun *run = reinterpret_cast< ManifestRun* >( arg );
+	withoutGvl( runManifest, run, &run->cancel.token );
+	return Qnil;
+}
+
+static VALUE finishManifest( VALUE arg ) {
+	unregisterBatch( reinterpret_cast< ManifestRun* >( arg )->cancel );
+	return Qnil;
+}
+
+/**
+ * readManifest - Reads this process's shard of a manifest into
+ *	<outdir>/shard-<i>-of-<N>.results, resuming from its checkpoint
+ *
+ * @param	rubymanifest	Path of the manifest (one image path per line)
+ * @param	rubyshard	Index of this shard (0 <= shard < numShards)
+ * @param	rubynumShards	Total number of shards
+ * @param	rubyoutdir	Directory for result and checkpoint files
+ * @param	rubynumQ	ruby-formatted number of questions on test
+ * @param	rubyReadname	ruby bool value to determine if name to be read
+ * @return	Number of sheets read by this call.  Raises IOError, naming the
+ *	file and the cause, if the manifest, results or checkpoint cannot be
+ *	read or written.  The shard is read without the GVL; cancel, or an
+ *	interrupt, stops it after the sheet being read, and a later call
+ *	resumes from the checkpoint
+ */
+extern "C" VALUE method_readManifest(VALUE self, VALUE rubymanifest, VALUE rubyshard,
+ VALUE rubynumShards, VALUE rubyoutdir, VALUE rubynumQ, VALUE rubyReadname) {
+	int numQ = parseNumQ( rubynumQ, "numQ" );
+	int shard = NUM2INT( rubyshard );
+	int numShards = NUM2INT( rubynumShards );
+	if( numShards < 1 || shard < 0 || shard >= numShards ) {
+		rb_raise( rb_eArgError, "shard must be between 0 and %d", numShards - 1 );
+	}
+	const char *manifest = StringValueCStr( rubymanifest );
+	const char *outdir = StringValueCStr( rubyoutdir );
+	ManifestRun *run = new ManifestRun( manifest, shard, numShards, outdir );
+	VALUE rbRun = Data_Wrap_Struct( 0, 0, freeManifest, run );
+	run->numQ = numQ;
+	run->readName = RTEST( rubyReadname );
+
+	registerBatch( self, run->cancel );
+	rb_ensure( (rubyf) waitManifest, reinterpret_cast< VALUE >( run ),
+		(rubyf) finishManifest, reinterpret_cast< VALUE >( run ) );
+	int numRead = run->numRead;
+	VALUE rbError = Qnil;
+	if( numRead < 0 ) {
+		rbError = rb_exc_new2( rb_eIOError, run->runner.lastError().c_str() );
+	}
+	DATA_PTR( rbRun ) = NULL;
+	delete run;
+	if( !NIL_P( rbError ) ) {
+		rb_exc_raise( rbError );
+	}
+	return INT2NUM( numRead );
+}
+
+/**
+ * mergeShards - Combines every shard's result file into one file ordered
+ *	as the manifest
+ *
+ * @param	rubymanifest	Path of the manifest the shards were read from
+ * @param	rubynumShards	Total number of shards
+ * @param	rubyoutdir	Directory holding the shard result files
+ * @param	rubymerged	Path of the merged result file
+ * @return	Number of merged sheets, nil if a shard is missing or incomplete
+ */
+extern "C" VALUE method_mergeShards(VALUE self, VALUE rubymanifest, VALUE rubynumShards,
+ VALUE rubyoutdir, VALUE rubymerged) {
+	// Converted first: nothing may raise once the strings are built
+	const char *manifest = StringValueCStr( rubymanifest );
+	const char *outdir = StringValueCStr( rubyoutdir );
+	const char *merged = StringValueCStr( rubymerged );
+	int numShards = NUM2INT( rubynumShards );
+	int numMerged = ShardRunner::merge( manifest, numShards, outdir, merged );
+	if( numMerged < 0 ) {
+		return Qnil;
+	}
+	return INT2NUM( numMerged );
+}
+
+// Serves until the server is stopped, called without the GVL
+static void *runServer( void *server ) {
+	static_cast< GradeServer* >( server )->run();
+	return NULL;
+}
+
+// Unblocking function: an interrupted serve (Ctrl-C, SIGTERM) stops the
+//	server, which cancels its sheets and closes its connections
+static void stopServer( void *server ) {
+	static_cast< GradeServer* >( server )->stop();
+}
+
+static VALUE serveBody( VALUE arg ) {
+	GradeServer *server = reinterpret_cast< GradeServer* >( arg );
+#ifdef HAVE_RB_THREAD_CALL_WITHOUT_GVL
+	rb_thread_call_without_gvl( runServer, server, stopServer, server );
+#else
+	rb_thread_blocking_region( (rb_blocking_function_t*) runServer, server,
+		stopServer, server );
+#endif
+	return Qnil;
+}
+
+static VALUE serveEnsure( VALUE arg ) {
+	delete reinterpret_cast< GradeServer* >( arg );
+	poolHolds--;
+	return Qnil;
+}
+
+/**
+ * method_serve - Imgproc.serve: runs a resident grading server on a Unix
+ *	domain socket until interrupted (see GradeServer.h and
+ *	ImgprocClient.rb)
+ *
+ * @param	rubypath	Path of the socket file
+ * @param	rubyopts	Optional hash:
+ *	:maxQueued	most sheets queued or unsent across all clients
+ *		(default four per pool worker)
+ *	:mode	permissions of the socket file (default 0660)
+ */
+extern "C" VALUE method_serve(int argc, VALUE *argv, VALUE self) {
+	VALUE rubypath, rubyopts;
+	rb_scan_args( argc, argv, "11", &rubypath, &rubyopts );
+	std::string strpath( StringValueCStr( rubypath ) );
+	VALUE rubymaxQueued = optionValue( rubyopts, "maxQueued" );
+	VALUE rubymode = optionValue( rubyopts, "mode" );
+	int maxQueued = NIL_P( rubymaxQueued ) ? 0 : NUM2INT( rubymaxQueued );
+	int mode = NIL_P( rubymode ) ? 0660 : NUM2INT( rubymode );
+
+	GradeServer *server = new GradeServer( strpath, maxQueued, mode );
+	if( !server->start() ) {
+		delete server;
+		rb_sys_fail( strpath.c_str() );
+	}
+	poolHolds++;
+	rb_ensure( (rubyf) serveBody, reinterpret_cast< VALUE >( server ),
+		(rubyf) serveEnsure, reinterpret_cast< VALUE >( server ) );
+	return Qnil;
+}
+
+// Ruby names of the ThreadPolicy pinning modes
+static const char *PIN_NAMES[] = { "none", "cores", "numa" };
+
+/**
+ * method_threading - Imgproc.threading: the threading policy of the shared
+ *	worker pool, as a hash with :workers, :cvThreads (0 if OpenCV's own
+ *	setting is kept), :pin and :reserved, plus the machine's :cores (CPUs this process
+ *	may use) and :numaNodes for choosing a policy
+ */
+extern "C" VALUE method_threading(VALUE self) {
+	ThreadPolicy policy = ResPool::sharedPolicy();
+	if( policy.workers < 1 ) {
+		// Not created yet: report what it will get
+		int perWorker = policy.cvThreads < 1 ? 1 : policy.cvThreads;
+		policy.workers = std::max( 1, ResPool::defaultWorkers() / perWorker );
+	}
+	VALUE rbPolicy = rb_hash_new();
+	rb_hash_aset( rbPolicy, ID2SYM( rb_intern( "workers" ) ),
+		INT2NUM( policy.workers ) );
+	rb_hash_aset( rbPolicy, ID2SYM( rb_intern( "cvThreads" ) ),
+		INT2NUM( policy.cvThreads ) );
+	rb_hash_aset( rbPolicy, ID2SYM( rb_intern( "pin" ) ),
+		ID2SYM( rb_intern( PIN_NAMES[policy.pin] ) ) );
+	rb_hash_aset( rbPolicy, ID2SYM( rb_intern( "reserved" ) ),
+		INT2NUM( std::min( policy.reserved, policy.workers - 1 ) ) );
+	rb_hash_aset( rbPolicy, ID2SYM( rb_intern( "cores" ) ),
+		INT2NUM( ResPool::defaultWorkers() ) );
+	rb_hash_aset( rbPolicy, ID2SYM( rb_intern( "numaNodes" ) ),
+		INT2NUM( ResPool::numaNodes() ) );
+	return rbPolicy;
+}
+
+/**
+ * method_setThreading - Imgproc.threading = opts: rebuilds the shared
+ *	worker pool under a new policy.  Keys left out take their defaults,
+ *	not their current values.  Raises if batches are still running.
+ *
+ * @param	rubyopts	Hash:
+ *	:workers	batch workers (default: cores / cvThreads)
+ *	:cvThreads	threads OpenCV may use inside one worker's call
+ *		(default 1, so only the workers run in parallel; nil or 0
+ *		keeps OpenCV's own setting)
+ *	:pin	:none (default), :cores (each worker on its own cvThreads
+ *		CPUs) or :numa (workers dealt round-robin to NUMA nodes)
+ *	:reserved	workers kept for interactive sheets (prepShowImage,
+ *		single-sheet reads; see readFiles :priority), so one is free
+ *		for them however much bulk work is queued (default 0: they
+ *		only go ahead of the queue)
+ */
+extern "C" VALUE method_setThreading(VALUE self, VALUE rubyopts) {
+	Check_Type( rubyopts, T_HASH );
+	ThreadPolicy policy;
+	VALUE val;
+	if( !NIL_P( val = optionValue( rubyopts, "workers" ) ) ) {
+		policy.workers = NUM2INT( val );
+	}
+	if( RTEST( rb_funcall( rubyopts, rb_intern( "key?" ), 1,
+		ID2SYM( rb_intern( "cvThreads" ) ) ) ) ) {
+		val = optionValue( rubyopts, "cvThreads" );
+		policy.cvThreads = NIL_P( val ) ? 0 : NUM2INT( val );
+	}
+	if( !NIL_P( val = optionValue( rubyopts, "pin" ) ) ) {
+		ID pin = SYM2ID( rb_funcall( val, rb_intern( "to_sym" ), 0 ) );
+		if( pin == rb_intern( "none" ) ) {
+			policy.pin = ThreadPolicy::PIN_NONE;
+		} else if( pin == rb_intern( "cores" ) ) {
+			policy.pin = ThreadPolicy::PIN_CORES;
+		} else if( pin == rb_intern( "numa" ) ) {
+			policy.pin = ThreadPolicy::PIN_NUMA;
+		} else {
+			rb_raise( rb_eArgError, ":pin must be :none, :cores or :numa" );
+		}
+	}
+	if( !NIL_P( val = optionValue( rubyopts, "reserved" ) ) ) {
+		policy.reserved = NUM2INT( val );
+		if( policy.reserved < 0 ) {
+			rb_raise( rb_eArgError, ":reserved must not be negative" );
+		}
+	}
+	if( poolHolds > 0 || !ResPool::configure( policy ) ) {
+		rb_raise( rb_eRuntimeError,
+			"threading cannot change while batches are running" );
+	}
+	return rubyopts;
+}
+
+// Ruby names of the ResJob priority classes
+static const char *PRIORITY_NAMES[] = { "interactive", "bulk" };
+
+/**
+ * method_queueWaits - Imgproc.queueWaits(reset = false): how long the
+ *	shared pool's jobs waited for a worker, per priority class, as
+ *	{:interactive => waits, :bulk => waits}.  Each waits hash has :queued
+ *	(waiting now), :jobs (taken by a worker) and, in seconds, :mean, :max
+ *	and :p50, :p95 and :p99 (to within a quarter octave).  With reset true,
+ *	the counts start over after being read.
+ */
+extern "C" VALUE method_queueWaits(int argc, VALUE *argv, VALUE self) {
+	VALUE rubyreset;
+	rb_scan_args( argc, argv, "01", &rubyreset );
+	ResPool &pool = ResPool::shared();
+	VALUE rbWaits = rb_hash_new();
+	for( int p = 0; p < ResJob::NUM_PRIORITIES; p++ ) {
+		QueueWaits waits = pool.queueWaits( ResJob::Priority( p ) );
+		VALUE rbClass = rb_hash_new();
+		rb_hash_aset( rbClass, ID2SYM( rb_intern( "queued" ) ),
+			INT2NUM( waits.queued ) );
+		rb_hash_aset( rbClass, ID2SYM( rb_intern( "jobs" ) ),
+			LONG2NUM( waits.jobs ) );
+		rb_hash_aset( rbClass, ID2SYM( rb_intern( "mean" ) ),
+			DBL2NUM( waits.jobs > 0 ? waits.totalSeconds / waits.jobs : 0 ) );
+		rb_hash_aset( rbClass, ID2SYM( rb_intern( "max" ) ),
+			DBL2NUM( waits.maxSeconds ) );
+		rb_hash_aset( rbClass, ID2SYM( rb_intern( "p50" ) ),
+			DBL2NUM( waits.percentile( 0.50 ) ) );
+		rb_hash_aset( rbClass, ID2SYM( rb_intern( "p95" ) ),
+			DBL2NUM( waits.percentile( 0.95 ) ) );
+		rb_hash_aset( rbClass, ID2SYM( rb_intern( "p99" ) ),
+			DBL2NUM( waits.percentile( 0.99 ) ) );
+		rb_hash_aset( rbWaits, ID2SYM( rb_intern( PRIORITY_NAMES[p] ) ),
+			rbClass );
+	}
+	if( RTEST( rubyreset ) ) {
+		pool.resetQueueWaits();
+	}
+	return rbWaits;
+}
+
+/**
+ * method_tracing - Imgproc.tracing: whether reading spans are being
+ *	recorded for dumpTrace
+ */
+extern "C" VALUE method_tracing(VALUE self) {
+	return Tracer::enabled() ? Qtrue : Qfalse;
+}
+
+/**
+ * method_setTracing - Imgproc.tracing = on: starts or stops recording the
+ *	stages of every sheet read (decode, frame, orient, threshold, answers,
+ *	name, classify, preview encode), each pool job's queue wait and each
+ *	batch's wait, per thread.  Starting clears the spans recorded before.
+ *	Off by default; while off the stages cost one flag check each.
+ */
+extern "C" VALUE method_setTracing(VALUE self, VALUE rubyon) {
+	Tracer::enable( RTEST( rubyon ) );
+	return rubyon;
+}
+
+/**
+ * method_dumpTrace - Imgproc.dumpTrace(path): writes the recorded spans as
+ *	Chrome trace-event JSON, for chrome://tracing or ui.perfetto.dev.  Each
+ *	thread keeps its last Tracer::RING_EVENTS spans.  Tracing may stay on.
+ *
+ * @param	rubypath	file to write (replaced whole)
+ * @return	the number of spans written
+ */
+extern "C" VALUE method_dumpTrace(VALUE self, VALUE rubypath) {
+	std::string path = StringValueCStr( rubypath );
+	long events = Tracer::dump( path );
+	if( events < 0 ) {
+		rb_raise( rb_eIOError, "cannot write trace %s", path.c_str() );
+	}
+	return LONG2NUM( events );
+}
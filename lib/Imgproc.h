@@ -16,12 +16,49 @@ void Init_Imgproc();
 VALUE method_init(VALUE self);
 
 // Reads the filenames with the specified number of questions and
-// 	boolean to read the name or not
-VALUE method_readFiles(VALUE self, VALUE rubyfilenames,
- VALUE rubynumQ, VALUE rubyReadname);
+// 	boolean to read the name or not, plus an optional options hash
+VALUE method_readFiles(int argc, VALUE *argv, VALUE self);
+
+// Yields each file's result as soon as it is read (Enumerator without a block)
+VALUE method_eachResult(int argc, VALUE *argv, VALUE self);
+
+// readFiles for pages prepShowImage normalized, without calibrating
+VALUE method_readNormalized(int argc, VALUE *argv, VALUE self);
+
+// readFiles for sheets of different forms, each described on its own
+VALUE method_readSheets(int argc, VALUE *argv, VALUE self);
+
+// Cancels the batches running on this instance
+VALUE method_cancel(VALUE self);
+
+// Per-stage reading times of the last batch on this instance
+VALUE method_stageTimings(VALUE self);
 
 // Normalizes and saves image for further viewing
-VALUE method_prepShowImage(VALUE self, VALUE rubyfilename, VALUE rubyoutname);
+VALUE method_prepShowImage(int argc, VALUE *argv, VALUE self);
+
+// Reads one shard of a manifest, resuming from its checkpoint
+VALUE method_readManifest(VALUE self, VALUE rubymanifest, VALUE rubyshard,
+ VALUE rubynumShards, VALUE rubyoutdir, VALUE rubynumQ, VALUE rubyReadname);
+
+// Merges the result files of all shards into manifest order
+VALUE method_mergeShards(VALUE self, VALUE rubymanifest, VALUE rubynumShards,
+ VALUE rubyoutdir, VALUE rubymerged);
+
+// Runs a resident grading server on a Unix domain socket (class method)
+VALUE method_serve(int argc, VALUE *argv, VALUE self);
+
+// Threading policy of the shared worker pool (class methods)
+VALUE method_threading(VALUE self);
+VALUE method_setThreading(VALUE self, VALUE rubyopts);
+
+// Queue waits of the shared pool per priority class (class method)
+VALUE method_queueWaits(int argc, VALUE *argv, VALUE self);
+
+// Records reading spans and dumps them as a Chrome trace (class methods)
+VALUE method_tracing(VALUE self);
+VALUE method_setTracing(VALUE self, VALUE rubyon);
+VALUE method_dumpTrace(VALUE self, VALUE rubypath);
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,298 @@
+# ImgprocClient - Imgproc's reading API, served by a resident grading server
+#
+# Start one server per host (bin/gsimgproc-server, or Imgproc.serve), then
+# use an ImgprocClient wherever an Imgproc was used:
+#
+#   iproc = ImgprocClient.new("/tmp/gsimgproc.sock")
+#   results = iproc.readFiles(files, 50, true, :classify => true)
+#
+# readFiles, readNormalized, readSheets, eachResult and prepShowImage
+# return what Imgproc's do, except that answer keys (:key), result stores
+# (:store) and sheets in memory are not sent to the server; grade, store
+# and read those with a local Imgproc.  Paths are expanded here since the
+# server has its own working directory.  One client holds one connection;
+# calls on it are serialized.  :priority is sent along, but :tenant is
+# not: the server shares bulk work between its connections instead.
+
+require 'socket'
+
+class ImgprocClient
+
+  DEFAULT_SOCKET = "/tmp/gsimgproc.sock"
+
+  # Must match GradeServer.h
+  OP_READ = 1
+  OP_PREP = 2
+  OP_STATUS = 3
+
+  REPLY_SHEET = 1
+  REPLY_DONE = 2
+  REPLY_ERROR = 3
+  REPLY_STATUS = 4
+  REPLY_FAILED = 5
+
+  READ_NAME = 1
+  READ_CLASSIFY = 2
+  READ_WARP_FREE = 4
+  READ_PROFILE_FRAME = 8
+  READ_NORMALIZED = 16
+  READ_APPROXIMATE = 32
+  READ_INTERACTIVE = 64
+
+  # The one stride the server subsamples at with READ_APPROXIMATE
+  APPROXIMATE_STRIDE = 4
+
+  # ReadReason names, as Imgproc reports them
+  REASONS = [:none, :unreadableFile, :noFrame, :noOrientationBox,
+             :pageOutOfBounds, :regionOutOfBounds, :timeout, :cancelled,
+             :opencvError, :unwritableFile, :noGeometry]
+
+  class ServerError < StandardError; end
+
+  def initialize(socketPath = DEFAULT_SOCKET)
+    @socketPath = socketPath
+    @socket = nil
+    @lock = Mutex.new
+  end
+
+  # Same arguments and results as Imgproc#readFiles.  Given a block, yields
+  # |index, result, nil| per sheet as the server finishes it
+  def readFiles(filenames, numQ, readName, opts = {})
+    raise ArgumentError, "grading (:key) needs a local Imgproc" if opts[:key]
+    raise ArgumentError, "storing results (:store) needs a local Imgproc" if opts[:store]
+    classify = opts[:classify]
+    results = block_given? ? nil : Array.new(filenames.size)
+    count = 0
+    request(read_request(filenames, numQ, readName, opts)) do |type, body|
+      case type
+      when REPLY_SHEET
+        index, result = decode_sheet(body, classify)
+        if results
+          results[index] = result
+        else
+          yield index, result, nil
+        end
+        count += 1
+        false
+      when REPLY_DONE
+        true
+      else
+        unexpected(type, body)
+      end
+    end
+    results || count
+  end
+
+  # Same as Imgproc#readNormalized: readFiles for pages prepShowImage wrote
+  def readNormalized(filenames, numQ, readName, opts = {}, &block)
+    readFiles(filenames, numQ, readName, opts.merge(:normalized => true), &block)
+  end
+
+  # Same as Imgproc#readSheets, for sheets given by path: one readFiles
+  # request per question count and name flag, results in the order given
+  def readSheets(sheets, opts = {})
+    if opts[:key] || opts[:store]
+      raise ArgumentError, "grade (:key) and store (:store) one form at a time with readFiles"
+    end
+    specs = sheets.each_with_index.map do |sheet, i|
+      sheet = { :path => sheet } unless sheet.is_a?(Hash)
+      raise ArgumentError, "sheet #{i}: in-memory sheets (:data) need a local Imgproc" if sheet[:data]
+      raise ArgumentError, "sheet #{i} needs one of :path and :data" unless sheet[:path]
+      layout = (sheet[:layout] || "default").to_s
+      raise ArgumentError, "sheet #{i}: unknown layout #{layout}" unless layout == "default"
+      numQ = sheet[:numQ] || opts[:numQ]
+      raise ArgumentError, "sheet #{i} has no :numQ" unless numQ
+      readName = sheet.key?(:readName) ? sheet[:readName] : opts[:readName]
+      [sheet[:path], numQ, !!readName]
+    end
+    priority = opts[:priority] || (sheets.size == 1 ? :interactive : :bulk)
+    results = Array.new(sheets.size)
+    (0...specs.size).group_by { |i| specs[i][1, 2] }.each do |(numQ, readName), indices|
+      read = readFiles(indices.map { |i| specs[i][0] }, numQ, readName,
+                       opts.merge(:priority => priority))
+      indices.each_with_index { |i, k| results[i] = read[k] }
+    end
+    results
+  end
+
+  # Same as Imgproc#eachResult: an Enumerator without a block
+  def eachResult(filenames, numQ, readName, opts = {}, &block)
+    return enum_for(:eachResult, filenames, numQ, readName, opts) unless block
+    readFiles(filenames, numQ, readName, opts, &block)
+  end
+
+  # Same as Imgproc#prepShowImage, but the server always reads previews
+  # as interactive
+  def prepShowImage(filename, outname, opts = {})
+    if opts[:priority] && opts[:priority].to_sym != :interactive
+      raise ArgumentError, "the server reads previews as :interactive"
+    end
+    body = [OP_PREP].pack("C") + string(File.expand_path(filename)) +
+      string(File.expand_path(outname))
+    # Raised once the reply is in, so the connection stays usable
+    failed = nil
+    request(body) do |type, reply|
+      if type == REPLY_FAILED
+        failed = REASONS[reply.unpack("C")[0]]
+      else
+        unexpected(type, reply) unless type == REPLY_DONE
+      end
+      true
+    end
+    raise IOError, "cannot normalize #{filename}: #{failed}" if failed
+    self
+  end
+
+  # {:workers, :maxQueued, :queued, :connections, :sheetsRead} of the
+  # server, plus :queueWaits as Imgproc.queueWaits reports them
+  def status
+    values = nil
+    request([OP_STATUS].pack("C")) do |type, body|
+      unexpected(type, body) unless type == REPLY_STATUS
+      values = body.unpack("L5" + "L2f5" * 2)
+      true
+    end
+    status = Hash[[:workers, :maxQueued, :queued, :connections, :sheetsRead].zip(values)]
+    waits = values[5..-1].each_slice(7).map do |slice|
+      Hash[[:queued, :jobs, :mean, :max, :p50, :p95, :p99].zip(slice)]
+    end
+    status[:queueWaits] = { :interactive => waits[0], :bulk => waits[1] }
+    status
+  end
+
+  def close
+    @lock.synchronize do
+      @socket.close if @socket
+      @socket = nil
+    end
+  end
+
+  private
+
+  def read_request(filenames, numQ, readName, opts)
+    flags = 0
+    flags |= READ_NAME if readName
+    flags |= READ_CLASSIFY if opts[:classify]
+    flags |= READ_WARP_FREE if opts[:warpFree]
+    flags |= READ_PROFILE_FRAME if opts[:frame] && opts[:frame].to_sym == :profile
+    flags |= READ_NORMALIZED if opts[:normalized]
+    approximate = opts[:approximate]
+    if approximate && approximate != 1
+      unless approximate == true || approximate == APPROXIMATE_STRIDE
+        raise ArgumentError, "the server only subsamples at a stride of #{APPROXIMATE_STRIDE}"
+      end
+      raise ArgumentError, ":approximate needs :classify" unless opts[:classify]
+      flags |= READ_APPROXIMATE
+    end
+    # As in Imgproc, a single file is interactive unless asked otherwise
+    priority = opts[:priority] || (filenames.size == 1 ? :interactive : :bulk)
+    unless [:interactive, :bulk].include?(priority.to_sym)
+      raise ArgumentError, ":priority must be :interactive or :bulk"
+    end
+    flags |= READ_INTERACTIVE if priority.to_sym == :interactive
+    # Negative thresholds keep the server's defaults
+    retries = (opts[:retries] || 0).to_i
+    raise ArgumentError, ":retries must not be negative" if retries < 0
+    body = [OP_READ, flags, [retries, 255].min, numQ,
+            (opts[:fillThreshold] || -1).to_f, (opts[:marginThreshold] || -1).to_f,
+            (opts[:timeout] || 0).to_f, filenames.size].pack("CCCLfffL")
+    filenames.each { |f| body << string(File.expand_path(f)) }
+    questions = opts[:questions] || []
+    unless questions.all? { |q| q.is_a?(Integer) && q >= 0 && q < numQ }
+      raise ArgumentError, ":questions must be between 0 and #{numQ - 1}"
+    end
+    body << [questions.size, *questions].pack("L*")
+  end
+
+  # Sends one request and hands each reply frame to the block until it
+  # returns true.  A connection left mid-reply (a broken connection, or a
+  # block that broke out early) is dropped, which cancels its sheets on
+  # the server
+  def request(body)
+    @lock.synchronize do
+      finished = false
+      begin
+        @socket ||= UNIXSocket.new(@socketPath)
+        @socket.write([body.bytesize].pack("L") + body)
+        until finished
+          length = read_exactly(4).unpack("L")[0]
+          frame = read_exactly(length)
+          finished = yield(frame.getbyte(0), frame.byteslice(1, length - 1))
+        end
+      ensure
+        unless finished
+          @socket.close if @socket && !@socket.closed?
+          @socket = nil
+        end
+      end
+    end
+  end
+
+  def read_exactly(n)
+    data = @socket.read(n)
+    raise IOError, "grading server closed the connection" if data.nil? || data.bytesize < n
+    data
+  end
+
+  def string(s)
+    s = s.b
+    [s.bytesize].pack("L") + s
+  end
+
+  def unexpected(type, body)
+    if type == REPLY_ERROR
+      n = body.unpack("L")[0]
+      raise ServerError, body.byteslice(4, n)
+    end
+    raise ServerError, "unexpected reply #{type}"
+  end
+
+  # Builds the result Imgproc would return for one REPLY_SHEET
+  def decode_sheet(body, classify)
+    pos = 0
+    take = lambda do |format, size, count|
+      values = body.byteslice(pos, size * count).unpack("#{format}#{count}")
+      pos += size * count
+      values
+    end
+    array = lambda do |format, size|
+      n = take.call("L", 4, 1)[0]
+      take.call(format, size, n)
+    end
+
+    index, status = take.call("L", 4, 1)[0], take.call("l", 4, 1)[0]
+    rows = Array.new(take.call("L", 4, 1)[0]) { array.call("f", 4) }
+    name = array.call("f", 4)
+    codes = array.call("C", 1)
+    confidence = array.call("f", 4)
+    ambiguous = array.call("L", 4)
+    nameCodes = array.call("c", 1)
+    nameConfidence = array.call("f", 4)
+    ambiguousName = take.call("L", 4, 1)[0]
+    reason, attempts = take.call("C", 1, 2)
+    approximate = array.call("L", 4)
+    approximateName = take.call("L", 4, 1)[0]
+
+    if classify
+      sheet = { :status => status }
+      sheet[:attempts] = attempts if attempts > 1
+      if status != 0
+        sheet[:reason] = REASONS[reason]
+      else
+        sheet[:answers] = codes
+        sheet[:confidence] = confidence
+        sheet[:ambiguousAnswers] = ambiguous.reverse.inject(0) { |bits, w| bits << 32 | w }
+        sheet[:name] = nameCodes
+        sheet[:nameConfidence] = nameConfidence
+        sheet[:ambiguousName] = ambiguousName
+        if approximateName != 0 || approximate.any? { |w| w != 0 }
+          sheet[:approximateAnswers] = approximate.reverse.inject(0) { |bits, w| bits << 32 | w }
+          sheet[:approximateName] = approximateName
+        end
+      end
+      return index, sheet
+    end
+    return index, rows + [status == 0 ? name : [status.to_f]]
+  end
+
+end
@@ -5,6 +5,11 @@
 
 #include "ResThread.h"
 
+#include <cmath>
+#include <cstdio>
+#include <sched.h>
+#include <unistd.h>
+
 using namespace std;
 using namespace gsweb;
 
@@ -101,4 +106,508 @@ void ResGroup::join()
     for ( it = myThreads.begin(); it != myThreads.end(); ++it ) {
         (*it)->join();
     }
-}
\ No newline at end of file
+}
+
+ResJob::ResJob()
+    : priority( PRIORITY_BULK ),
+        queuedAt( -1 )
+{}
+
+ResJob::~ResJob()
+{}
+
+// Upper bound of the first QueueWaits bucket, in seconds
+static const double WAIT_FLOOR = 0.0001;
+
+QueueWaits::QueueWaits()
+    : queued( 0 ),
+        jobs( 0 ),
+        totalSeconds( 0 ),
+        maxSeconds( 0 )
+{
+    for ( int i = 0; i < BUCKETS; ++i ) {
+        buckets[i] = 0;
+    }
+}
+
+void QueueWaits::add( double seconds )
+{
+    ++jobs;
+    totalSeconds += seconds;
+    if ( seconds > maxSeconds ) {
+        maxSeconds = seconds;
+    }
+    int bucket = 0;
+    if ( seconds >= WAIT_FLOOR ) {
+        bucket = 1 + int( 4 * log2( seconds / WAIT_FLOOR ) );
+        if ( bucket >= BUCKETS ) {
+            bucket = BUCKETS - 1;
+        }
+    }
+    ++buckets[bucket];
+}
+
+double QueueWaits::percentile( double p ) const
+{
+    if ( jobs == 0 ) {
+        return 0;
+    }
+    long rank = long( ceil( p * jobs ) );
+    if ( rank < 1 ) {
+        rank = 1;
+    }
+    long seen = 0;
+    for ( int i = 0; i < BUCKETS; ++i ) {
+        seen += buckets[i];
+        if ( seen >= rank ) {
+            double upper = WAIT_FLOOR * pow( 2.0, i / 4.0 );
+            return upper < maxSeconds ? upper : maxSeconds;
+        }
+    }
+    return maxSeconds;
+}
+
+ThreadPolicy::ThreadPolicy()
+    : workers( 0 ),
+        cvThreads( 1 ),
+        pin( PIN_NONE ),
+        reserved( 0 )
+{}
+
+// CPUs this process may run on
+static void allowedCpus( std::vector<int>& cpus )
+{
+    cpus.clear();
+    cpu_set_t set;
+    CPU_ZERO( &set );
+    if ( sched_getaffinity( 0, sizeof( set ), &set ) == 0 ) {
+        for ( int cpu = 0; cpu < CPU_SETSIZE; ++cpu ) {
+            if ( CPU_ISSET( cpu, &set ) ) {
+                cpus.push_back( cpu );
+            }
+        }
+    }
+    if ( cpus.empty() ) {
+        long online = sysconf( _SC_NPROCESSORS_ONLN );
+        for ( int cpu = 0; cpu < online; ++cpu ) {
+            cpus.push_back( cpu );
+        }
+    }
+}
+
+// Allowed CPUs of each NUMA node, from /sys/devices/system/node/node<n>/cpulist
+// ("0-15,32-47"); nodes without any are left out
+static void numaCpus( std::vector<std::vector<int> >& nodes )
+{
+    nodes.clear();
+    std::vector<int> allowed;
+    allowedCpus( allowed );
+    std::vector<bool> isAllowed( allowed.empty() ? 0 : allowed.back() + 1, false );
+    for ( size_t i = 0; i < allowed.size(); ++i ) {
+        isAllowed[allowed[i]] = true;
+    }
+    for ( int node = 0; node < 1024; ++node ) {
+        char path[64];
+        snprintf( path, sizeof( path ),
+                  "/sys/devices/system/node/node%d/cpulist", node );
+        FILE* in = fopen( path, "r" );
+        if ( in == NULL ) {
+            continue;
+        }
+        std::vector<int> cpus;
+        int first, last;
+        while ( fscanf( in, "%d", &first ) == 1 ) {
+            last = first;
+            int c = fgetc( in );
+            if ( c == '-' && fscanf( in, "%d", &last ) == 1 ) {
+                c = fgetc( in );
+            }
+            for ( int cpu = first; cpu <= last; ++cpu ) {
+                if ( cpu < int(isAllowed.size()) && isAllowed[cpu] ) {
+                    cpus.push_back( cpu );
+                }
+            }
+            if ( c != ',' ) {
+                break;
+            }
+        }
+        fclose( in );
+        if ( !cpus.empty() ) {
+            nodes.push_back( cpus );
+        }
+    }
+}
+
+ResPool::ResPool( int numWorkers )
+    : bulkQueued( 0 ),
+        stopping( false )
+{
+    // Leaves OpenCV's own threading alone
+    myPolicy.workers = numWorkers < 1 ? 1 : numWorkers;
+    myPolicy.cvThreads = 0;
+    start();
+}
+
+ResPool::ResPool( const ThreadPolicy& policy )
+    : myPolicy( policy ),
+        bulkQueued( 0 ),
+        stopping( false )
+{
+    if ( myPolicy.workers < 1 ) {
+        int perWorker = myPolicy.cvThreads < 1 ? 1 : myPolicy.cvThreads;
+        myPolicy.workers = defaultWorkers() / perWorker;
+        if ( myPolicy.workers < 1 ) {
+            myPolicy.workers = 1;
+        }
+    }
+    start();
+}
+
+void ResPool::start()
+{
+    // OpenCV's thread count is process-wide: each worker's warps and
+    // thresholds split over at most cvThreads threads, so workers times
+    // cvThreads is what the pool asks of the machine
+    if ( myPolicy.cvThreads > 0 ) {
+        cv::setNumThreads( myPolicy.cvThreads );
+    }
+    // Some worker must be left for bulk jobs
+    if ( myPolicy.reserved > myPolicy.workers - 1 ) {
+        myPolicy.reserved = myPolicy.workers - 1;
+    }
+    if ( myPolicy.reserved < 0 ) {
+        myPolicy.reserved = 0;
+    }
+    workers.resize( myPolicy.workers );
+    pthread_mutex_init( &lock, NULL );
+    pthread_cond_init( &jobReady, NULL );
+    pthread_cond_init( &interactiveReady, NULL );
+    for ( size_t i = 0; i < workers.size(); ++i ) {
+        workers[i].pool = this;
+        workers[i].index = int(i);
+        pthread_create( &workers[i].thread, NULL,
+                        (thread_f) &ResPool::implWorker, &workers[i] );
+    }
+}
+
+ResPool::~ResPool()
+{
+    pthread_mutex_lock( &lock );
+    stopping = true;
+    pthread_cond_broadcast( &jobReady );
+    pthread_cond_broadcast( &interactiveReady );
+    pthread_mutex_unlock( &lock );
+    for ( size_t i = 0; i < workers.size(); ++i ) {
+        pthread_join( workers[i].thread, NULL );
+    }
+    pthread_cond_destroy( &interactiveReady );
+    pthread_cond_destroy( &jobReady );
+    pthread_mutex_destroy( &lock );
+}
+
+void ResPool::submit( ResJob* job )
+{
+    job->queuedAt = Tracer::now();
+    pthread_mutex_lock( &lock );
+    if ( job->priority == ResJob::PRIORITY_INTERACTIVE ) {
+        interactive.push_back( job );
+        pthread_cond_signal( &interactiveReady );
+    } else {
+        std::deque<ResJob*>& queue = bulk[job->tenant];
+        if ( queue.empty() ) {
+            turns.push_back( job->tenant );
+        }
+        queue.push_back( job );
+        ++bulkQueued;
+    }
+    pthread_cond_signal( &jobReady );
+    pthread_mutex_unlock( &lock );
+}
+
+ResJob* ResPool::take( bool reserved )
+{
+    if ( !interactive.empty() ) {
+        ResJob* job = interactive.front();
+        interactive.pop_front();
+        return job;
+    }
+    if ( reserved || turns.empty() ) {
+        return NULL;
+    }
+    std::string tenant = turns.front();
+    turns.pop_front();
+    std::map<std::string, std::deque<ResJob*> >::iterator it = bulk.find( tenant );
+    ResJob* job = it->second.front();
+    it->second.pop_front();
+    if ( it->second.empty() ) {
+        bulk.erase( it );
+    } else {
+        turns.push_back( tenant );
+    }
+    --bulkQueued;
+    return job;
+}
+
+int ResPool::size() const
+{
+    return int(workers.size());
+}
+
+const ThreadPolicy& ResPool::policy() const
+{
+    return myPolicy;
+}
+
+int ResPool::queued()
+{
+    pthread_mutex_lock( &lock );
+    int numQueued = int(interactive.size()) + bulkQueued;
+    pthread_mutex_unlock( &lock );
+    return numQueued;
+}
+
+QueueWaits ResPool::queueWaits( ResJob::Priority priority )
+{
+    pthread_mutex_lock( &lock );
+    QueueWaits result = waits[priority];
+    result.queued = priority == ResJob::PRIORITY_INTERACTIVE
+        ? int(interactive.size()) : bulkQueued;
+    pthread_mutex_unlock( &lock );
+    return result;
+}
+
+void ResPool::resetQueueWaits()
+{
+    pthread_mutex_lock( &lock );
+    for ( int i = 0; i < ResJob::NUM_PRIORITIES; ++i ) {
+        waits[i] = QueueWaits();
+    }
+    pthread_mutex_unlock( &lock );
+}
+
+static ResPool* sharedPool = NULL;
+static pthread_mutex_t sharedPoolLock = PTHREAD_MUTEX_INITIALIZER;
+// Policy the shared pool is built with, as configure() last set it
+static ThreadPolicy sharedPoolPolicy;
+
+// fork() holds sharedPoolLock, so the child never inherits it locked by a
+// thread that is not there
+static void lockSharedPool()
+{
+    pthread_mutex_lock( &sharedPoolLock );
+}
+
+static void unlockSharedPool()
+{
+    pthread_mutex_unlock( &sharedPoolLock );
+}
+
+// Worker threads do not survive fork(); a forked child (e.g. a preforking
+// app server worker) builds its own pool on first use, under the policy
+// the parent configured
+static void forgetSharedPool()
+{
+    sharedPool = NULL;
+    pthread_mutex_unlock( &sharedPoolLock );
+}
+
+static pthread_once_t forkHandlersSet = PTHREAD_ONCE_INIT;
+
+static void setForkHandlers()
+{
+    pthread_atfork( lockSharedPool, unlockSharedPool, forgetSharedPool );
+}
+
+ResPool& ResPool::shared()
+{
+    pthread_once( &forkHandlersSet, setForkHandlers );
+    pthread_mutex_lock( &sharedPoolLock );
+    if ( sharedPool == NULL ) {
+        sharedPool = new ResPool( sharedPoolPolicy );
+    }
+    ResPool* pool = sharedPool;
+    pthread_mutex_unlock( &sharedPoolLock );
+    return *pool;
+}
+
+bool ResPool::configure( const ThreadPolicy& policy )
+{
+    pthread_once( &forkHandlersSet, setForkHandlers );
+    pthread_mutex_lock( &sharedPoolLock );
+    if ( sharedPool != NULL && sharedPool->queued() > 0 ) {
+        pthread_mutex_unlock( &sharedPoolLock );
+        return false;
+    }
+    // Deleting waits for the jobs still running on the old workers
+    delete sharedPool;
+    sharedPoolPolicy = policy;
+    sharedPool = new ResPool( policy );
+    pthread_mutex_unlock( &sharedPoolLock );
+    return true;
+}
+
+ThreadPolicy ResPool::sharedPolicy()
+{
+    pthread_mutex_lock( &sharedPoolLock );
+    ThreadPolicy policy = sharedPoolPolicy;
+    if ( sharedPool != NULL ) {
+        policy = sharedPool->policy();
+    }
+    pthread_mutex_unlock( &sharedPoolLock );
+    return policy;
+}
+
+int ResPool::defaultWorkers()
+{
+    std::vector<int> cpus;
+    allowedCpus( cpus );
+    return cpus.empty() ? 1 : int(cpus.size());
+}
+
+int ResPool::numaNodes()
+{
+    std::vector<std::vector<int> > nodes;
+    numaCpus( nodes );
+    return int(nodes.size());
+}
+
+void ResPool::pinWorker( int index ) const
+{
+    std::vector<int> cpus;
+    if ( myPolicy.pin == ThreadPolicy::PIN_CORES ) {
+        std::vector<int> allowed;
+        allowedCpus( allowed );
+        int span = myPolicy.cvThreads < 1 ? 1 : myPolicy.cvThreads;
+        for ( int k = 0; k < span && !allowed.empty(); ++k ) {
+            cpus.push_back( allowed[( index * span + k ) % allowed.size()] );
+        }
+    } else if ( myPolicy.pin == ThreadPolicy::PIN_NUMA ) {
+        std::vector<std::vector<int> > nodes;
+        numaCpus( nodes );
+        if ( !nodes.empty() ) {
+            cpus = nodes[index % nodes.size()];
+        }
+    }
+    if ( cpus.empty() ) {
+        return;
+    }
+    cpu_set_t set;
+    CPU_ZERO( &set );
+    for ( size_t i = 0; i < cpus.size(); ++i ) {
+        CPU_SET( cpus[i], &set );
+    }
+    // Best effort: a worker the scheduler will not pin still works
+    pthread_setaffinity_np( pthread_self(), sizeof( set ), &set );
+}
+
+void* ResPool::implWorker( Worker* w )
+{
+    ResPool* pool = w->pool;
+    pool->pinWorker( w->index );
+    Tracer::setWorker( w->index );
+    bool reserved = w->index >= pool->size() - pool->myPolicy.reserved;
+    pthread_cond_t* ready = reserved ? &pool->interactiveReady : &pool->jobReady;
+    for ( ;; ) {
+        pthread_mutex_lock( &pool->lock );
+        ResJob* job;
+        while ( ( job = pool->take( reserved ) ) == NULL && !pool->stopping ) {
+            pthread_cond_wait( ready, &pool->lock );
+        }
+        if ( job == NULL ) {
+            pthread_mutex_unlock( &pool->lock );
+            return NULL;
+        }
+        int64_t queuedAt = job->queuedAt;
+        int64_t started = Tracer::now();
+        bool interactive = job->priority == ResJob::PRIORITY_INTERACTIVE;
+        pool->waits[job->priority].add( ( started - queuedAt ) / 1e9 );
+        pthread_mutex_unlock( &pool->lock );
+
+        // The job may be gone once it has run, so its wait is kept here
+        // and recorded after, when the sheet it read tags the thread
+        bool traced = Tracer::enabled();
+        job->run( w->imgReader, w->index );
+        if ( traced && Tracer::enabled() ) {
+            Tracer::recordAsync( interactive ? "interactive wait" : "queue wait",
+                                 queuedAt, started );
+        }
+        Tracer::setSheet( NULL );
+    }
+}
+
+ResBatch::ResBatch( int size )
+    : size( size ),
+        finished( 0 ),
+        returned( 0 ),
+        releaseAt( -1 ),
+        release( NULL ),
+        releaseArg( NULL )
+{
+    pthread_mutex_init( &lock, NULL );
+    pthread_cond_init( &jobDone, NULL );
+}
+
+ResBatch::~ResBatch()
+{
+    pthread_cond_destroy( &jobDone );
+    pthread_mutex_destroy( &lock );
+}
+
+void ResBatch::done( int index )
+{
+    pthread_mutex_lock( &lock );
+    ++finished;
+    completed.push_back( index );
+    pthread_cond_broadcast( &jobDone );
+    // The batch may be gone once released, so nothing is touched after
+    void (*releaseNow)( void* ) = finished == releaseAt ? release : NULL;
+    void* arg = releaseArg;
+    pthread_mutex_unlock( &lock );
+    if ( releaseNow != NULL ) {
+        releaseNow( arg );
+    }
+}
+
+void ResBatch::join()
+{
+    waitFinished( size );
+}
+
+void ResBatch::waitFinished( int count )
+{
+    pthread_mutex_lock( &lock );
+    while ( finished < count ) {
+        pthread_cond_wait( &jobDone, &lock );
+    }
+    pthread_mutex_unlock( &lock );
+}
+
+bool ResBatch::releaseWhenFinished( int count, void (*func)( void* ),
+                                    void* arg )
+{
+    pthread_mutex_lock( &lock );
+    bool handed = finished < count;
+    if ( handed ) {
+        releaseAt = count;
+        release = func;
+        releaseArg = arg;
+    }
+    pthread_mutex_unlock( &lock );
+    return handed;
+}
+
+int ResBatch::next()
+{
+    pthread_mutex_lock( &lock );
+    while ( completed.empty() && returned < size ) {
+        pthread_cond_wait( &jobDone, &lock );
+    }
+    int index = -1;
+    if ( !completed.empty() ) {
+        index = completed.front();
+        completed.pop_front();
+        ++returned;
+    }
+    pthread_mutex_unlock( &lock );
+    return index;
+}
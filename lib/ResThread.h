@@ -9,8 +9,12 @@
 #include <pthread.h>
 #include <vector>
 #include <list>
+#include <deque>
+#include <map>
+#include <string>
 
 #include "ImageReader.h"
+#include "Tracer.h"
 
 namespace gsweb {
 
@@ -74,6 +78,256 @@ namespace gsweb {
 
     };
 
+    // One unit of work for a ResPool worker
+    class ResJob {
+
+    public:
+
+        enum Priority {
+            // Someone is waiting on this one sheet (a preview, a re-read):
+            // taken before any bulk job, and by the reserved workers
+            PRIORITY_INTERACTIVE,
+            // Part of a batch; shared fairly between tenants
+            PRIORITY_BULK,
+            NUM_PRIORITIES
+        };
+
+        // Bulk, for the unnamed tenant
+        ResJob();
+
+        virtual ~ResJob();
+
+        // Runs on a pool thread; worker is that thread's index in the pool
+        virtual void run( ImageReader& reader, int worker ) = 0;
+
+        Priority priority;
+
+        // Whose bulk work this is (a school, a connection); bulk jobs of
+        // different tenants are taken in turn, one sheet each
+        std::string tenant;
+
+        // Tracer::now() when last submitted
+        int64_t queuedAt;
+
+    };
+
+    // How long the jobs of one priority class waited in a ResPool queue
+    struct QueueWaits {
+
+        // Waits are binned in quarter octaves from 0.1 ms up
+        static const int BUCKETS = 96;
+
+        // Jobs waiting now
+        int queued;
+
+        // Jobs taken by a worker
+        long jobs;
+
+        double totalSeconds;
+
+        double maxSeconds;
+
+        long buckets[BUCKETS];
+
+        QueueWaits();
+
+        void add( double seconds );
+
+        // Wait that fraction p of the jobs did not exceed, to within a
+        // quarter octave (0 if no job has been taken)
+        double percentile( double p ) const;
+
+    };
+
+    // How a ResPool uses the machine: how many batch workers, how many
+    // threads OpenCV may start inside each worker's calls, and which CPUs
+    // each worker may run on
+    struct ThreadPolicy {
+
+        enum Pinning {
+            // Workers run wherever the scheduler puts them
+            PIN_NONE,
+            // Worker i gets its own cvThreads consecutive allowed CPUs
+            PIN_CORES,
+            // Workers are dealt round-robin to NUMA nodes and may use any
+            // CPU of their node
+            PIN_NUMA
+        };
+
+        // Batch workers; < 1 means one per cvThreads allowed CPUs
+        int workers;
+
+        // cv::setNumThreads for the process; < 1 leaves OpenCV's setting
+        int cvThreads;
+
+        Pinning pin;
+
+        // Of the workers, how many only take interactive jobs, so one is
+        // free for them however much bulk work is queued (at most
+        // workers - 1)
+        int reserved;
+
+        // One single-threaded worker per allowed CPU, unpinned, none
+        // reserved
+        ThreadPolicy();
+
+    };
+
+    // Fixed set of worker threads, each with its own ImageReader.  A worker
+    // finishing a job takes the oldest interactive job if there is one,
+    // else the next tenant's oldest bulk job, so interactive jobs overtake
+    // queued bulk work at the next sheet boundary; the last
+    // policy().reserved workers take interactive jobs only
+    class ResPool {
+
+    public:
+
+        ResPool( int numWorkers );
+
+        ResPool( const ThreadPolicy& policy );
+
+        // Finishes the queued jobs, then joins the workers
+        virtual ~ResPool();
+
+        // Queues a job; the caller keeps ownership and must keep it alive
+        // until it has run
+        void submit( ResJob* job );
+
+        int size() const;
+
+        // The policy in effect, with workers resolved
+        const ThreadPolicy& policy() const;
+
+        // Jobs waiting for a worker
+        int queued();
+
+        // Queue waits of a priority class since the pool started (or
+        // since the last reset)
+        QueueWaits queueWaits( ResJob::Priority priority );
+
+        void resetQueueWaits();
+
+        // Process-wide pool, created on first use (also in a forked child)
+        // with the policy configure() last set, or the default one
+        static ResPool& shared();
+
+        // Replaces the shared pool with one built for policy, once the
+        // jobs running on it finish.  Returns false, changing nothing, if
+        // jobs are still queued; the caller must make sure nobody submits
+        // to the old pool again.
+        static bool configure( const ThreadPolicy& policy );
+
+        // Policy of the shared pool (the one it will get if not created yet)
+        static ThreadPolicy sharedPolicy();
+
+        // One worker per CPU this process may run on
+        static int defaultWorkers();
+
+        // NUMA nodes with CPUs this process may run on (0 if unknown)
+        static int numaNodes();
+
+    private:
+
+        struct Worker {
+            ResPool* pool;
+            int index;
+            pthread_t thread;
+            ImageReader imgReader;
+        };
+
+        ThreadPolicy myPolicy;
+
+        std::vector<Worker> workers;
+
+        std::deque<ResJob*> interactive;
+
+        // Queued bulk jobs of each tenant, and the tenants with any in
+        // the order they get their next turn
+        std::map<std::string, std::deque<ResJob*> > bulk;
+
+        std::deque<std::string> turns;
+
+        int bulkQueued;
+
+        QueueWaits waits[ResJob::NUM_PRIORITIES];
+
+        bool stopping;
+
+        pthread_mutex_t lock;
+
+        // Signalled for every job, and waited on by the unreserved workers
+        pthread_cond_t jobReady;
+
+        // Signalled for interactive jobs, waited on by the reserved workers
+        pthread_cond_t interactiveReady;
+
+        void start();
+
+        // Restricts the calling worker to its CPUs under the policy
+        void pinWorker( int index ) const;
+
+        // Next job for a worker, NULL if there is none it may take.  The
+        // caller holds the lock
+        ResJob* take( bool reserved );
+
+        static void* implWorker( Worker* w );
+
+    };
+
+    // Completion tracking for a set of jobs, waited on by the submitter
+    // either all at once (join) or one finished job at a time (next)
+    class ResBatch {
+
+    public:
+
+        ResBatch( int size );
+
+        virtual ~ResBatch();
+
+        // Called by a worker when the job at index has finished
+        void done( int index );
+
+        // Blocks until every job has finished
+        void join();
+
+        // Blocks until at least count jobs have finished
+        void waitFinished( int count );
+
+        // Blocks until a job finishes that next() has not returned yet and
+        // returns the index it was done() with, or -1 once all have been
+        int next();
+
+        // Hands the batch over to its jobs instead of waiting for them:
+        // once count jobs have finished, the worker finishing the last
+        // calls release( arg ), which may delete the batch.  Returns false,
+        // calling nothing, if count jobs already have
+        bool releaseWhenFinished( int count, void (*release)( void* ),
+                                  void* arg );
+
+    private:
+
+        int size;
+
+        int finished;
+
+        int returned;
+
+        std::deque<int> completed;
+
+        // What releaseWhenFinished() set, and after how many jobs; -1
+        // until it is called
+        int releaseAt;
+
+        void (*release)( void* );
+
+        void* releaseArg;
+
+        pthread_mutex_t lock;
+
+        pthread_cond_t jobDone;
+
+    };
+
 }
 
 #endif
\ No newline at end of file
@@ -0,0 +1,226 @@
+/**
+* ResultStore.cpp - Columnar, append-only binary file of batch results
+*/
+
+#include "ResultStore.h"
+
+#include <cstring>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace std;
+using namespace gsweb;
+
+namespace {
+
+    const char STORE_MAGIC[8] = { 'G', 'S', 'R', 'S', 'T', 'O', 'R', 'E' };
+    const char SEGMENT_MAGIC[8] = { 'G', 'S', 'R', 'S', 'E', 'G', 'M', 'T' };
+    const uint32_t STORE_BYTE_ORDER = 0x01020304;
+
+    // Appends a column at the next 8-byte boundary and records its offset
+    template <typename T>
+    void putColumn( std::string& segment, StoreSegment& header, int column,
+                    const std::vector<T>& values )
+    {
+        segment.resize( ( segment.size() + 7 ) & ~size_t( 7 ), '\0' );
+        header.columns[column] = segment.size();
+        if ( !values.empty() ) {
+            segment.append( reinterpret_cast<const char*>( &values[0] ),
+                            values.size() * sizeof( T ) );
+        }
+    }
+
+}
+
+ResultStore::ResultStore( const std::string& path, int numAnswers,
+                          bool readName, int flags )
+    : path( path ),
+        numAnswers( numAnswers ),
+        readName( readName ),
+        flags( flags ),
+        out( NULL ),
+        written( 0 ),
+        nameLetters( 0 )
+{}
+
+ResultStore::~ResultStore()
+{
+    if ( out != NULL ) {
+        fclose( out );
+    }
+}
+
+bool ResultStore::open()
+{
+    FILE* in = fopen( path.c_str(), "rb" );
+    if ( in != NULL ) {
+        StoreHeader header;
+        size_t got = fread( &header, 1, sizeof( header ), in );
+        fclose( in );
+        // An empty file is a store not yet started
+        if ( got != 0 && ( got != sizeof( header )
+                || memcmp( header.magic, STORE_MAGIC, sizeof( STORE_MAGIC ) ) != 0
+                || header.version != VERSION
+                || header.byteOrder != STORE_BYTE_ORDER ) ) {
+            return false;
+        }
+        if ( got != 0 && !truncateTornTail() ) {
+            return false;
+        }
+    }
+
+    out = fopen( path.c_str(), "ab" );
+    if ( out == NULL ) {
+        return false;
+    }
+    if ( ftello( out ) == 0 ) {
+        StoreHeader header;
+        memset( &header, 0, sizeof( header ) );
+        memcpy( header.magic, STORE_MAGIC, sizeof( STORE_MAGIC ) );
+        header.version = VERSION;
+        header.byteOrder = STORE_BYTE_ORDER;
+        if ( fwrite( &header, sizeof( header ), 1, out ) != 1
+                || fflush( out ) != 0 ) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool ResultStore::truncateTornTail()
+{
+    struct stat info;
+    FILE* in = fopen( path.c_str(), "rb" );
+    if ( in == NULL || fstat( fileno( in ), &info ) != 0 ) {
+        if ( in != NULL ) {
+            fclose( in );
+        }
+        return false;
+    }
+    off_t end = sizeof( StoreHeader );
+    StoreSegment segment;
+    while ( fseeko( in, end, SEEK_SET ) == 0
+            && fread( &segment, sizeof( segment ), 1, in ) == 1
+            && memcmp( segment.magic, SEGMENT_MAGIC, sizeof( SEGMENT_MAGIC ) ) == 0
+            && segment.size >= sizeof( segment )
+            && segment.size <= uint64_t( info.st_size - end ) ) {
+        end += off_t( segment.size );
+    }
+    fclose( in );
+    return end == info.st_size || truncate( path.c_str(), end ) == 0;
+}
+
+bool ResultStore::add( int sheet, const std::string& filename,
+                       const SheetResult& result )
+{
+    if ( sheets.empty() ) {
+        nameLetters = readName ? int( result.name.size() ) : 0;
+    }
+    sheets.push_back( uint32_t( sheet ) );
+    statuses.push_back( int32_t( result.status ) );
+    reasons.push_back( uint8_t( result.reason ) );
+    bool read = result.status == 0;
+
+    // Rows are fixed width; what a sheet lacks is left zero
+    size_t row = fills.size();
+    fills.resize( row + size_t( numAnswers ) * 5, 0.0f );
+    for ( int q = 0; read && q < numAnswers && q < int( result.answers.size() ); ++q ) {
+        for ( int a = 0; a < 5 && a < int( result.answers[q].size() ); ++a ) {
+            fills[row + q * 5 + a] = result.answers[q][a];
+        }
+    }
+    row = name.size();
+    name.resize( row + nameLetters, 0.0f );
+    for ( int i = 0; read && i < nameLetters && i < int( result.name.size() ); ++i ) {
+        name[row + i] = result.name[i];
+    }
+    if ( flags & STORE_CLASSIFIED ) {
+        row = codes.size();
+        codes.resize( row + numAnswers, 0 );
+        confidence.resize( row + numAnswers, 0.0f );
+        for ( int q = 0; read && q < numAnswers && q < int( result.codes.size() ); ++q ) {
+            codes[row + q] = result.codes[q];
+            confidence[row + q] = result.confidence[q];
+        }
+        row = nameCodes.size();
+        nameCodes.resize( row + nameLetters, 0 );
+        for ( int i = 0; read && i < nameLetters && i < int( result.nameCodes.size() ); ++i ) {
+            nameCodes[row + i] = result.nameCodes[i];
+        }
+    }
+    if ( flags & STORE_GRADED ) {
+        scores.push_back( read ? result.score : 0.0f );
+    }
+    nameOffsets.push_back( filenames.size() );
+    filenames.append( filename );
+
+    if ( int( sheets.size() ) >= SEGMENT_SHEETS ) {
+        return flush();
+    }
+    return true;
+}
+
+bool ResultStore::flush()
+{
+    if ( sheets.empty() ) {
+        return true;
+    }
+    if ( out == NULL ) {
+        return false;
+    }
+    StoreSegment header;
+    memset( &header, 0, sizeof( header ) );
+    memcpy( header.magic, SEGMENT_MAGIC, sizeof( SEGMENT_MAGIC ) );
+    header.numSheets = uint32_t( sheets.size() );
+    header.numAnswers = uint32_t( numAnswers );
+    header.nameLetters = uint32_t( nameLetters );
+    header.flags = uint32_t( flags );
+
+    // The header goes in last, once the column offsets are known
+    std::string segment( sizeof( header ), '\0' );
+    nameOffsets.push_back( filenames.size() );
+    putColumn( segment, header, COLUMN_SHEET, sheets );
+    putColumn( segment, header, COLUMN_STATUS, statuses );
+    putColumn( segment, header, COLUMN_REASON, reasons );
+    putColumn( segment, header, COLUMN_FILLS, fills );
+    putColumn( segment, header, COLUMN_NAME, name );
+    if ( flags & STORE_CLASSIFIED ) {
+        putColumn( segment, header, COLUMN_CODES, codes );
+        putColumn( segment, header, COLUMN_CONFIDENCE, confidence );
+        putColumn( segment, header, COLUMN_NAME_CODES, nameCodes );
+    }
+    if ( flags & STORE_GRADED ) {
+        putColumn( segment, header, COLUMN_SCORE, scores );
+    }
+    putColumn( segment, header, COLUMN_NAME_OFFSETS, nameOffsets );
+    segment.append( filenames );
+    header.columns[COLUMN_FILENAMES] = segment.size() - filenames.size();
+    // Keep the next segment aligned
+    segment.resize( ( segment.size() + 7 ) & ~size_t( 7 ), '\0' );
+    header.size = segment.size();
+    memcpy( &segment[0], &header, sizeof( header ) );
+
+    // One write per segment, so a crash tears at most the last one
+    bool ok = fwrite( segment.data(), segment.size(), 1, out ) == 1
+        && fflush( out ) == 0;
+    if ( ok ) {
+        written += long( sheets.size() );
+    }
+    sheets.clear();
+    statuses.clear();
+    reasons.clear();
+    fills.clear();
+    codes.clear();
+    confidence.clear();
+    name.clear();
+    nameCodes.clear();
+    scores.clear();
+    nameOffsets.clear();
+    filenames.clear();
+    return ok;
+}
+
+long ResultStore::sheetsWritten() const
+{
+    return written;
+}
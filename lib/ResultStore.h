@@ -0,0 +1,157 @@
+/**
+* ResultStore.h - Columnar, append-only binary file of batch results
+*
+* A store is a StoreHeader followed by segments, each holding up to
+* SEGMENT_SHEETS sheets of one batch.  A segment is a StoreSegment header
+* followed by its columns; every column starts on an 8-byte boundary, at
+* the offset from the segment start the header lists (0 if the segment
+* has no such column), and holds one fixed-width row per sheet in the
+* order the sheets were added:
+*
+*   COLUMN_SHEET        uint32, index of the sheet in its readFiles call
+*   COLUMN_STATUS       int32, SheetResult::status
+*   COLUMN_REASON       uint8, SheetResult::reason
+*   COLUMN_FILLS        float32 x numAnswers x 5, raw fill ratios
+*   COLUMN_CODES        uint8 x numAnswers (STORE_CLASSIFIED)
+*   COLUMN_CONFIDENCE   float32 x numAnswers (STORE_CLASSIFIED)
+*   COLUMN_NAME         float32 x nameLetters, raw name letters
+*   COLUMN_NAME_CODES   int8 x nameLetters (STORE_CLASSIFIED)
+*   COLUMN_SCORE        float32 (STORE_GRADED)
+*   COLUMN_NAME_OFFSETS uint64 x (numSheets + 1), where each filename
+*                       starts in COLUMN_FILENAMES
+*   COLUMN_FILENAMES    the filenames, back to back, unterminated
+*
+* Values are in host byte order (StoreHeader::byteOrder tells), and the
+* rows of a failed sheet are zero but for its status and reason.  Readers
+* walk the segment headers once and then index any sheet, mapped or not,
+* without parsing.  A segment that runs past the end of the file is a torn
+* append; readers ignore it and the next writer truncates it.
+*/
+
+#ifndef ResultStore_H_
+#define ResultStore_H_
+
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+#include "ImageReader.h"
+
+namespace gsweb {
+
+    struct StoreHeader {
+        // "GSRSTORE"
+        char magic[8];
+        uint32_t version;
+        // 0x01020304 as the writing host stores it
+        uint32_t byteOrder;
+        uint64_t reserved[2];
+    };
+
+    struct StoreSegment {
+        // "GSRSEGMT"
+        char magic[8];
+        // Bytes of the segment, this header included
+        uint64_t size;
+        uint32_t numSheets;
+        // Questions per sheet (ReadOptions::questions, if it lists any)
+        uint32_t numAnswers;
+        // Name letters per sheet, 0 if names were not read
+        uint32_t nameLetters;
+        uint32_t flags;
+        // Offset of each ResultStore::Column from the start of the segment
+        uint64_t columns[11];
+    };
+
+    class ResultStore {
+
+    public:
+
+        enum Column {
+            COLUMN_SHEET,
+            COLUMN_STATUS,
+            COLUMN_REASON,
+            COLUMN_FILLS,
+            COLUMN_CODES,
+            COLUMN_CONFIDENCE,
+            COLUMN_NAME,
+            COLUMN_NAME_CODES,
+            COLUMN_SCORE,
+            COLUMN_NAME_OFFSETS,
+            COLUMN_FILENAMES,
+            NUM_COLUMNS
+        };
+
+        enum Flags {
+            // Classified codes and confidences were stored
+            STORE_CLASSIFIED = 1,
+            // Scores were stored
+            STORE_GRADED = 2
+        };
+
+        static const uint32_t VERSION = 1;
+
+        // Sheets held in memory before they are appended as a segment
+        static const int SEGMENT_SHEETS = 4096;
+
+        ResultStore( const std::string& path, int numAnswers, bool readName,
+                     int flags );
+
+        // Closes the file; sheets not yet flushed are dropped
+        virtual ~ResultStore();
+
+        // Opens the store for appending, creating it if need be.  Returns
+        // false if it cannot be opened or is not a store of this version.
+        bool open();
+
+        // Adds one sheet, appending a segment once SEGMENT_SHEETS are held.
+        // Returns false if that append failed.
+        bool add( int sheet, const std::string& filename,
+                  const SheetResult& result );
+
+        // Appends the sheets held as one segment.  Returns false on a
+        // write error.
+        bool flush();
+
+        // Sheets appended by this writer
+        long sheetsWritten() const;
+
+    private:
+
+        std::string path;
+
+        int numAnswers;
+
+        bool readName;
+
+        int flags;
+
+        FILE* out;
+
+        long written;
+
+        // Columns of the sheets not yet appended
+        std::vector<uint32_t> sheets;
+        std::vector<int32_t> statuses;
+        std::vector<uint8_t> reasons;
+        std::vector<float> fills;
+        std::vector<uint8_t> codes;
+        std::vector<float> confidence;
+        std::vector<float> name;
+        std::vector<int8_t> nameCodes;
+        std::vector<float> scores;
+        std::vector<uint64_t> nameOffsets;
+        std::string filenames;
+
+        // Name letters of the segment being held, from its first sheet
+        int nameLetters;
+
+        // Drops a torn segment left by a crashed writer
+        bool truncateTornTail();
+
+    };
+
+}
+
+#endif
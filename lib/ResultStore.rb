@@ -0,0 +1,120 @@
+# ResultStore - Reads the columnar result files readFiles writes with :store
+#
+#   store = ResultStore.new("session.gsr")
+#   store.size              # sheets in every batch appended so far
+#   store[123456]           # one sheet, straight from its columns
+#   store.each { |sheet| ... }
+#
+# The format is laid out in ResultStore.h.  Only the segment headers are
+# read when the store is opened; a sheet is then a few positioned reads, so
+# a store of a million sheets opens at once and reads in any order.  Each
+# sheet is a hash of :filename, :sheet (its index in its readFiles call),
+# :status, :reason (failed sheets), :fills (five raw fill ratios per
+# question) and :nameFills (when names were read), plus :answers,
+# :confidence and :name as classified results have them, and :score when
+# the batch was graded.
+
+class ResultStore
+  include Enumerable
+
+  HEADER_SIZE = 32
+  SEGMENT_SIZE = 120
+
+  # ResultStore::Column, in order
+  COLUMNS = [:sheet, :status, :reason, :fills, :codes, :confidence, :name,
+             :nameCodes, :score, :nameOffsets, :filenames]
+
+  CLASSIFIED = 1
+  GRADED = 2
+
+  # ReadReason names, as Imgproc reports them
+  REASONS = [:none, :unreadableFile, :noFrame, :noOrientationBox,
+             :pageOutOfBounds, :regionOutOfBounds, :timeout, :cancelled,
+             :opencvError, :unwritableFile, :noGeometry]
+
+  Segment = Struct.new(:offset, :first, :numSheets, :numAnswers, :nameLetters,
+                       :flags, :columns)
+
+  attr_reader :size
+
+  def initialize(path)
+    @file = File.open(path, "rb")
+    magic, version, order = (@file.pread(HEADER_SIZE, 0) rescue "").unpack("a8LL")
+    unless magic == "GSRSTORE" && version == 1
+      @file.close
+      raise ArgumentError, "#{path} is not a result store"
+    end
+    unless order == 0x01020304
+      @file.close
+      raise ArgumentError, "#{path} was written on a host of another byte order"
+    end
+
+    # A segment running past the end is a torn append; it and anything
+    # after it are skipped
+    @segments = []
+    @size = 0
+    offset = HEADER_SIZE
+    length = @file.size
+    while offset + SEGMENT_SIZE <= length
+      magic, bytes, numSheets, numAnswers, nameLetters, flags, *columns =
+        @file.pread(SEGMENT_SIZE, offset).unpack("a8QL4Q#{COLUMNS.size}")
+      break unless magic == "GSRSEGMT" && bytes >= SEGMENT_SIZE && offset + bytes <= length
+      @segments << Segment.new(offset, @size, numSheets, numAnswers, nameLetters,
+                               flags, columns)
+      @size += numSheets
+      offset += bytes
+    end
+  end
+
+  def [](i)
+    i += @size if i < 0
+    return nil if i < 0 || i >= @size
+    segment = @segments.bsearch { |s| s.first + s.numSheets > i }
+    row = i - segment.first
+    numQ = segment.numAnswers
+    letters = segment.nameLetters
+
+    from, to = column(segment, :nameOffsets, row, 2, "Q", 8)
+    sheet = {
+      :filename => to > from ? @file.pread(to - from, segment.offset +
+        segment.columns[COLUMNS.index(:filenames)] + from) : "",
+      :sheet => column(segment, :sheet, row, 1, "L", 4)[0],
+      :status => column(segment, :status, row, 1, "l", 4)[0]
+    }
+    if sheet[:status] != 0
+      sheet[:reason] = REASONS[column(segment, :reason, row, 1, "C", 1)[0]]
+    end
+    fills = column(segment, :fills, row * numQ * 5, numQ * 5, "f", 4)
+    sheet[:fills] = fills.each_slice(5).to_a
+    sheet[:nameFills] = column(segment, :name, row * letters, letters, "f", 4) if letters > 0
+    if segment.flags & CLASSIFIED != 0
+      sheet[:answers] = column(segment, :codes, row * numQ, numQ, "C", 1)
+      sheet[:confidence] = column(segment, :confidence, row * numQ, numQ, "f", 4)
+      sheet[:name] = column(segment, :nameCodes, row * letters, letters, "c", 1) if letters > 0
+    end
+    if segment.flags & GRADED != 0
+      sheet[:score] = column(segment, :score, row, 1, "f", 4)[0]
+    end
+    sheet
+  end
+
+  def each
+    return enum_for(:each) unless block_given?
+    @size.times { |i| yield self[i] }
+    self
+  end
+
+  def close
+    @file.close
+  end
+
+  private
+
+  # count values of a column, from its element first on
+  def column(segment, name, first, count, format, bytes)
+    return [] if count == 0
+    start = segment.offset + segment.columns[COLUMNS.index(name)] + first * bytes
+    @file.pread(count * bytes, start).unpack("#{format}#{count}")
+  end
+
+end
@@ -0,0 +1,275 @@
+/**
+* ShardRunner.cpp - Deterministic manifest sharding with checkpointed results
+*/
+
+#include "ShardRunner.h"
+
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <unistd.h>
+
+using namespace std;
+using namespace gsweb;
+
+namespace {
+
+    // Writes a filename as one result field, escaping what would split it
+    void putField( FILE* out, const std::string& field )
+    {
+        for ( size_t i = 0; i < field.size(); ++i ) {
+            switch ( field[i] ) {
+            case '\\':
+                fputs( "\\\\", out );
+                break;
+            case '\t':
+                fputs( "\\t", out );
+                break;
+            case '\n':
+                fputs( "\\n", out );
+                break;
+            case '\r':
+                fputs( "\\r", out );
+                break;
+            default:
+                fputc( field[i], out );
+                break;
+            }
+        }
+    }
+
+}
+
+ShardRunner::ShardRunner( const std::string& manifest, int shard,
+                          int numShards, const std::string& outDir )
+    : manifest( manifest ),
+        shard( shard ),
+        numShards( numShards ),
+        outDir( outDir )
+{}
+
+ShardRunner::~ShardRunner()
+{}
+
+int ShardRunner::run( int numQuestions, bool readName,
+                      const CancelToken* cancel )
+{
+    vector<string> entries;
+    if ( numShards < 1 || shard < 0 || shard >= numShards ) {
+        errno = EINVAL;
+        return fail( "shard out of range for", manifest );
+    }
+    if ( !readManifest( manifest, entries ) ) {
+        return fail( "cannot read manifest", manifest );
+    }
+
+    // Resume from the last checkpoint.  Anything past the checkpointed
+    // offset is a partially written record from a crashed run.
+    long done = 0;
+    long offset = 0;
+    if ( !readCheckpoint( done, offset ) ) {
+        done = 0;
+        offset = 0;
+    }
+    string results = resultPath();
+    FILE* out = fopen( results.c_str(), "a" );
+    if ( out == NULL ) {
+        return fail( "cannot open results", results );
+    }
+    fclose( out );
+    if ( truncate( results.c_str(), offset ) != 0 ) {
+        return fail( "cannot truncate results", results );
+    }
+    out = fopen( results.c_str(), "a" );
+    if ( out == NULL ) {
+        return fail( "cannot open results", results );
+    }
+
+    int numRead = 0;
+    long position = 0;
+    for ( size_t k = shard; k < entries.size(); k += numShards, ++position ) {
+        if ( position < done ) {
+            continue;
+        }
+        if ( cancel != NULL && cancel->cancelled() ) {
+            break;
+        }
+        vector<vector<float> > res =
+            imgReader.readImage( entries[k], numQuestions, readName );
+
+        fprintf( out, "%lu\t", (unsigned long) k );
+        putField( out, entries[k] );
+        fputc( '\t', out );
+        for ( size_t r = 0; r < res.size(); ++r ) {
+            if ( r > 0 ) {
+                fputc( ';', out );
+            }
+            for ( size_t c = 0; c < res[r].size(); ++c ) {
+                fprintf( out, c > 0 ? ",%.9g" : "%.9g", res[r][c] );
+            }
+        }
+        fputc( '\n', out );
+        if ( fflush( out ) != 0 || fsync( fileno( out ) ) != 0 ) {
+            fail( "cannot write results", results );
+            fclose( out );
+            return -1;
+        }
+        if ( !writeCheckpoint( position + 1, ftell( out ) ) ) {
+            fail( "cannot write checkpoint", checkpointPath() );
+            fclose( out );
+            return -1;
+        }
+        ++numRead;
+    }
+    fclose( out );
+    return numRead;
+}
+
+int ShardRunner::merge( const std::string& manifest, int numShards,
+                        const std::string& outDir,
+                        const std::string& mergedPath )
+{
+    vector<string> entries;
+    if ( numShards < 1 || !readManifest( manifest, entries ) ) {
+        return -1;
+    }
+
+    vector<string> lines( entries.size() );
+    vector<bool> present( entries.size(), false );
+    char* line = NULL;
+    size_t capacity = 0;
+    for ( int s = 0; s < numShards; ++s ) {
+        string path = shardName( outDir, s, numShards, "results" );
+        FILE* in = fopen( path.c_str(), "r" );
+        if ( in == NULL ) {
+            free( line );
+            return -1;
+        }
+        ssize_t len;
+        while ( ( len = getline( &line, &capacity, in ) ) > 0 ) {
+            if ( line[len - 1] != '\n' ) {
+                // Torn record past the checkpoint
+                break;
+            }
+            char* end = NULL;
+            unsigned long k = strtoul( line, &end, 10 );
+            if ( end == line || *end != '\t' || k >= entries.size()
+                    || int( k % numShards ) != s ) {
+                continue;
+            }
+            lines[k].assign( line, len );
+            present[k] = true;
+        }
+        fclose( in );
+    }
+    free( line );
+
+    for ( size_t k = 0; k < entries.size(); ++k ) {
+        if ( !present[k] ) {
+            return -1;
+        }
+    }
+
+    // Write-then-rename, as for checkpoints
+    string tmp = mergedPath + ".tmp";
+    FILE* out = fopen( tmp.c_str(), "w" );
+    if ( out == NULL ) {
+        return -1;
+    }
+    for ( size_t k = 0; k < lines.size(); ++k ) {
+        fputs( lines[k].c_str(), out );
+    }
+    bool written = fflush( out ) == 0 && fsync( fileno( out ) ) == 0;
+    if ( fclose( out ) != 0 || !written
+            || rename( tmp.c_str(), mergedPath.c_str() ) != 0 ) {
+        unlink( tmp.c_str() );
+        return -1;
+    }
+    return int( lines.size() );
+}
+
+bool ShardRunner::readManifest( const std::string& manifest,
+                                std::vector<std::string>& entries )
+{
+    entries.clear();
+    FILE* in = fopen( manifest.c_str(), "r" );
+    if ( in == NULL ) {
+        return false;
+    }
+    char* line = NULL;
+    size_t capacity = 0;
+    ssize_t len;
+    while ( ( len = getline( &line, &capacity, in ) ) >= 0 ) {
+        while ( len > 0 && ( line[len - 1] == '\n' || line[len - 1] == '\r' ) ) {
+            line[--len] = '\0';
+        }
+        if ( len == 0 || line[0] == '#' ) {
+            continue;
+        }
+        entries.push_back( string( line, len ) );
+    }
+    free( line );
+    fclose( in );
+    return true;
+}
+
+std::string ShardRunner::resultPath() const
+{
+    return shardName( outDir, shard, numShards, "results" );
+}
+
+std::string ShardRunner::checkpointPath() const
+{
+    return shardName( outDir, shard, numShards, "ckpt" );
+}
+
+const std::string& ShardRunner::lastError() const
+{
+    return error;
+}
+
+int ShardRunner::fail( const char* what, const std::string& path )
+{
+    error = string( what ) + " " + path + ": " + strerror( errno );
+    return -1;
+}
+
+std::string ShardRunner::shardName( const std::string& outDir, int shard,
+                                    int numShards, const char* ext )
+{
+    char name[64];
+    snprintf( name, sizeof( name ), "shard-%d-of-%d.%s",
+              shard, numShards, ext );
+    return outDir + "/" + name;
+}
+
+bool ShardRunner::readCheckpoint( long& done, long& offset ) const
+{
+    FILE* in = fopen( checkpointPath().c_str(), "r" );
+    if ( in == NULL ) {
+        return false;
+    }
+    bool ok = ( fscanf( in, "%ld %ld", &done, &offset ) == 2
+                && done >= 0 && offset >= 0 );
+    fclose( in );
+    return ok;
+}
+
+bool ShardRunner::writeCheckpoint( long done, long offset ) const
+{
+    // Write-then-rename so a crash never leaves a torn checkpoint
+    string path = checkpointPath();
+    string tmp = path + ".tmp";
+    FILE* out = fopen( tmp.c_str(), "w" );
+    if ( out == NULL ) {
+        return false;
+    }
+    fprintf( out, "%ld %ld\n", done, offset );
+    if ( fflush( out ) != 0 || fsync( fileno( out ) ) != 0 ) {
+        fclose( out );
+        return false;
+    }
+    fclose( out );
+    return rename( tmp.c_str(), path.c_str() ) == 0;
+}
@@ -0,0 +1,88 @@
+/**
+* ShardRunner.h - Deterministic manifest sharding with checkpointed results
+*
+* A manifest is a text file with one image path per line (blank lines and
+* lines starting with '#' are skipped).  Entry k belongs to shard k % N, so
+* any number of processes or hosts can split one manifest with nothing shared
+* but the filesystem.  Each shard appends its results to its own file and
+* records a checkpoint after every sheet, so a crashed shard resumes where it
+* stopped.  merge() combines all shard files back into manifest order.
+*
+* Result lines: <index>\t<filename>\t<row>;<row>;...  (row values use ',').
+* Backslashes, tabs, newlines and carriage returns in the filename are
+* written as \\, \t, \n and \r, so every record is one line of three fields.
+*/
+
+#ifndef ShardRunner_H_
+#define ShardRunner_H_
+
+#include <string>
+#include <vector>
+
+#include "ImageReader.h"
+
+namespace gsweb {
+
+    class ShardRunner {
+
+    public:
+
+        ShardRunner( const std::string& manifest, int shard, int numShards,
+                     const std::string& outDir );
+
+        virtual ~ShardRunner();
+
+        // Reads every remaining sheet of this shard, stopping early (after
+        // the sheet being read) once cancel is set.  Returns the number of
+        // sheets read by this call, or -1 if the manifest, result file or
+        // checkpoint could not be read or written; lastError() says why.
+        int run( int numQuestions, bool readName, const CancelToken* cancel );
+
+        // Merges all shard result files of a manifest into mergedPath in
+        // manifest order, writing a temporary file renamed over it, so
+        // mergedPath is never left half written.  Returns the number of
+        // merged sheets, or -1 if a shard file is missing or incomplete or
+        // the merged file could not be written.
+        static int merge( const std::string& manifest, int numShards,
+                          const std::string& outDir,
+                          const std::string& mergedPath );
+
+        static bool readManifest( const std::string& manifest,
+                                  std::vector<std::string>& entries );
+
+        std::string resultPath() const;
+
+        std::string checkpointPath() const;
+
+        // Why the last run() failed
+        const std::string& lastError() const;
+
+    private:
+
+        ImageReader imgReader;
+
+        std::string manifest;
+
+        int shard;
+
+        int numShards;
+
+        std::string outDir;
+
+        std::string error;
+
+        // Records why run() failed, with the errno it failed with
+        int fail( const char* what, const std::string& path );
+
+        static std::string shardName( const std::string& outDir, int shard,
+                                      int numShards, const char* ext );
+
+        bool readCheckpoint( long& done, long& offset ) const;
+
+        bool writeCheckpoint( long done, long offset ) const;
+
+    };
+
+}
+
+#endif
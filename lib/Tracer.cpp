@@ -0,0 +1,294 @@
+/**
+* Tracer.cpp - Opt-in per-thread timeline of reading spans
+*/
+
+#include "Tracer.h"
+
+#include <cstdio>
+#include <cstring>
+#include <vector>
+#include <pthread.h>
+#include <time.h>
+
+using namespace std;
+using namespace gsweb;
+
+namespace {
+
+    // Trailing characters of the filename kept with each span
+    const int SHEET_CHARS = 80;
+
+    struct TraceEvent {
+        const char* name;
+        int64_t start;
+        int64_t end;
+        // Nonzero for async spans
+        uint64_t id;
+        char sheet[SHEET_CHARS];
+    };
+
+    // One thread's spans.  Only its thread writes it: an event is filled
+    // in, then published by advancing head, so a dump running alongside
+    // can tell which slots it copied whole
+    struct TraceRing {
+        int thread;
+        // A live thread records into it; a free ring waits for the next
+        // thread to record its first span
+        bool owned;
+        volatile int worker;
+        volatile uint64_t head;
+        // Events before this one were recorded before tracing last started
+        volatile uint64_t floor;
+        TraceEvent events[Tracer::RING_EVENTS];
+    };
+
+    pthread_mutex_t ringsLock = PTHREAD_MUTEX_INITIALIZER;
+    std::vector<TraceRing*> rings;
+    // Threads that recorded a span, numbering them in the trace
+    int threadsSeen = 0;
+
+    pthread_once_t ringKeyOnce = PTHREAD_ONCE_INIT;
+    pthread_key_t ringKey;
+
+    __thread TraceRing* threadRing = NULL;
+    __thread int threadWorker = -1;
+    __thread char threadSheet[SHEET_CHARS];
+
+    volatile uint64_t asyncIds = 0;
+
+    // Thread exit: frees the thread's ring for the next new thread, so
+    // there are only as many rings as threads ever recorded at once.  Its
+    // spans are dumped until the ring is taken again
+    void releaseRing( void* arg )
+    {
+        TraceRing* r = static_cast<TraceRing*>( arg );
+        pthread_mutex_lock( &ringsLock );
+        r->owned = false;
+        pthread_mutex_unlock( &ringsLock );
+        threadRing = NULL;
+    }
+
+    void makeRingKey()
+    {
+        pthread_key_create( &ringKey, releaseRing );
+    }
+
+    TraceRing* ring()
+    {
+        if ( threadRing == NULL ) {
+            pthread_once( &ringKeyOnce, makeRingKey );
+            pthread_mutex_lock( &ringsLock );
+            TraceRing* r = NULL;
+            for ( size_t i = 0; i < rings.size() && r == NULL; ++i ) {
+                if ( !rings[i]->owned ) {
+                    r = rings[i];
+                    // Drops the spans of the thread that exited
+                    r->floor = r->head;
+                }
+            }
+            if ( r == NULL ) {
+                r = new TraceRing;
+                r->head = 0;
+                r->floor = 0;
+                rings.push_back( r );
+            }
+            r->owned = true;
+            r->thread = ++threadsSeen;
+            r->worker = threadWorker;
+            pthread_mutex_unlock( &ringsLock );
+            pthread_setspecific( ringKey, r );
+            threadRing = r;
+        }
+        return threadRing;
+    }
+
+    void put( const char* name, int64_t start, int64_t end, uint64_t id )
+    {
+        TraceRing* r = ring();
+        uint64_t seq = r->head;
+        TraceEvent& e = r->events[seq % Tracer::RING_EVENTS];
+        e.name = name;
+        e.start = start;
+        e.end = end;
+        e.id = id;
+        memcpy( e.sheet, threadSheet, SHEET_CHARS );
+        __sync_synchronize();
+        r->head = seq + 1;
+    }
+
+    // A JSON string literal of s
+    void putString( FILE* out, const char* s )
+    {
+        fputc( '"', out );
+        for ( ; *s != '\0'; ++s ) {
+            unsigned char c = (unsigned char) *s;
+            if ( c == '"' || c == '\\' ) {
+                fprintf( out, "\\%c", c );
+            } else if ( c < 0x20 ) {
+                fprintf( out, "\\u%04x", c );
+            } else {
+                fputc( c, out );
+            }
+        }
+        fputc( '"', out );
+    }
+
+    void putArgs( FILE* out, const TraceEvent& e, int worker )
+    {
+        fprintf( out, ",\"args\":{\"worker\":%d", worker );
+        if ( e.sheet[0] != '\0' ) {
+            fputs( ",\"sheet\":", out );
+            putString( out, e.sheet );
+        }
+        fputs( "}}", out );
+    }
+
+}
+
+volatile int Tracer::active = 0;
+
+void Tracer::enable( bool on )
+{
+    pthread_mutex_lock( &ringsLock );
+    if ( on && !active ) {
+        for ( size_t i = 0; i < rings.size(); ++i ) {
+            rings[i]->floor = rings[i]->head;
+        }
+    }
+    active = on ? 1 : 0;
+    pthread_mutex_unlock( &ringsLock );
+}
+
+int64_t Tracer::now()
+{
+    struct timespec t;
+    clock_gettime( CLOCK_MONOTONIC, &t );
+    return int64_t( t.tv_sec ) * 1000000000 + t.tv_nsec;
+}
+
+void Tracer::record( const char* name, int64_t start, int64_t end )
+{
+    put( name, start, end, 0 );
+}
+
+void Tracer::recordAsync( const char* name, int64_t start, int64_t end )
+{
+    put( name, start, end, __sync_add_and_fetch( &asyncIds, 1 ) );
+}
+
+void Tracer::setWorker( int worker )
+{
+    threadWorker = worker;
+    if ( threadRing != NULL ) {
+        threadRing->worker = worker;
+    }
+}
+
+void Tracer::setSheet( const char* filename )
+{
+    // Untraced reads skip the copy; clearing the tag keeps a trace started
+    // mid-sheet from showing an earlier sheet's name
+    if ( filename == NULL || !enabled() ) {
+        threadSheet[0] = '\0';
+        return;
+    }
+    // The end of a long path tells sheets apart best
+    size_t length = strlen( filename );
+    const char* tail = filename;
+    if ( length >= size_t( SHEET_CHARS ) ) {
+        tail = filename + length - ( SHEET_CHARS - 1 );
+    }
+    strncpy( threadSheet, tail, SHEET_CHARS - 1 );
+    threadSheet[SHEET_CHARS - 1] = '\0';
+}
+
+long Tracer::dump( const std::string& path )
+{
+    // Copy the rings out first; a slot whose sequence the writer may have
+    // reached again while it was copied is dropped
+    std::vector<TraceEvent> events;
+    std::vector<int> threads;
+    std::vector<int> workers;
+    std::vector<int> eventThreads;
+    pthread_mutex_lock( &ringsLock );
+    for ( size_t i = 0; i < rings.size(); ++i ) {
+        TraceRing* r = rings[i];
+        uint64_t head = r->head;
+        __sync_synchronize();
+        uint64_t first = head > uint64_t( RING_EVENTS ) ? head - RING_EVENTS : 0;
+        if ( first < r->floor ) {
+            first = r->floor;
+        }
+        size_t copied = events.size();
+        for ( uint64_t seq = first; seq < head; ++seq ) {
+            events.push_back( r->events[seq % RING_EVENTS] );
+        }
+        __sync_synchronize();
+        uint64_t after = r->head;
+        uint64_t valid = after >= uint64_t( RING_EVENTS ) ? after - RING_EVENTS + 1 : 0;
+        if ( valid > first ) {
+            size_t torn = size_t( ( valid < head ? valid : head ) - first );
+            events.erase( events.begin() + copied, events.begin() + copied + torn );
+        }
+        eventThreads.resize( events.size(), int( i ) );
+        threads.push_back( r->thread );
+        workers.push_back( int( r->worker ) );
+    }
+    pthread_mutex_unlock( &ringsLock );
+
+    int64_t origin = 0;
+    for ( size_t k = 0; k < events.size(); ++k ) {
+        if ( k == 0 || events[k].start < origin ) {
+            origin = events[k].start;
+        }
+    }
+
+    // Write-then-rename so a viewer never opens half a trace
+    std::string tmp = path + ".tmp";
+    FILE* out = fopen( tmp.c_str(), "w" );
+    if ( out == NULL ) {
+        return -1;
+    }
+    fputs( "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n", out );
+    for ( size_t i = 0; i < threads.size(); ++i ) {
+        char name[32];
+        if ( workers[i] >= 0 ) {
+            snprintf( name, sizeof( name ), "worker %d", workers[i] );
+        } else {
+            snprintf( name, sizeof( name ), "thread %d", threads[i] );
+        }
+        fprintf( out, "%s{\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"name\":\"thread_name\","
+                 "\"args\":{\"name\":\"%s\"}}", i > 0 ? ",\n" : "", threads[i], name );
+    }
+    for ( size_t k = 0; k < events.size(); ++k ) {
+        const TraceEvent& e = events[k];
+        int t = eventThreads[k];
+        double start = ( e.start - origin ) / 1000.0;
+        double end = ( e.end - origin ) / 1000.0;
+        // Every event follows its thread's name record
+        fputs( ",\n", out );
+        if ( e.id == 0 ) {
+            fprintf( out, "{\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"name\":\"%s\","
+                     "\"ts\":%.3f,\"dur\":%.3f", threads[t], e.name, start,
+                     end - start );
+            putArgs( out, e, workers[t] );
+        } else {
+            // Async spans begin and end as separate events sharing an id
+            fprintf( out, "{\"ph\":\"b\",\"cat\":\"queue\",\"id\":%llu,\"pid\":1,"
+                     "\"tid\":%d,\"name\":\"%s\",\"ts\":%.3f",
+                     (unsigned long long) e.id, threads[t], e.name, start );
+            putArgs( out, e, workers[t] );
+            fprintf( out, ",\n{\"ph\":\"e\",\"cat\":\"queue\",\"id\":%llu,\"pid\":1,"
+                     "\"tid\":%d,\"name\":\"%s\",\"ts\":%.3f}",
+                     (unsigned long long) e.id, threads[t], e.name, end );
+        }
+    }
+    fputs( "\n]}\n", out );
+    bool ok = !ferror( out );
+    ok = fclose( out ) == 0 && ok;
+    if ( !ok || rename( tmp.c_str(), path.c_str() ) != 0 ) {
+        remove( tmp.c_str() );
+        return -1;
+    }
+    return long( events.size() );
+}
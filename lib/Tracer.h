@@ -0,0 +1,100 @@
+/**
+* Tracer.h - Opt-in per-thread timeline of reading spans, dumped as Chrome
+* trace-event JSON (chrome://tracing, ui.perfetto.dev)
+*
+* Each thread records into its own ring of the last RING_EVENTS spans, so
+* recording takes no lock; the registry of rings is locked only when a
+* thread records its first span, when it exits and when the rings are
+* dumped.  A thread that exits leaves its ring to the next thread that
+* starts recording, so short-lived threads do not pile up rings.  While
+* tracing is off a TraceSpan costs one flag read.  Spans are tagged with
+* the sheet the thread is reading and, on pool threads, the worker index.
+*/
+
+#ifndef Tracer_H_
+#define Tracer_H_
+
+#include <string>
+#include <stdint.h>
+
+namespace gsweb {
+
+    class Tracer {
+
+    public:
+
+        // Spans each thread keeps; older ones are overwritten
+        static const int RING_EVENTS = 16384;
+
+        static bool enabled()
+        {
+            return active != 0;
+        }
+
+        // Starts (clearing what was recorded before) or stops recording
+        static void enable( bool on );
+
+        // Monotonic clock, in nanoseconds
+        static int64_t now();
+
+        // Records a finished span on the calling thread.  name must be a
+        // string literal (it is kept, not copied)
+        static void record( const char* name, int64_t start, int64_t end );
+
+        // Records a span that overlaps others on its thread, such as a
+        // job's wait in the pool queue
+        static void recordAsync( const char* name, int64_t start, int64_t end );
+
+        // Marks the calling thread as pool worker index (-1: not a worker)
+        static void setWorker( int worker );
+
+        // Tags the calling thread's spans with filename until the next
+        // call; NULL clears it
+        static void setSheet( const char* filename );
+
+        // Writes the spans every thread still holds to path as trace-event
+        // JSON.  Returns the number of spans written, or -1 if the file
+        // could not be written.
+        static long dump( const std::string& path );
+
+    private:
+
+        static volatile int active;
+
+    };
+
+    // Times its scope into the tracer, when tracing is on
+    class TraceSpan {
+
+    public:
+
+        explicit TraceSpan( const char* name )
+            : name( name ),
+                start( Tracer::enabled() ? Tracer::now() : -1 )
+        {}
+
+        ~TraceSpan()
+        {
+            end();
+        }
+
+        // Ends the span before the scope does
+        void end()
+        {
+            if ( start >= 0 ) {
+                Tracer::record( name, start, Tracer::now() );
+                start = -1;
+            }
+        }
+
+    private:
+
+        const char* name;
+
+        int64_t start;
+
+    };
+
+}
+
+#endif
@@ -21,6 +21,8 @@ if have_library( "opencv_highgui" ) and
    have_library( 'opencv_imgproc' ) and
    have_library( 'pthread' )
 then
+   # Batch waits release the GVL (rb_thread_blocking_region before 2.0)
+   have_func( 'rb_thread_call_without_gvl', 'ruby/thread.h' )
    create_makefile(extension_name)
 else
    puts "Not found! Extension not made."
@@ -9,9 +9,39 @@ rescue Bundler::BundlerError => e
   exit e.status_code
 end
 require 'test/unit'
+require 'fileutils'
+require 'json'
+require 'digest/md5'
 
 $LOAD_PATH.unshift(File.join(File.dirname(__FILE__), '..', 'lib'))
 $LOAD_PATH.unshift(File.dirname(__FILE__))
 
+require 'Imgproc'
+require 'regress/sheet_generator'
+
 class Test::Unit::TestCase
+
+  # Drawn sheets are kept here between runs, as the regression corpus is
+  SHEET_DIR = File.join(File.dirname(__FILE__), 'tmp')
+
+  # The regression corpus scale
+  SHEET_SCALE = 0.5
+
+  # Path of the sheet SheetGenerator draws from spec (an entry as in
+  # regress/corpus.json), drawn on first use
+  def sheet(spec)
+    FileUtils.mkdir_p(SHEET_DIR)
+    path = File.join(SHEET_DIR, Digest::MD5.hexdigest(JSON.generate(spec)) + ".pgm")
+    unless File.exist?(path)
+      SheetGenerator.draw(spec, SHEET_SCALE, path + ".tmp")
+      File.rename(path + ".tmp", path)
+    end
+    path
+  end
+
+  # Bitmask codes of drawn answers, as classify reports them
+  def codes(answers)
+    answers.map { |a| SheetGenerator.code(a) }
+  end
+
 end
@@ -0,0 +1,335 @@
+# Concurrent load test of Imgproc from many Ruby callers
+#
+#   ruby test/load/load.rb [--scenarios FILE] [--only NAME,...]
+#                          [--duration SECONDS] [--out REPORT]
+#
+# Each scenario of scenarios.json runs `callers` callers, as threads of
+# this process (mode "threads", each with its own Imgproc on the shared
+# pool) or as forked processes (mode "processes", each with its own pool,
+# like a preforking app server).  A caller issues requests drawn by weight
+# from the scenario's `mix` back to back, after an exponential think time
+# of mean `think` seconds, until `duration` seconds are up.  Request kinds:
+#
+#   batch    readFiles of `size` sheets (a count or [min, max]) drawn from
+#            the corpus, classified, as the caller's own :tenant
+#   preview  prepShowImage of one sheet (interactive by default)
+#   reread   readFiles of one sheet, classified (interactive by default)
+#   failing  readFiles of `size` inputs that cannot be read: missing files,
+#            files that are not images and the corpus's unreadable pages
+#
+# A mix entry's `options` are merged into its readFiles (or prepShowImage)
+# options, say { "priority": "bulk" } to read it behind the batches.  A
+# scenario's `threading` is set with Imgproc.threading= before it runs (in
+# every process, for processes); without one the defaults are restored.
+#
+# The sheets are the regression corpus (test/regress/corpus.json), drawn
+# into test/load/tmp.  The report (REPORT, default test/load/tmp/report.json)
+# has, per scenario: requests and sheets per second; count, errors and
+# mean/p50/p95/p99/max latency in seconds per kind and overall; peak and
+# final RSS of the callers' processes; their CPU seconds and utilization of
+# the host's cores; and Imgproc.queueWaits (one per process, for
+# processes).  Latency percentiles are exact, over every request.
+
+require 'json'
+require 'fileutils'
+require 'etc'
+require 'optparse'
+
+DIR = File.expand_path(File.dirname(__FILE__))
+require File.join(DIR, '..', 'regress', 'sheet_generator')
+require File.join(DIR, '..', '..', 'lib', 'Imgproc')
+
+CORPUS = File.join(DIR, '..', 'regress', 'corpus.json')
+SCENARIOS = File.join(DIR, 'scenarios.json')
+WORK = File.join(DIR, 'tmp')
+
+KINDS = ["batch", "preview", "reread", "failing"]
+
+# RSS of the callers is sampled this often, in seconds
+SAMPLE_INTERVAL = 0.1
+
+# Option values readFiles and Imgproc.threading take as symbols
+SYMBOL_VALUES = [:frame, :priority, :pin]
+
+def load_corpus
+  corpus = JSON.parse(File.read(CORPUS))
+  FileUtils.mkdir_p(WORK)
+  corpus["sheets"].each do |spec|
+    spec["path"] = File.join(WORK, spec["id"] + ".pgm")
+    # Regenerated when the corpus description changes
+    stamp = spec["path"] + ".json"
+    desc = JSON.generate(spec.merge("scale" => corpus["scale"]))
+    next if File.exist?(spec["path"]) && File.exist?(stamp) && File.read(stamp) == desc
+    SheetGenerator.draw(spec, corpus["scale"], spec["path"])
+    File.open(stamp, "w") { |f| f.write(desc) }
+  end
+  corpus["sheets"]
+end
+
+# What the callers draw their requests from
+def load_inputs
+  sheets = load_corpus
+  readable = sheets.reject { |spec| spec["expectError"] }
+  garbage = File.join(WORK, "not-an-image.pgm")
+  File.open(garbage, "wb") { |f| f.write(Random.new(1).bytes(4096)) } unless File.exist?(garbage)
+  {
+    # Sheets sharing a question count and name flag can share a batch
+    :groups => readable.group_by { |spec| [spec["questions"], !spec["name"].nil?] }.to_a,
+    :sheets => readable,
+    :failing => sheets.select { |spec| spec["expectError"] }.map { |spec| spec["path"] } +
+      [garbage, File.join(WORK, "missing.pgm")]
+  }
+end
+
+def symbolize(hash)
+  result = {}
+  (hash || {}).each do |key, value|
+    key = key.to_sym
+    result[key] = SYMBOL_VALUES.include?(key) && value.is_a?(String) ? value.to_sym : value
+  end
+  result
+end
+
+def now
+  Process.clock_gettime(Process::CLOCK_MONOTONIC)
+end
+
+def cpu_seconds
+  Process.clock_gettime(Process::CLOCK_PROCESS_CPUTIME_ID)
+end
+
+# Resident set of a process in bytes (0 once it is gone)
+def rss(pid)
+  File.foreach("/proc/#{pid}/status") do |line|
+    return line.split[1].to_i * 1024 if line.start_with?("VmRSS:")
+  end
+  0
+rescue Errno::ENOENT, Errno::ESRCH
+  0
+end
+
+def pick(mix, total, rng)
+  r = rng.rand * total
+  mix.each do |entry|
+    r -= entry["weight"] || 1
+    return entry if r < 0
+  end
+  mix.last
+end
+
+def size_of(entry, rng)
+  size = entry["size"] || 1
+  size.is_a?(Array) ? rng.rand(size[0]..size[1]) : size
+end
+
+# Runs one request; returns [sheets read, sheets that failed]
+def perform(iproc, entry, caller, inputs, rng)
+  options = symbolize(entry["options"])
+  case entry["kind"]
+  when "batch"
+    (numQ, readName), group = inputs[:groups].sample(random: rng)
+    paths = Array.new(size_of(entry, rng)) { group.sample(random: rng)["path"] }
+    results = iproc.readFiles(paths, numQ, readName,
+                              { :classify => true, :tenant => "caller #{caller}" }.merge(options))
+    [paths.size, results.count { |r| r[:status] != 0 }]
+  when "preview"
+    spec = inputs[:sheets].sample(random: rng)
+    iproc.prepShowImage(spec["path"], File.join(WORK, "preview-#{Process.pid}-#{caller}.png"), options)
+    [1, 0]
+  when "reread"
+    spec = inputs[:sheets].sample(random: rng)
+    results = iproc.readFiles([spec["path"]], spec["questions"], !spec["name"].nil?,
+                              { :classify => true }.merge(options))
+    [1, results.count { |r| r[:status] != 0 }]
+  when "failing"
+    paths = Array.new(size_of(entry, rng)) { inputs[:failing].sample(random: rng) }
+    results = iproc.readFiles(paths, 50, false, { :classify => true }.merge(options))
+    [paths.size, results.count { |r| r[:status] != 0 }]
+  else
+    raise ArgumentError, "unknown request kind #{entry["kind"]}"
+  end
+end
+
+# One caller's requests until the deadline, as latencies per kind
+def run_caller(scenario, caller, deadline, inputs)
+  iproc = Imgproc.new
+  rng = Random.new((scenario["seed"] || 1) * 1000 + caller)
+  mix = scenario["mix"]
+  total = mix.inject(0) { |sum, entry| sum + (entry["weight"] || 1) }
+  think = scenario["think"] || 0
+  stats = { "latencies" => Hash.new { |h, k| h[k] = [] }, "errors" => Hash.new(0),
+            "sheets" => 0, "failedSheets" => 0 }
+  while now < deadline
+    sleep(-Math.log(1 - rng.rand) * think) if think > 0
+    break if now >= deadline
+    entry = pick(mix, total, rng)
+    start = now
+    begin
+      sheets, failed = perform(iproc, entry, caller, inputs, rng)
+      stats["sheets"] += sheets
+      stats["failedSheets"] += failed
+    rescue StandardError
+      stats["errors"][entry["kind"]] += 1
+    end
+    stats["latencies"][entry["kind"]] << now - start
+  end
+  stats
+end
+
+def merge_stats(all)
+  merged = { "latencies" => Hash.new { |h, k| h[k] = [] }, "errors" => Hash.new(0),
+             "sheets" => 0, "failedSheets" => 0 }
+  all.each do |stats|
+    stats["latencies"].each { |kind, values| merged["latencies"][kind].concat(values) }
+    stats["errors"].each { |kind, count| merged["errors"][kind] += count }
+    merged["sheets"] += stats["sheets"]
+    merged["failedSheets"] += stats["failedSheets"]
+  end
+  merged
+end
+
+# Nearest-rank percentile of sorted values
+def percentile(sorted, p)
+  sorted[[(p * sorted.size).ceil - 1, 0].max]
+end
+
+def latency(values, errors)
+  sorted = values.sort
+  return { "count" => 0, "errors" => errors } if sorted.empty?
+  { "count" => sorted.size, "errors" => errors,
+    "mean" => sorted.inject(:+) / sorted.size,
+    "p50" => percentile(sorted, 0.50), "p95" => percentile(sorted, 0.95),
+    "p99" => percentile(sorted, 0.99), "max" => sorted.last }
+end
+
+# Peak and last summed RSS of pids, sampled until stop is set
+def sample_rss(pids, stop)
+  Thread.new do
+    peak = last = 0
+    loop do
+      last = pids.call.inject(0) { |sum, pid| sum + rss(pid) }
+      peak = last if last > peak
+      break if stop[0]
+      sleep SAMPLE_INTERVAL
+    end
+    [peak, last]
+  end
+end
+
+def run_threads(scenario, duration, inputs)
+  Imgproc.threading = symbolize(scenario["threading"])
+  Imgproc.queueWaits(true)
+  stop = [false]
+  sampler = sample_rss(lambda { [Process.pid] }, stop)
+  cpu = cpu_seconds
+  deadline = now + duration
+  callers = Array.new(scenario["callers"]) do |caller|
+    Thread.new { run_caller(scenario, caller, deadline, inputs) }
+  end
+  stats = merge_stats(callers.map(&:value))
+  stats["cpuSeconds"] = cpu_seconds - cpu
+  stop[0] = true
+  stats["rssPeak"], stats["rssEnd"] = sampler.value
+  stats["queueWaits"] = Imgproc.queueWaits
+  stats
+end
+
+def run_processes(scenario, duration, inputs)
+  deadline = now + duration
+  children = Array.new(scenario["callers"]) do |caller|
+    reader, writer = IO.pipe
+    pid = fork do
+      reader.close
+      Imgproc.threading = symbolize(scenario["threading"])
+      cpu = cpu_seconds
+      stats = run_caller(scenario, caller, deadline, inputs)
+      stats["cpuSeconds"] = cpu_seconds - cpu
+      stats["queueWaits"] = Imgproc.queueWaits
+      writer.write(JSON.generate(stats))
+      writer.close
+      exit!(0)
+    end
+    writer.close
+    [pid, reader]
+  end
+  stop = [false]
+  live = children.map(&:first)
+  sampler = sample_rss(lambda { live }, stop)
+  all = children.map do |pid, reader|
+    output = reader.read
+    reader.close
+    Process.wait(pid)
+    live -= [pid]
+    JSON.parse(output)
+  end
+  stop[0] = true
+  stats = merge_stats(all)
+  stats["cpuSeconds"] = all.inject(0) { |sum, s| sum + s["cpuSeconds"] }
+  stats["rssPeak"], stats["rssEnd"] = sampler.value
+  stats["queueWaits"] = all.map { |s| s["queueWaits"] }
+  stats
+end
+
+def run_scenario(scenario, duration, inputs)
+  start = now
+  stats = case scenario["mode"] || "threads"
+          when "threads" then run_threads(scenario, duration, inputs)
+          when "processes" then run_processes(scenario, duration, inputs)
+          else raise ArgumentError, "#{scenario["name"]}: mode must be threads or processes"
+          end
+  wall = now - start
+  requests = stats["latencies"].values.inject(0) { |sum, values| sum + values.size }
+  latencies = {}
+  KINDS.each do |kind|
+    next unless stats["latencies"].key?(kind)
+    latencies[kind] = latency(stats["latencies"][kind], stats["errors"][kind])
+  end
+  latencies["all"] = latency(stats["latencies"].values.flatten, stats["errors"].values.inject(0, :+))
+  { "name" => scenario["name"], "mode" => scenario["mode"] || "threads",
+    "callers" => scenario["callers"], "seconds" => wall,
+    "requestsPerSecond" => requests / wall, "sheetsPerSecond" => stats["sheets"] / wall,
+    "sheets" => stats["sheets"], "failedSheets" => stats["failedSheets"],
+    "latency" => latencies,
+    "rssPeakMB" => stats["rssPeak"] / 1048576.0, "rssEndMB" => stats["rssEnd"] / 1048576.0,
+    "cpuSeconds" => stats["cpuSeconds"],
+    "cpuUtilization" => stats["cpuSeconds"] / (wall * Etc.nprocessors),
+    "queueWaits" => stats["queueWaits"] }
+end
+
+def summarize(result)
+  puts format("%s: %d %s callers, %.1f req/s, %.1f sheets/s, cpu %.0f%%, rss peak %.0f MB",
+              result["name"], result["callers"], result["mode"], result["requestsPerSecond"],
+              result["sheetsPerSecond"], 100 * result["cpuUtilization"], result["rssPeakMB"])
+  result["latency"].each do |kind, l|
+    next if l["count"] == 0
+    puts format("  %-8s %6d req %4d err  p50 %.3fs  p95 %.3fs  p99 %.3fs  max %.3fs",
+                kind, l["count"], l["errors"], l["p50"], l["p95"], l["p99"], l["max"])
+  end
+end
+
+options = { :scenarios => SCENARIOS, :out => File.join(WORK, "report.json") }
+OptionParser.new do |opts|
+  opts.banner = "Usage: load.rb [options]"
+  opts.on("--scenarios FILE", "Scenario file (#{File.basename(SCENARIOS)})") { |v| options[:scenarios] = v }
+  opts.on("--only NAMES", Array, "Run only these scenarios") { |v| options[:only] = v }
+  opts.on("--duration SECONDS", Float, "Override every scenario's duration") { |v| options[:duration] = v }
+  opts.on("--out REPORT", "Report file (tmp/report.json)") { |v| options[:out] = v }
+end.parse!
+
+scenarios = JSON.parse(File.read(options[:scenarios]))["scenarios"]
+scenarios = scenarios.select { |s| options[:only].include?(s["name"]) } if options[:only]
+abort "no scenarios to run" if scenarios.empty?
+inputs = load_inputs
+
+results = scenarios.map do |scenario|
+  result = run_scenario(scenario, options[:duration] || scenario["duration"] || 30, inputs)
+  summarize(result)
+  result
+end
+
+report = { "host" => { "cores" => Etc.nprocessors, "ruby" => RUBY_VERSION,
+                       "time" => Time.now.utc.to_s },
+           "scenarios" => results }
+FileUtils.mkdir_p(File.dirname(options[:out]))
+File.open(options[:out], "w") { |f| f.write(JSON.pretty_generate(report) + "\n") }
+puts "wrote #{options[:out]}"
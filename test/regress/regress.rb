@@ -0,0 +1,327 @@
+# Golden-corpus regression and benchmark for Imgproc
+#
+#   ruby test/regress/regress.rb check         accuracy and golden outputs
+#   ruby test/regress/regress.rb record        rewrite golden.json
+#   ruby test/regress/regress.rb bench         throughput against baseline.json
+#   ruby test/regress/regress.rb bench-record  rewrite baseline.json
+#
+# The corpus (corpus.json) is drawn by SheetGenerator into test/regress/tmp,
+# so only its description is checked in.  Every sheet is read through
+# readFiles (raw, classified, warp-free, with the profile frame engine and
+# subsampled) and prepShowImage, whose output is read back with
+# readNormalized, classified again into a result store and all at once
+# through readSheets.  check fails if a classified sheet disagrees with the
+# marks it was drawn with, or if any output differs from golden.json.  bench
+# fails if sheets per second or any per-stage time per sheet is more than
+# BENCH_TOLERANCE (default 0.15) worse than baseline.json.  Run the best of
+# REGRESS_REPEAT (default 3) passes.
+#
+# Both files are recorded on a build host with OpenCV and checked in.  On a
+# checkout without them, check records golden.json once every other check
+# has passed (the drawn marks vouch for the outputs), and bench records
+# baseline.json; either way it says so, and the file should be committed.
+
+require 'json'
+require 'fileutils'
+
+DIR = File.expand_path(File.dirname(__FILE__))
+require File.join(DIR, 'sheet_generator')
+require File.join(DIR, '..', '..', 'lib', 'Imgproc')
+require File.join(DIR, '..', '..', 'lib', 'ResultStore')
+
+CORPUS = File.join(DIR, 'corpus.json')
+GOLDEN = File.join(DIR, 'golden.json')
+BASELINE = File.join(DIR, 'baseline.json')
+WORK = File.join(DIR, 'tmp')
+
+# Raw fill ratios may drift this much before a golden mismatch is reported
+RATIO_TOLERANCE = 1e-4
+
+# Stage times below this many seconds per sheet are noise, not regressions
+STAGE_FLOOR = 0.002
+
+MODES = ["plain", "classify", "warpFree", "profile", "approximate"]
+
+def load_corpus
+  corpus = JSON.parse(File.read(CORPUS))
+  FileUtils.mkdir_p(WORK)
+  corpus["sheets"].each do |spec|
+    spec["path"] = File.join(WORK, spec["id"] + ".pgm")
+    # Regenerated when the corpus description changes
+    stamp = spec["path"] + ".json"
+    desc = JSON.generate(spec.merge("scale" => corpus["scale"]))
+    next if File.exist?(spec["path"]) && File.exist?(stamp) && File.read(stamp) == desc
+    SheetGenerator.draw(spec, corpus["scale"], spec["path"])
+    File.open(stamp, "w") { |f| f.write(desc) }
+  end
+  corpus["sheets"]
+end
+
+# Sheets sharing a question count and name flag go through one readFiles call
+def groups(sheets)
+  sheets.group_by { |spec| [spec["questions"], !spec["name"].nil?] }
+end
+
+def read_options(mode)
+  case mode
+  when "classify" then { :classify => true }
+  when "warpFree" then { :classify => true, :warpFree => true }
+  when "profile" then { :classify => true, :frame => :profile }
+  when "approximate" then { :classify => true, :approximate => true }
+  else {}
+  end
+end
+
+# Outputs of every sheet in every mode, keyed "<id>/<mode>"
+def read_corpus(iproc, sheets)
+  outputs = {}
+  groups(sheets).each do |(numQ, readName), group|
+    paths = group.map { |spec| spec["path"] }
+    MODES.each do |mode|
+      results = iproc.readFiles(paths, numQ, readName, read_options(mode))
+      group.each_with_index do |spec, i|
+        outputs["#{spec["id"]}/#{mode}"] = JSON.parse(JSON.generate(results[i]))
+      end
+    end
+  end
+  outputs
+end
+
+def prep_corpus(iproc, sheets)
+  failures = []
+  sheets.each do |spec|
+    next if spec["expectError"]
+    out = File.join(WORK, spec["id"] + "-prep.png")
+    [out, out + ".geom"].each { |f| File.delete(f) if File.exist?(f) }
+    begin
+      iproc.prepShowImage(spec["path"], out)
+    rescue IOError => e
+      failures << "#{spec["id"]}: #{e.message}"
+      next
+    end
+    failures << "#{spec["id"]}: prepShowImage wrote nothing" unless File.size?(out)
+    failures << "#{spec["id"]}: prepShowImage wrote no geometry" unless File.size?(out + ".geom")
+  end
+  failures
+end
+
+# prepShowImage output read back through readNormalized, whole and for the
+# last question alone
+def normalized_failures(iproc, sheets)
+  failures = []
+  sheets.each do |spec|
+    next if spec["expectError"]
+    out = File.join(WORK, spec["id"] + "-prep.png")
+    numQ = spec["questions"]
+    expected = SheetGenerator.answers(spec).map { |a| SheetGenerator.code(a) }
+    whole = iproc.readNormalized([out], numQ, !spec["name"].nil?, :classify => true)[0]
+    one = iproc.readNormalized([out], numQ, false, :classify => true,
+                               :questions => [numQ - 1])[0]
+    if whole[:status] != 0
+      failures << "#{spec["id"]} (normalized): status #{whole[:status]} #{whole[:reason]}"
+    elsif whole[:answers] != expected
+      failures << "#{spec["id"]} (normalized): answers differ from the drawn marks"
+    elsif spec["name"] && whole[:name] != SheetGenerator.name_codes(spec["name"])
+      failures << "#{spec["id"]} (normalized): name read #{whole[:name].inspect}"
+    end
+    if one[:status] != 0 || one[:answers] != [expected.last]
+      failures << "#{spec["id"]} (normalized): question #{numQ} alone read #{one[:answers].inspect}"
+    end
+  end
+  failures
+end
+
+# Classified results appended to a result store, whole batches and
+# streamed, then read back against the classify outputs
+def store_failures(iproc, sheets, outputs)
+  path = File.join(WORK, "corpus.gsr")
+  File.delete(path) if File.exist?(path)
+  groups(sheets).each do |(numQ, readName), group|
+    paths = group.map { |spec| spec["path"] }
+    iproc.readFiles(paths, numQ, readName, :classify => true, :store => path,
+                    :sheets => false)
+    iproc.eachResult(paths, numQ, readName, :classify => true, :store => path) {}
+  end
+  store = ResultStore.new(path)
+  failures = []
+  if store.size != 2 * sheets.size
+    failures << "store: #{store.size} sheets, read #{2 * sheets.size}"
+  end
+  store.each do |stored|
+    spec = sheets.find { |s| s["path"] == stored[:filename] }
+    got = spec && outputs["#{spec["id"]}/classify"]
+    if got.nil?
+      failures << "store: unknown sheet #{stored[:filename]}"
+    elsif stored[:status] != got["status"] || (got["status"] == 0 &&
+          (stored[:answers] != got["answers"] || (spec["name"] && stored[:name] != got["name"])))
+      failures << "#{spec["id"]} (store): differs from the classify output"
+    end
+  end
+  store.close
+  failures
+end
+
+# The whole corpus in one readSheets call, every other sheet passed in
+# memory, against the classify outputs
+def mixed_failures(iproc, sheets, outputs)
+  specs = sheets.each_with_index.map do |spec, i|
+    sheet = { :numQ => spec["questions"], :readName => !spec["name"].nil? }
+    if i.odd? && File.exist?(spec["path"])
+      sheet.merge(:data => File.binread(spec["path"]))
+    else
+      sheet.merge(:path => spec["path"])
+    end
+  end
+  results = iproc.readSheets(specs, :classify => true)
+  failures = []
+  sheets.each_with_index do |spec, i|
+    got = JSON.parse(JSON.generate(results[i]))
+    unless same?(got, outputs["#{spec["id"]}/classify"])
+      failures << "#{spec["id"]} (mixed): differs from the classify output"
+    end
+  end
+  failures
+end
+
+# Classified results against the marks each sheet was drawn with
+def accuracy_failures(sheets, outputs)
+  failures = []
+  sheets.each do |spec|
+    ["classify", "warpFree", "profile", "approximate"].each do |mode|
+      got = outputs["#{spec["id"]}/#{mode}"]
+      label = "#{spec["id"]} (#{mode})"
+      if spec["expectError"]
+        failures << "#{label}: read a sheet that should fail" if got["status"] == 0
+        failures << "#{label}: failed without a reason" if got["status"] != 0 && got["reason"].nil?
+        next
+      end
+      if got["status"] != 0
+        failures << "#{label}: status #{got["status"]}"
+        next
+      end
+      expected = SheetGenerator.answers(spec).map { |a| SheetGenerator.code(a) }
+      expected.each_with_index do |code, q|
+        if got["answers"][q] != code
+          failures << "#{label}: question #{q + 1} read #{got["answers"][q]}, drawn #{code}"
+        end
+      end
+      if spec["name"] && got["name"] != SheetGenerator.name_codes(spec["name"])
+        failures << "#{label}: name read #{got["name"].inspect}"
+      end
+    end
+  end
+  failures
+end
+
+def same?(a, b)
+  if a.is_a?(Array) && b.is_a?(Array)
+    a.size == b.size && a.zip(b).all? { |x, y| same?(x, y) }
+  elsif a.is_a?(Hash) && b.is_a?(Hash)
+    a.keys.sort == b.keys.sort && a.keys.all? { |k| same?(a[k], b[k]) }
+  elsif a.is_a?(Float) || b.is_a?(Float)
+    a.is_a?(Numeric) && b.is_a?(Numeric) && (a - b).abs <= RATIO_TOLERANCE
+  else
+    a == b
+  end
+end
+
+# Records golden.json instead if there is none and record is true
+def golden_failures(outputs, record)
+  unless File.exist?(GOLDEN)
+    return ["no #{File.basename(GOLDEN)}, and not recorded from a failing build"] unless record
+    write_json(GOLDEN, outputs)
+    puts "recorded the golden outputs; commit #{File.basename(GOLDEN)}"
+    return []
+  end
+  golden = JSON.parse(File.read(GOLDEN))
+  failures = []
+  (golden.keys | outputs.keys).sort.each do |key|
+    failures << "#{key}: differs from golden output" unless same?(golden[key], outputs[key])
+  end
+  failures
+end
+
+# Best-of-N throughput and per-sheet stage times over the whole corpus
+def bench(iproc, sheets)
+  repeat = (ENV["REGRESS_REPEAT"] || 3).to_i
+  best = nil
+  repeat.times do
+    stages = Hash.new(0.0)
+    count = 0
+    start = Time.now
+    groups(sheets).each do |(numQ, readName), group|
+      iproc.readFiles(group.map { |spec| spec["path"] }, numQ, readName)
+      timings = iproc.stageTimings
+      count += timings.delete(:sheets)
+      # Stage times are Floats; the rest are sheet counts
+      timings.each { |stage, seconds| stages[stage.to_s] += seconds if seconds.is_a?(Float) }
+    end
+    elapsed = Time.now - start
+    run = { "sheetsPerSecond" => count / elapsed, "stages" => {} }
+    stages.each { |stage, seconds| run["stages"][stage] = seconds / count }
+    best = run if best.nil? || run["sheetsPerSecond"] > best["sheetsPerSecond"]
+  end
+  best
+end
+
+# Records baseline.json instead if there is none
+def bench_failures(result)
+  unless File.exist?(BASELINE)
+    write_json(BASELINE, result)
+    puts "recorded the baseline; commit #{File.basename(BASELINE)} if this is the reference host"
+    return []
+  end
+  baseline = JSON.parse(File.read(BASELINE))
+  tolerance = (ENV["BENCH_TOLERANCE"] || 0.15).to_f
+  failures = []
+  floor = baseline["sheetsPerSecond"] * (1 - tolerance)
+  if result["sheetsPerSecond"] < floor
+    failures << format("throughput %.2f sheets/s, baseline %.2f",
+                       result["sheetsPerSecond"], baseline["sheetsPerSecond"])
+  end
+  baseline["stages"].each do |stage, seconds|
+    now = result["stages"][stage] || 0
+    if now > [seconds * (1 + tolerance), STAGE_FLOOR].max
+      failures << format("%s %.4fs/sheet, baseline %.4fs", stage, now, seconds)
+    end
+  end
+  failures
+end
+
+def report(failures)
+  failures.each { |f| puts "FAIL #{f}" }
+  puts failures.empty? ? "ok" : "#{failures.size} failure(s)"
+  exit(failures.empty? ? 0 : 1)
+end
+
+def write_json(path, data)
+  File.open(path, "w") { |f| f.write(JSON.pretty_generate(data) + "\n") }
+  puts "wrote #{path}"
+end
+
+mode = ARGV[0] || "check"
+iproc = Imgproc.new
+sheets = load_corpus
+
+case mode
+when "check"
+  outputs = read_corpus(iproc, sheets)
+  failures = accuracy_failures(sheets, outputs) + prep_corpus(iproc, sheets) +
+             normalized_failures(iproc, sheets) + store_failures(iproc, sheets, outputs) +
+             mixed_failures(iproc, sheets, outputs)
+  report(failures + golden_failures(outputs, failures.empty?))
+when "record"
+  outputs = read_corpus(iproc, sheets)
+  failures = accuracy_failures(sheets, outputs)
+  report(failures) unless failures.empty?
+  write_json(GOLDEN, outputs)
+when "bench"
+  result = bench(iproc, sheets)
+  puts format("%.2f sheets/s", result["sheetsPerSecond"])
+  result["stages"].sort.each { |stage, s| puts format("  %-10s %.4fs/sheet", stage, s) }
+  report(bench_failures(result))
+when "bench-record"
+  write_json(BASELINE, bench(iproc, sheets))
+else
+  abort "usage: regress.rb check|record|bench|bench-record"
+end
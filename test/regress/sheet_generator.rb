@@ -0,0 +1,226 @@
+# SheetGenerator - Draws synthetic GradeSnap answer sheets as PGM images
+#
+# The page geometry mirrors the base layout constants in ImageReader.cpp
+# (frame corners, question and name box offsets), so a generated sheet
+# reads back to exactly the marks it was drawn with.  Everything is
+# deterministic: the same spec always produces the same bytes.
+
+class SheetGenerator
+
+  # Base page, in pixels of the 300dpi layout ImageReader is tuned for
+  PAGE_WIDTH = 2550
+  PAGE_HEIGHT = 3300
+
+  # Frame corners (mainUL / mainLR) and border thickness
+  FRAME_LEFT = 88
+  FRAME_TOP = 214
+  FRAME_RIGHT = 2436
+  FRAME_BOTTOM = 3214
+  FRAME_THICKNESS = 14
+
+  # Orientation box, just inside the upper-left frame corner
+  BOX_OFFSET = 24
+  BOX_SIZE = 80
+
+  # Question boxes
+  QBOX_X = 154
+  QBOX_Y = 445
+  QBOX_X_STEP = 304
+  QBOX_Y_STEP = 86.5
+  QBOX_WIDTH = 225
+  QBOX_HEIGHT = 68
+  QUESTIONS_PER_COLUMN = 25
+
+  # Name columns
+  NBOX_X = 1404
+  NBOX_Y = 433
+  NBOX_X_STEP = 45.3
+  NBOX_FIRST2MI = 80
+  NBOX_MI2LAST = 84
+  NBOX_WIDTH = 40
+  NBOX_HEIGHT = 2262
+  NAME_COLUMNS = 17
+
+  PAPER = 235
+  INK = 25
+
+  attr_reader :width, :height
+
+  def initialize(scale)
+    @scale = scale
+    @width = (PAGE_WIDTH * scale).round
+    @height = (PAGE_HEIGHT * scale).round
+    @rows = Array.new(@height) { (PAPER.chr * @width).force_encoding("BINARY") }
+  end
+
+  # Answers of a corpus entry: its "answers" list, or "questions" answers
+  # drawn from "seed" with some blanks, double marks and erasures mixed in
+  def self.answers(spec)
+    return spec["answers"] if spec["answers"]
+    rng = Random.new(spec["seed"] || 1)
+    letters = %w(A B C D E)
+    Array.new(spec["questions"].to_i) do
+      pick = letters.sample(2, random: rng)
+      case rng.rand(100)
+      when 0...8 then ""
+      when 8...14 then pick.sort.join
+      when 14...20 then pick[0] + pick[1].downcase
+      else pick[0]
+      end
+    end
+  end
+
+  # Bitmask code of an answer (1 = A ... 16 = E), as classify reports it
+  def self.code(answer)
+    answer.scan(/[A-E]/).inject(0) { |bits, letter| bits | 1 << (letter.ord - "A".ord) }
+  end
+
+  # Letter index per name column (-1 blank), as classify reports it
+  def self.name_codes(name)
+    Array.new(NAME_COLUMNS) do |i|
+      letter = name.to_s[i]
+      letter && letter =~ /[A-Z]/ ? letter.ord - "A".ord : -1
+    end
+  end
+
+  # Draws a sheet from a corpus entry (see corpus.json) and writes it to path
+  def self.draw(spec, scale, path)
+    if spec["corrupt"]
+      File.open(path, "wb") { |f| f.write("P5\n#{PAGE_WIDTH} #{PAGE_HEIGHT}\n255\n\0\0\0") }
+      return
+    end
+    gen = new(scale)
+    unless spec["blankPage"]
+      gen.frame
+      gen.questions(answers(spec))
+      gen.name(spec["name"]) if spec["name"]
+    end
+    gen.noise(spec["noise"], spec["seed"] || 1) if spec["noise"]
+    gen.skew(spec["skew"]) if spec["skew"]
+    (spec["rotate"].to_i / 90 % 4).times { gen.rotate90 }
+    gen.write(path)
+  end
+
+  def frame
+    t = FRAME_THICKNESS
+    fill_rect(FRAME_LEFT, FRAME_TOP, FRAME_RIGHT - FRAME_LEFT, t)
+    fill_rect(FRAME_LEFT, FRAME_BOTTOM - t, FRAME_RIGHT - FRAME_LEFT, t)
+    fill_rect(FRAME_LEFT, FRAME_TOP, t, FRAME_BOTTOM - FRAME_TOP)
+    fill_rect(FRAME_RIGHT - t, FRAME_TOP, t, FRAME_BOTTOM - FRAME_TOP)
+    fill_rect(FRAME_LEFT + BOX_OFFSET, FRAME_TOP + BOX_OFFSET, BOX_SIZE, BOX_SIZE)
+  end
+
+  # answers: one entry per question.  Capital letters are filled bubbles
+  # ("AC" is a double mark), lower case letters are faint partial marks
+  # (erasures) and "" is blank
+  def questions(answers)
+    cell = QBOX_WIDTH / 5.0
+    answers.each_with_index do |answer, q|
+      x = FRAME_LEFT + QBOX_X + (q / QUESTIONS_PER_COLUMN) * QBOX_X_STEP
+      y = FRAME_TOP + QBOX_Y + (q % QUESTIONS_PER_COLUMN) * QBOX_Y_STEP
+      5.times do |a|
+        cx = x + (a + 0.5) * cell
+        cy = y + QBOX_HEIGHT / 2.0
+        letter = ("A".ord + a).chr
+        if answer.include?(letter)
+          fill_ellipse(cx, cy, 21, 31, INK)
+        elsif answer.include?(letter.downcase)
+          fill_ellipse(cx, cy, 11, 15, 140)
+        else
+          ring(cx, cy, 16, 2)
+        end
+      end
+    end
+  end
+
+  # name: up to 17 letters, spaces for blank columns
+  def name(letters)
+    x = FRAME_LEFT + NBOX_X
+    cell = NBOX_HEIGHT / 26.0
+    NAME_COLUMNS.times do |i|
+      letter = letters[i]
+      if letter && letter =~ /[A-Z]/
+        row = letter.ord - "A".ord
+        fill_ellipse(x + NBOX_WIDTH / 2.0, FRAME_TOP + NBOX_Y + (row + 0.5) * cell,
+                     19, 38, INK)
+      end
+      x += i == 7 ? NBOX_FIRST2MI : (i == 8 ? NBOX_MI2LAST : NBOX_X_STEP)
+    end
+  end
+
+  # Scatters density * pixels random specks
+  def noise(density, seed)
+    rng = Random.new(seed)
+    (density * @width * @height).to_i.times do
+      @rows[rng.rand(@height)].setbyte(rng.rand(@width), rng.rand(256))
+    end
+  end
+
+  # Rotates the page by a small angle (degrees) about its center
+  def skew(degrees)
+    rad = degrees * Math::PI / 180
+    cos, sin = Math.cos(rad), Math.sin(rad)
+    cx, cy = @width / 2.0, @height / 2.0
+    src = @rows
+    @rows = Array.new(@height) do |y|
+      row = (PAPER.chr * @width).force_encoding("BINARY")
+      dy = y - cy
+      @width.times do |x|
+        dx = x - cx
+        sx = (cx + dx * cos + dy * sin).round
+        sy = (cy - dx * sin + dy * cos).round
+        row.setbyte(x, src[sy].getbyte(sx)) if sx >= 0 && sy >= 0 && sx < @width && sy < @height
+      end
+      row
+    end
+  end
+
+  # Rotates the page a quarter turn clockwise
+  def rotate90
+    src = @rows
+    w, h = @width, @height
+    @rows = Array.new(w) do |y|
+      row = ("\0" * h).force_encoding("BINARY")
+      h.times { |x| row.setbyte(x, src[h - 1 - x].getbyte(y)) }
+      row
+    end
+    @width, @height = h, w
+  end
+
+  def write(path)
+    File.open(path, "wb") do |f|
+      f.write("P5\n#{@width} #{@height}\n255\n")
+      @rows.each { |row| f.write(row) }
+    end
+  end
+
+  private
+
+  def fill_rect(x, y, w, h, value = INK)
+    x0, y0 = (x * @scale).round, (y * @scale).round
+    x1, y1 = ((x + w) * @scale).round, ((y + h) * @scale).round
+    span = (value.chr * (x1 - x0)).force_encoding("BINARY")
+    (y0...y1).each { |row| @rows[row][x0, x1 - x0] = span }
+  end
+
+  def fill_ellipse(cx, cy, rx, ry, value)
+    cx, cy, rx, ry = cx * @scale, cy * @scale, rx * @scale, ry * @scale
+    ((cy - ry).ceil..(cy + ry).floor).each do |row|
+      half = rx * Math.sqrt([1 - ((row - cy) / ry)**2, 0].max)
+      x0, x1 = (cx - half).round, (cx + half).round
+      next if x1 <= x0
+      @rows[row][x0, x1 - x0] = (value.chr * (x1 - x0)).force_encoding("BINARY")
+    end
+  end
+
+  def ring(cx, cy, r, thickness)
+    cx, cy, r, t = cx * @scale, cy * @scale, r * @scale, [thickness * @scale, 1].max
+    ((cy - r).floor..(cy + r).ceil).each do |row|
+      ((cx - r).floor..(cx + r).ceil).each do |col|
+        d = Math.hypot(col - cx, row - cy)
+        @rows[row].setbyte(col, INK) if d <= r && d >= r - t
+      end
+    end
+  end
+
+end
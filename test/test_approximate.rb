@@ -0,0 +1,68 @@
+require 'helper'
+
+# readFiles :approximate against an exact read of the same sheets.  An
+# estimate only stands when its error bound cannot change the answer or its
+# ambiguity; everything else is scored exactly
+class TestApproximate < Test::Unit::TestCase
+
+  NUM_QUESTIONS = 100
+
+  def setup
+    @iproc = Imgproc.new
+    # Blanks, double marks and erasures, as the regression corpus draws them
+    @paths = [1, 2, 3].map do |seed|
+      sheet("questions" => NUM_QUESTIONS, "seed" => seed, "name" => "SUBSAMPLED  SHEET")
+    end
+  end
+
+  def read(opts = {})
+    @iproc.readFiles(@paths, NUM_QUESTIONS, true, opts.merge(:classify => true))
+  end
+
+  def test_estimates_classify_as_the_exact_read
+    exact = read
+    [true, 2, 8, 16].each do |stride|
+      read(:approximate => stride).each_with_index do |approx, i|
+        label = "sheet #{i}, stride #{stride}"
+        assert_equal 0, approx[:status], label
+        assert_equal exact[i][:answers], approx[:answers], label
+        assert_equal exact[i][:ambiguousAnswers], approx[:ambiguousAnswers], label
+        assert_equal exact[i][:name], approx[:name], label
+        assert_equal exact[i][:ambiguousName], approx[:ambiguousName], label
+      end
+    end
+  end
+
+  def test_unsettled_questions_are_scored_exactly
+    exact = read
+    read(:approximate => true).each_with_index do |approx, i|
+      estimated = approx[:approximateAnswers] || 0
+      NUM_QUESTIONS.times do |q|
+        next if estimated[q] == 1
+        assert_in_delta exact[i][:confidence][q], approx[:confidence][q], 1e-6,
+          "sheet #{i}, question #{q + 1}"
+      end
+      estimatedName = approx[:approximateName] || 0
+      exact[i][:nameConfidence].each_with_index do |confidence, l|
+        next if estimatedName[l] == 1
+        assert_in_delta confidence, approx[:nameConfidence][l], 1e-6, "sheet #{i}, letter #{l + 1}"
+      end
+    end
+  end
+
+  def test_exact_reads_flag_nothing
+    [read, read(:approximate => 1)].each do |results|
+      results.each do |sheet|
+        assert_nil sheet[:approximateAnswers]
+        assert_nil sheet[:approximateName]
+      end
+    end
+  end
+
+  def test_approximate_needs_classify
+    assert_raise(ArgumentError) do
+      @iproc.readFiles(@paths, NUM_QUESTIONS, true, :approximate => true)
+    end
+  end
+
+end
@@ -0,0 +1,73 @@
+require 'helper'
+
+# Fill counts of the bit-packed page (BitPage.h) as readFiles reports them.
+# Bubbles fall at every offset within a 64-pixel word across the columns
+# of a full sheet, so a masking or popcount slip shows up as a misread
+class TestBitPage < Test::Unit::TestCase
+
+  NUM_QUESTIONS = 100
+
+  # Single marks cycling through the columns, five marks and blanks mixed in
+  ANSWERS = Array.new(NUM_QUESTIONS) do |q|
+    case q % 7
+    when 5 then "ABCDE"
+    when 6 then ""
+    else ("A".ord + q % 5).chr
+    end
+  end
+
+  def setup
+    @iproc = Imgproc.new
+    @path = sheet("answers" => ANSWERS)
+  end
+
+  def read(opts = {})
+    @iproc.readFiles([@path], NUM_QUESTIONS, false, opts)[0]
+  end
+
+  def test_counts_read_the_drawn_marks
+    result = read(:classify => true)
+    assert_equal 0, result[:status]
+    assert_equal codes(ANSWERS), result[:answers]
+  end
+
+  def test_fill_ratios
+    rows = read[0...NUM_QUESTIONS]
+    assert_equal NUM_QUESTIONS, rows.size
+    rows.each_with_index do |fills, q|
+      assert_equal 5, fills.size
+      code = SheetGenerator.code(ANSWERS[q])
+      fills.each_with_index do |fill, a|
+        label = "question #{q + 1}, choice #{a + 1}"
+        assert_operator fill, :>=, 0.0, label
+        if code[a] == 1
+          assert_operator fill, :>=, 0.5, label
+        else
+          assert_operator fill, :<, 0.5, label
+        end
+      end
+    end
+  end
+
+  def test_cell_pages_count_as_the_whole_page
+    whole = read(:classify => true)
+    cells = read(:classify => true, :warpFree => true)
+    assert_equal whole[:answers], cells[:answers]
+  end
+
+  def test_stride_one_counts_every_pixel
+    assert_equal read, read(:approximate => 1)
+  end
+
+  def test_strides_must_be_powers_of_two
+    [0, 3, 6, 32].each do |stride|
+      assert_raise(ArgumentError, "stride #{stride}") do
+        read(:classify => true, :approximate => stride)
+      end
+    end
+    [2, 8, 16].each do |stride|
+      assert_equal 0, read(:classify => true, :approximate => stride)[:status]
+    end
+  end
+
+end
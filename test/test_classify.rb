@@ -0,0 +1,80 @@
+require 'helper'
+
+# readFiles :classify against the raw fills it classifies and the
+# thresholds that steer it
+class TestClassify < Test::Unit::TestCase
+
+  # A mark, a blank, a double mark, an erasure and five marks
+  ANSWERS = ["A", "", "BD", "c", "ABCDE", "E"]
+
+  NAME = "AB  Z"
+
+  def setup
+    @iproc = Imgproc.new
+    @path = sheet("answers" => ANSWERS, "name" => NAME)
+  end
+
+  def classify(opts = {})
+    result = @iproc.readFiles([@path], ANSWERS.size, true, opts.merge(:classify => true))[0]
+    assert_equal 0, result[:status]
+    result
+  end
+
+  # The selection rule of ImageReader::classifyAnswer, on raw fills
+  def expected(fills, fillThreshold, marginThreshold)
+    selected = (0...fills.size).select { |a| fills[a] >= fillThreshold }
+    code = selected.inject(0) { |bits, a| bits | 1 << a }
+    weakest = selected.empty? ? fillThreshold : selected.map { |a| fills[a] }.min
+    strongest = ((0...fills.size).to_a - selected).map { |a| fills[a] }.max || 0.0
+    confidence = [[weakest - strongest, 0.0].max, 1.0].min
+    [code, confidence, selected.size > 1 || confidence < marginThreshold]
+  end
+
+  def test_default_thresholds_read_the_drawn_marks
+    result = classify
+    assert_equal codes(ANSWERS), result[:answers]
+    assert_equal SheetGenerator.name_codes(NAME), result[:name]
+    # Two or more marks are ambiguous; a clean mark or blank is not
+    assert_equal (1 << 2) | (1 << 4), result[:ambiguousAnswers]
+    result[:confidence].each { |c| assert_operator c, :>=, 0.0; assert_operator c, :<=, 1.0 }
+  end
+
+  def test_thresholds_follow_the_raw_fills
+    raw = @iproc.readFiles([@path], ANSWERS.size, true)[0][0...ANSWERS.size]
+    [0.25, 0.5, 0.75].each do |fillThreshold|
+      [0.0625, 0.25, 0.5].each do |marginThreshold|
+        result = classify(:fillThreshold => fillThreshold, :marginThreshold => marginThreshold)
+        raw.each_with_index do |fills, q|
+          code, confidence, ambiguous = expected(fills, fillThreshold, marginThreshold)
+          label = "question #{q + 1} at #{fillThreshold}/#{marginThreshold}"
+          assert_equal code, result[:answers][q], label
+          assert_in_delta confidence, result[:confidence][q], 1e-5, label
+          # Too close to the margin to tell float rounding from a flip
+          next if (confidence - marginThreshold).abs < 1e-5
+          assert_equal ambiguous, result[:ambiguousAnswers][q] == 1, label
+        end
+      end
+    end
+  end
+
+  def test_unreachable_fill_threshold_reads_blank
+    result = classify(:fillThreshold => 1.01)
+    assert_equal [0] * ANSWERS.size, result[:answers]
+    assert_equal [-1] * SheetGenerator::NAME_COLUMNS, result[:name]
+  end
+
+  def test_margin_threshold_sets_ambiguity
+    assert_equal (1 << 2) | (1 << 4), classify(:marginThreshold => 0.0)[:ambiguousAnswers]
+    # No fill gap reaches a whole cell, so everything is too close to call
+    assert_equal (1 << ANSWERS.size) - 1, classify(:marginThreshold => 1.0)[:ambiguousAnswers]
+    assert_equal (1 << SheetGenerator::NAME_COLUMNS) - 1,
+      classify(:marginThreshold => 1.0)[:ambiguousName]
+  end
+
+  def test_blank_confidence_is_the_gap_to_the_fill_threshold
+    low = classify(:fillThreshold => 0.5)[:confidence][1]
+    high = classify(:fillThreshold => 0.75)[:confidence][1]
+    assert_in_delta 0.25, high - low, 1e-5
+  end
+
+end
@@ -0,0 +1,92 @@
+require 'helper'
+
+# readFiles :key grading and the item statistics it gathers per version
+class TestGrading < Test::Unit::TestCase
+
+  KEY = ["A", "B", "C", "D", "E"]
+
+  # Scores 5, 3, 2 and 2 against KEY
+  SHEETS = [
+    ["A", "B", "C", "D", "E"],
+    ["A", "B", "C", "", ""],
+    ["A", "", "AB", "D", "B"],
+    ["B", "B", "E", "", "E"]
+  ]
+
+  def setup
+    @iproc = Imgproc.new
+    @paths = SHEETS.map { |answers| sheet("answers" => answers) }
+  end
+
+  def grade(key)
+    @iproc.readFiles(@paths, KEY.size, false, :classify => true, :key => key)
+  end
+
+  # The histogram bin of an answer: A-E, then blank, then multiple marks
+  def bin(code)
+    return 5 if code == 0
+    return 6 if code & (code - 1) != 0
+    Math.log2(code).to_i
+  end
+
+  def test_scores_and_sheets
+    graded = grade(codes(KEY))
+    assert_equal [5.0, 3.0, 2.0, 2.0], graded[:scores]
+    assert_equal SHEETS.map { |answers| codes(answers) },
+      graded[:sheets].map { |sheet| sheet[:answers] }
+  end
+
+  def test_item_statistics
+    stats = grade(codes(KEY))[:stats]
+    assert_equal 1, stats.size
+    stats = stats[0]
+    scores = [5.0, 3.0, 2.0, 2.0]
+    assert_equal SHEETS.size, stats[:sheets]
+    assert_equal KEY.size.to_f, stats[:maxScore]
+    assert_in_delta scores.inject(:+), stats[:sumScore], 1e-9
+    assert_in_delta scores.map { |s| s * s }.inject(:+), stats[:sumScoreSq], 1e-9
+
+    mean = scores.inject(:+) / scores.size
+    deviation = Math.sqrt(scores.map { |s| s * s }.inject(:+) / scores.size - mean * mean)
+    KEY.each_index do |q|
+      drawn = SHEETS.map { |answers| SheetGenerator.code(answers[q]) }
+      histogram = [0] * 7
+      drawn.each { |code| histogram[bin(code)] += 1 }
+      assert_equal histogram, stats[:histogram][q], "question #{q + 1}"
+
+      correct = (0...SHEETS.size).select { |s| drawn[s] == SheetGenerator.code(KEY[q]) }
+      assert_equal correct.size, stats[:numCorrect][q]
+      assert_in_delta correct.size.to_f / SHEETS.size, stats[:difficulty][q], 1e-6
+      assert_in_delta correct.map { |s| scores[s] }.inject(0.0, :+), stats[:sumScoreCorrect][q], 1e-9
+
+      # (M1 - M) / s * sqrt(p / (1 - p)), 0 when everyone or no one is right
+      p = correct.size.to_f / SHEETS.size
+      expected = if p == 0 || p == 1
+        0.0
+      else
+        meanCorrect = correct.map { |s| scores[s] }.inject(:+) / correct.size
+        (meanCorrect - mean) / deviation * Math.sqrt(p / (1 - p))
+      end
+      assert_in_delta expected, stats[:pointBiserial][q], 1e-5, "question #{q + 1}"
+    end
+  end
+
+  def test_weights_and_versions
+    other = ["A", "B", "C", "", ""]
+    graded = grade(:versions => [codes(KEY), codes(other)],
+                   :weights => [[2, 1, 1, 1, 1], [1, 1, 1, 3, 3]],
+                   :sheetVersions => [0, 1, 0, 1])
+    # Blanks a key leaves blank are right answers too
+    assert_equal [6.0, 9.0, 3.0, 4.0], graded[:scores]
+    assert_equal [2, 2], graded[:stats].map { |stats| stats[:sheets] }
+    assert_equal [6.0, 9.0], graded[:stats].map { |stats| stats[:maxScore] }
+  end
+
+  def test_bad_keys_raise
+    assert_raise(ArgumentError) do
+      grade(:versions => [codes(KEY)], :sheetVersions => [0, 1])
+    end
+    assert_raise(ArgumentError) { grade([]) }
+  end
+
+end
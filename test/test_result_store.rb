@@ -0,0 +1,93 @@
+require 'helper'
+require 'tmpdir'
+require 'ResultStore'
+
+# Batches readFiles appends with :store, read back through ResultStore.rb
+class TestResultStore < Test::Unit::TestCase
+
+  KEY = ["A", "B", "C", "D", "E"]
+
+  SHEETS = [
+    ["A", "B", "C", "D", "E"],
+    ["E", "", "AB", "D", "c"],
+    ["", "", "", "", ""]
+  ]
+
+  def setup
+    @iproc = Imgproc.new
+    @paths = SHEETS.map { |answers| sheet("answers" => answers, "name" => "STORE") }
+    @dir = Dir.mktmpdir("gsimgproc-store")
+    @store = File.join(@dir, "batch.gsr")
+  end
+
+  def teardown
+    FileUtils.rm_rf(@dir)
+  end
+
+  def append(paths = @paths)
+    @iproc.readFiles(paths, KEY.size, true, :classify => true, :key => codes(KEY),
+                     :store => @store)
+  end
+
+  def open_store
+    store = ResultStore.new(@store)
+    yield store
+  ensure
+    store.close if store
+  end
+
+  def test_round_trip
+    graded = append
+    open_store do |store|
+      assert_equal SHEETS.size, store.size
+      store.each_with_index do |stored, i|
+        read = graded[:sheets][i]
+        assert_equal @paths[i], stored[:filename]
+        assert_equal i, stored[:sheet]
+        assert_equal 0, stored[:status]
+        assert_equal read[:answers], stored[:answers]
+        assert_equal read[:name], stored[:name]
+        assert_equal graded[:scores][i], stored[:score]
+        read[:confidence].zip(stored[:confidence]).each { |c, s| assert_in_delta c, s, 1e-6 }
+        assert_equal KEY.size, stored[:fills].size
+      end
+      assert_equal store[0], store[-SHEETS.size]
+      assert_nil store[SHEETS.size]
+    end
+  end
+
+  def test_failed_sheets_keep_their_reason
+    @iproc.readFiles([File.join(@dir, "missing.pgm")] + @paths, KEY.size, true,
+                     :classify => true, :store => @store)
+    open_store do |store|
+      assert_equal SHEETS.size + 1, store.size
+      assert_not_equal 0, store[0][:status]
+      assert_equal :unreadableFile, store[0][:reason]
+      assert_nil store[1][:reason]
+    end
+  end
+
+  def test_torn_tail_is_ignored_then_truncated
+    append
+    whole = File.binread(@store)
+    # Half of another copy of the batch's segment: a crash mid-append
+    segment = whole.byteslice(ResultStore::HEADER_SIZE..-1)
+    File.open(@store, "ab") { |f| f.write(segment.byteslice(0, segment.bytesize / 2)) }
+    open_store { |store| assert_equal SHEETS.size, store.size }
+
+    # The next writer cuts the torn segment off before appending
+    append(@paths.reverse)
+    assert_equal whole.bytesize + segment.bytesize, File.size(@store)
+    open_store do |store|
+      assert_equal 2 * SHEETS.size, store.size
+      assert_equal @paths + @paths.reverse, store.map { |stored| stored[:filename] }
+    end
+  end
+
+  def test_other_files_are_not_stores
+    File.open(@store, "wb") { |f| f.write("not a result store") }
+    assert_raise(ArgumentError) { ResultStore.new(@store) }
+    assert_raise(IOError) { append }
+  end
+
+end